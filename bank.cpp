@@ -0,0 +1,297 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bank.h"
+
+// Offset of the first (modulator) operator of channels 0-8 within a bank
+static const uint8_t kOperatorOffset[9] = {
+	0x00, 0x01, 0x02,
+	0x08, 0x09, 0x0a,
+	0x10, 0x11, 0x12,
+};
+
+static const uint8_t kOperatorReg[BANK_REG_COUNT] = {
+	0x20, 0x40, 0x60, 0x80, 0xe0
+};
+
+static const size_t kSbiSize = 47;
+static const size_t kOp2InstrumentSize = 36;
+static const size_t kOp2Instruments = 175;
+static const size_t kOp2Melodic = 128;
+static const uint16_t kOp2FixedPitch = 0x0001;
+static const uint16_t kOp2DoubleVoice = 0x0004;
+static const size_t kWoplHeaderSize = 19;
+static const size_t kWoplBankMetaSize = 34;
+static const uint8_t kWoplFourOp = 0x01;
+static const uint8_t kWoplPseudoFourOp = 0x02;
+static const uint8_t kWoplBlank = 0x04;
+
+static uint16_t read_le16(const uint8_t * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t * p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t read_be16(const uint8_t * p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void write_le16(uint8_t * p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void write_le32(uint8_t * p, uint32_t v)
+{
+	write_le16(p, v & 0xffff);
+	write_le16(p + 2, v >> 16);
+}
+
+static void copy_name(char * dst, const uint8_t * src, size_t len)
+{
+	memset(dst, 0, kBankNameSize);
+	memcpy(dst, src, len < kBankNameSize ? len : kBankNameSize);
+	dst[kBankNameSize - 1] = 0;
+}
+
+static int read_file(const char * path, std::vector<uint8_t> &data)
+{
+	FILE * f = fopen(path, "rb");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data.resize(size > 0 ? size : 0);
+	size_t got = data.empty() ? 0 : fread(data.data(), 1, data.size(), f);
+	fclose(f);
+	if (got != data.size()) {
+		fprintf(stderr, "Could not read %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+// SBI: one 2-op instrument, registers interleaved modulator/carrier
+static int import_sbi(const std::vector<uint8_t> &data, std::vector<bank_entry_t> &entries)
+{
+	if (data.size() < kSbiSize)
+		return -1;
+	const uint8_t * p = data.data() + 36;
+	bank_entry_t e{};
+	copy_name(e.name, data.data() + 4, 32);
+	for (int op = 0; op < 2; op++) {
+		for (int r = 0; r < BANK_REG_COUNT; r++)
+			e.instrument.regs[op][r] = p[r * 2 + op];
+	}
+	e.instrument.c0[0] = p[10];
+	entries.push_back(e);
+	return 0;
+}
+
+// One half of a GENMIDI instrument: modulator, feedback, carrier, base note offset
+static void import_op2_voice(const uint8_t * v, bank_instrument_t &ins, int half)
+{
+	for (int op = 0; op < 2; op++) {
+		const uint8_t * o = v + op * 7;
+		uint8_t * regs = ins.regs[half * 2 + op];
+		regs[BANK_REG_20] = o[0];
+		regs[BANK_REG_60] = o[1];
+		regs[BANK_REG_80] = o[2];
+		regs[BANK_REG_E0] = o[3];
+		regs[BANK_REG_40] = (o[4] & 0xc0) | (o[5] & 0x3f);
+	}
+	ins.c0[half] = v[6];
+	ins.note_offset[half] = (int8_t)(int16_t)read_le16(v + 14);
+}
+
+static int import_op2(const std::vector<uint8_t> &data, std::vector<bank_entry_t> &entries)
+{
+	size_t names = 8 + kOp2Instruments * kOp2InstrumentSize;
+	if (data.size() < names + kOp2Instruments * kBankNameSize)
+		return -1;
+	for (size_t i = 0; i < kOp2Instruments; i++) {
+		const uint8_t * p = data.data() + 8 + i * kOp2InstrumentSize;
+		bank_entry_t e{};
+		uint16_t flags = read_le16(p);
+		e.instrument.fine_tune = (int8_t)(p[2] - 128);
+		e.instrument.fixed_note = p[3];
+		if ((flags & kOp2FixedPitch) || i >= kOp2Melodic)
+			e.instrument.flags |= BANK_FIXED_NOTE;
+		if (flags & kOp2DoubleVoice)
+			e.instrument.flags |= BANK_DOUBLE_VOICE;
+		import_op2_voice(p + 4, e.instrument, 0);
+		import_op2_voice(p + 4 + 16, e.instrument, 1);
+		copy_name(e.name, data.data() + names + i * kBankNameSize, kBankNameSize);
+		entries.push_back(e);
+	}
+	return 0;
+}
+
+// WOPL versions 1 to 3, melodic banks first then percussion banks, 128 instruments each
+static int import_wopl(const std::vector<uint8_t> &data, std::vector<bank_entry_t> &entries)
+{
+	if (data.size() < kWoplHeaderSize)
+		return -1;
+	const uint8_t * p = data.data();
+	uint16_t version = read_le16(p + 11);
+	size_t banks = read_be16(p + 13) + read_be16(p + 15);
+	size_t offset = kWoplHeaderSize;
+	if (version >= 2)
+		offset += banks * kWoplBankMetaSize;
+	size_t size = version >= 3 ? 66 : 62;
+	if (version < 1 || version > 3 || data.size() < offset + banks * 128 * size)
+		return -1;
+	for (size_t i = 0; i < banks * 128; i++) {
+		const uint8_t * w = p + offset + i * size;
+		bank_entry_t e{};
+		copy_name(e.name, w, 32);
+		uint8_t flags = w[39];
+		e.instrument.note_offset[0] = (int8_t)(int16_t)read_be16(w + 32);
+		e.instrument.note_offset[1] = (int8_t)(int16_t)read_be16(w + 34);
+		e.instrument.fine_tune = (int8_t)w[37];
+		e.instrument.fixed_note = w[38];
+		if (flags & kWoplFourOp)
+			e.instrument.flags |= (flags & kWoplPseudoFourOp) ? BANK_DOUBLE_VOICE : BANK_FOUR_OP;
+		if (flags & kWoplBlank)
+			e.instrument.flags |= BANK_BLANK;
+		if (i >= read_be16(p + 13) * 128u)
+			e.instrument.flags |= BANK_FIXED_NOTE;
+		e.instrument.c0[0] = w[40];
+		e.instrument.c0[1] = w[41];
+		// WOPL stores carrier before modulator
+		static const int order[4] = { 1, 0, 3, 2 };
+		for (int op = 0; op < 4; op++)
+			memcpy(e.instrument.regs[op], w + 42 + order[op] * 5, BANK_REG_COUNT);
+		entries.push_back(e);
+	}
+	return 0;
+}
+
+int bank_import(const char * path, std::vector<bank_entry_t> &entries)
+{
+	std::vector<uint8_t> data;
+	if (0 != read_file(path, data))
+		return -1;
+	int ret = -1;
+	if (data.size() >= 4 && memcmp(data.data(), "SBI\x1a", 4) == 0) {
+		ret = import_sbi(data, entries);
+	} else if (data.size() >= 8 && memcmp(data.data(), "#OPL_II#", 8) == 0) {
+		ret = import_op2(data, entries);
+	} else if (data.size() >= 11 && memcmp(data.data(), "WOPL3-BANK", 11) == 0) {
+		ret = import_wopl(data, entries);
+	} else {
+		fprintf(stderr, "%s: unknown instrument format\n", path);
+		return -1;
+	}
+	if (ret != 0)
+		fprintf(stderr, "%s: truncated or unsupported file\n", path);
+	return ret;
+}
+
+int bank_write(const char * path, const std::vector<bank_entry_t> &entries)
+{
+	uint32_t count = entries.size();
+	uint32_t names = kBankHeaderSize + count * sizeof(bank_instrument_t);
+	std::vector<uint8_t> data(names + count * kBankNameSize);
+	memcpy(data.data(), kBankMagic, 4);
+	write_le16(data.data() + 4, kBankVersion);
+	write_le32(data.data() + 8, count);
+	write_le32(data.data() + 12, names);
+	for (uint32_t i = 0; i < count; i++) {
+		memcpy(data.data() + kBankHeaderSize + i * sizeof(bank_instrument_t), &entries[i].instrument, sizeof(bank_instrument_t));
+		memcpy(data.data() + names + i * kBankNameSize, entries[i].name, kBankNameSize);
+	}
+	FILE * f = fopen(path, "wb");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not create %s\n", path);
+		return -1;
+	}
+	size_t written = fwrite(data.data(), 1, data.size(), f);
+	if (fclose(f) != 0 || written != data.size()) {
+		fprintf(stderr, "Could not write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int bank_open(bank_t &bank, const char * path)
+{
+	bank = bank_t{};
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	struct stat st;
+	void * map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= kBankHeaderSize)
+		map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s\n", path);
+		return -1;
+	}
+	const uint8_t * data = (const uint8_t*)map;
+	size_t size = st.st_size;
+	uint32_t count = read_le32(data + 8);
+	uint32_t names = read_le32(data + 12);
+	if (memcmp(data, kBankMagic, 4) != 0 || read_le16(data + 4) != kBankVersion ||
+		names < kBankHeaderSize + (uint64_t)count * sizeof(bank_instrument_t) ||
+		names + (uint64_t)count * kBankNameSize > size) {
+		fprintf(stderr, "%s is not a valid bank\n", path);
+		munmap(map, size);
+		return -1;
+	}
+	bank.data = data;
+	bank.size = size;
+	bank.count = count;
+	bank.instruments = (const bank_instrument_t*)(data + kBankHeaderSize);
+	bank.names = (const char*)(data + names);
+	return 0;
+}
+
+void bank_close(bank_t &bank)
+{
+	if (bank.data != nullptr)
+		munmap((void*)bank.data, bank.size);
+	bank = bank_t{};
+}
+
+const char * bank_name(const bank_t &bank, uint32_t index)
+{
+	return bank.names + index * kBankNameSize;
+}
+
+void bank_apply(const bank_instrument_t &ins, DBOPL::Handler &synth, uint8_t channel)
+{
+	DBOPL::RegWrite writes[2 * (2 * BANK_REG_COUNT + 1)];
+	int count = 0;
+	int halves = (ins.flags & BANK_FOUR_OP) ? 2 : 1;
+	// Route to both speakers when the chip runs in opl3 mode
+	uint8_t stereo = synth.chip.opl3Active ? 0x30 : 0;
+	for (int h = 0; h < halves; h++) {
+		uint8_t ch = channel + h * 3;
+		uint16_t bank = (ch / 9) << 8;
+		for (int op = 0; op < 2; op++) {
+			const uint8_t * regs = ins.regs[h * 2 + op];
+			uint16_t offset = kOperatorOffset[ch % 9] + op * 3;
+			for (int r = 0; r < BANK_REG_COUNT; r++)
+				writes[count++] = { (uint16_t)(bank | (kOperatorReg[r] + offset)), regs[r] };
+		}
+		writes[count++] = { (uint16_t)(bank | (0xc0 + ch % 9)), (uint8_t)(ins.c0[h] | stereo) };
+	}
+	synth.WriteRegs(writes, count);
+}
@@ -0,0 +1,90 @@
+#ifndef OPERATIC_BANK_H
+#define OPERATIC_BANK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "dbopl.h"
+
+// Instrument banks stored as ready to write register blocks.
+//
+// A bank file is memory mapped as is, nothing gets parsed on load. Layout,
+// all integers little endian:
+//
+//   0   char     magic[4]        "OPBK"
+//   4   uint16   version         kBankVersion
+//   6   uint16   reserved
+//   8   uint32   count           number of instruments
+//   12  uint32   names_offset    start of the name table
+//   16  bank_instrument_t[count]
+//   names_offset  char[count][32] NUL padded instrument names
+//
+// Operator registers are kept in chip order: the modulator and carrier of
+// the first channel, then those of the second channel of a 4-op or double
+// voice instrument.
+
+static const char kBankMagic[4] = { 'O', 'P', 'B', 'K' };
+static const uint16_t kBankVersion = 1;
+static const size_t kBankHeaderSize = 16;
+static const size_t kBankNameSize = 32;
+
+enum bank_flags
+{
+	BANK_FOUR_OP = 0x01,      // both halves form one 4-op voice
+	BANK_DOUBLE_VOICE = 0x02, // both halves play as two 2-op voices
+	BANK_FIXED_NOTE = 0x04,   // always play fixed_note, percussion
+	BANK_BLANK = 0x80,        // empty slot kept to preserve numbering
+};
+
+enum bank_operator_reg
+{
+	BANK_REG_20,
+	BANK_REG_40,
+	BANK_REG_60,
+	BANK_REG_80,
+	BANK_REG_E0,
+	BANK_REG_COUNT
+};
+
+struct bank_instrument_t
+{
+	uint8_t flags;
+	uint8_t fixed_note;
+	int8_t note_offset[2];    // semitones, per half
+	int8_t fine_tune;         // detune of the second voice
+	uint8_t c0[2];            // feedback and connection, per half
+	uint8_t regs[4][BANK_REG_COUNT];
+	uint8_t reserved[5];
+};
+
+static_assert(sizeof(bank_instrument_t) == 32, "bank instruments must stay 32 bytes");
+
+struct bank_entry_t
+{
+	bank_instrument_t instrument;
+	char name[kBankNameSize];
+};
+
+struct bank_t
+{
+	const uint8_t * data;
+	size_t size;
+	uint32_t count;
+	const bank_instrument_t * instruments;
+	const char * names;
+};
+
+// Import SBI, OP2 (DMX GENMIDI) or WOPL files, the format is detected from the contents
+int bank_import(const char * path, std::vector<bank_entry_t> &entries);
+int bank_write(const char * path, const std::vector<bank_entry_t> &entries);
+
+int bank_open(bank_t &bank, const char * path);
+void bank_close(bank_t &bank);
+const char * bank_name(const bank_t &bank, uint32_t index);
+
+// Write the instrument registers of a 2-op instrument to a register channel
+// (0-17) or of a 4-op instrument to the channel and its partner 3 channels up
+void bank_apply(const bank_instrument_t &ins, DBOPL::Handler &synth, uint8_t channel);
+
+#endif
@@ -38,6 +38,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <mutex>
 #include "dbopl.h"
 
 
@@ -181,6 +182,10 @@ static Bit16u ChanOffsetTable[32];
 //Start of an operator behind the chip struct start
 static Bit16u OpOffsetTable[64];
 
+//Noise generator state after 2^n steps, split up in a table for every nibble of the current state
+#define NOISE_JUMPS 24
+static Bit32u NoiseJumpTable[ NOISE_JUMPS ][ 6 ][ 16 ];
+
 //The lower bits are the shift of the operator vibrato value
 //The highest bit is right shifted to generate -1 or 0 for negation
 //So taking the highest input value of 7 this gives 3, 7, 3, 0, -3, -7, -3, 0
@@ -280,6 +285,65 @@ static const WaveHandler WaveHandlerTable[8] = {
 
 #endif
 
+#if DBOPL_COUNTERS
+//Every thread that touches the emulator gets a record in this list, exiting threads fold
+//theirs into retiredCounters so the totals never go down
+struct CounterThread {
+	Counters counters;
+	CounterThread* next;
+	CounterThread();
+	~CounterThread();
+};
+
+static std::mutex counterLock;
+static CounterThread* counterThreads = 0;
+static Counters retiredCounters;
+
+static void AddCounters( Counters& total, const Counters& add ) {
+	Bit64u* to = (Bit64u*)&total;
+	const Bit64u* from = (const Bit64u*)&add;
+	for ( Bitu i = 0; i < sizeof( Counters ) / sizeof( Bit64u ); i++ ) {
+		to[i] += from[i];
+	}
+}
+
+CounterThread::CounterThread() {
+	memset( &counters, 0, sizeof( counters ) );
+	std::lock_guard< std::mutex > guard( counterLock );
+	next = counterThreads;
+	counterThreads = this;
+}
+
+CounterThread::~CounterThread() {
+	std::lock_guard< std::mutex > guard( counterLock );
+	AddCounters( retiredCounters, counters );
+	for ( CounterThread** link = &counterThreads; *link; link = &(*link)->next ) {
+		if ( *link == this ) {
+			*link = next;
+			break;
+		}
+	}
+}
+
+static thread_local CounterThread counterThread;
+
+const Counters& ThreadCounters() {
+	return counterThread.counters;
+}
+
+void CollectCounters( Counters& total ) {
+	std::lock_guard< std::mutex > guard( counterLock );
+	total = retiredCounters;
+	for ( CounterThread* thread = counterThreads; thread; thread = thread->next ) {
+		AddCounters( total, thread->counters );
+	}
+}
+
+#define DBOPL_COUNT( _COUNTER_, _AMOUNT_ ) ( counterThread.counters._COUNTER_ += ( _AMOUNT_ ) )
+#else
+#define DBOPL_COUNT( _COUNTER_, _AMOUNT_ ) ( (void)0 )
+#endif
+
 /*
 	Operator
 */
@@ -357,6 +421,14 @@ void Operator::UpdateFrequency(  ) {
 	}
 }
 
+void Operator::UpdateRateTables( const Chip* chip ) {
+	freqMul = chip->freqMul[ reg20 & 0xf ];
+	UpdateFrequency();
+	UpdateAttack( chip );
+	UpdateDecay( chip );
+	UpdateRelease( chip );
+}
+
 void Operator::UpdateRates( const Chip* chip ) {
 	//Mame seems to reverse this where enabling ksr actually lowers
 	//the rate, but pdf manuals says otherwise?
@@ -440,7 +512,11 @@ static const VolumeHandler VolumeHandlerTable[5] = {
 };
 
 INLINE Bitu Operator::ForwardVolume() {
+#if DBOPL_COMPACT
+	return currentLevel + (this->*VolumeHandlerTable[ state ])();
+#else
 	return currentLevel + (this->*volHandler)();
+#endif
 }
 
 
@@ -459,7 +535,11 @@ void Operator::Write20( const Chip* chip, Bit8u val ) {
 	tremoloMask &= ~(( 1 << ENV_EXTRA ) -1);
 	//Update specific features based on changes
 	if ( change & MASK_KSR ) {
-		UpdateRates( chip );
+		if ( chip->deferUpdates ) {
+			dirty |= DIRTY_RATES;
+		} else {
+			UpdateRates( chip );
+		}
 	}
 	//With sustain enable the volume doesn't change
 	if ( reg20 & MASK_SUSTAIN || ( !releaseAdd ) ) {
@@ -470,15 +550,23 @@ void Operator::Write20( const Chip* chip, Bit8u val ) {
 	//Frequency multiplier or vibrato changed
 	if ( change & (0xf | MASK_VIBRATO) ) {
 		freqMul = chip->freqMul[ val & 0xf ];
-		UpdateFrequency();
+		if ( chip->deferUpdates ) {
+			dirty |= DIRTY_FREQUENCY;
+		} else {
+			UpdateFrequency();
+		}
 	}
 }
 
-void Operator::Write40( const Chip* /*chip*/, Bit8u val ) {
+void Operator::Write40( const Chip* chip, Bit8u val ) {
 	if (!(reg40 ^ val )) 
 		return;
 	reg40 = val;
-	UpdateAttenuation( );
+	if ( chip->deferUpdates ) {
+		dirty |= DIRTY_ATTENUATION;
+	} else {
+		UpdateAttenuation( );
+	}
 }
 
 void Operator::Write60( const Chip* chip, Bit8u val ) {
@@ -512,6 +600,10 @@ void Operator::WriteE0( const Chip* chip, Bit8u val ) {
 	//in opl3 mode you can always selet 7 waveforms regardless of waveformselect
 	Bit8u waveForm = val & ( ( 0x3 & chip->waveFormMask ) | (0x7 & chip->opl3Active ) );
 	regE0 = val;
+	SetWaveForm( waveForm );
+}
+
+void Operator::SetWaveForm( Bit8u waveForm ) {
 #if ( DBOPL_WAVE == WAVE_HANDLER )
 	waveHandler = WaveHandlerTable[ waveForm ];
 #else
@@ -521,9 +613,26 @@ void Operator::WriteE0( const Chip* chip, Bit8u val ) {
 #endif
 }
 
+//The wave form last selected, regE0 can't tell when opl3 mode changed since
+Bit8u Operator::WaveForm() const {
+	for ( Bit8u i = 0; i < 8; i++ ) {
+#if ( DBOPL_WAVE == WAVE_HANDLER )
+		if ( waveHandler == WaveHandlerTable[ i ] )
+			return i;
+#else
+		if ( waveBase == WaveTable + WaveBaseTable[ i ] && waveMask == WaveMaskTable[ i ] &&
+			waveStart == (Bit32u)( WaveStartTable[ i ] << WAVE_SH ) )
+			return i;
+#endif
+	}
+	return 0;
+}
+
 INLINE void Operator::SetState( Bit8u s ) {
 	state = s;
+#if !DBOPL_COMPACT
 	volHandler = VolumeHandlerTable[ s ];
+#endif
 }
 
 INLINE bool Operator::Silent() const {
@@ -534,13 +643,85 @@ INLINE bool Operator::Silent() const {
 	return true;
 }
 
-INLINE void Operator::Prepare( const Chip* chip )  {
-	currentLevel = totalLevel + (chip->tremoloValue & tremoloMask);
+//Silent and the envelope can't leave its current state, so the volume stays put for the whole block
+INLINE bool Operator::Idle() const {
+	if ( !Silent() )
+		return false;
+	switch ( state ) {
+	case DECAY:
+		return volume < sustainLevel;
+	case SUSTAIN:
+		if ( reg20 & MASK_SUSTAIN )
+			return true;
+		return volume < ENV_MAX;
+	case RELEASE:
+		return volume < ENV_MAX;
+	default:
+		return true;
+	}
+}
+
+//Attenuated by at least level and can only get quieter until the next register write
+INLINE bool Operator::Inaudible( Bit32s level ) const {
+	return state != ATTACK && totalLevel + volume >= level;
+}
+
+//Move phase and envelope along as if samples were generated, without generating any
+void Operator::Skip( Bitu samples ) {
+	waveIndex += waveCurrent * (Bit32u)samples;
+	while ( samples ) {
+		Bit32u add;
+		Bit32s limit;
+		switch ( state ) {
+		case ATTACK:
+			ForwardVolume();
+			samples--;
+			continue;
+		case DECAY:
+			add = decayAdd;
+			limit = sustainLevel;
+			break;
+		case SUSTAIN:
+			if ( reg20 & MASK_SUSTAIN )
+				return;
+			add = releaseAdd;
+			limit = ENV_MAX;
+			break;
+		case RELEASE:
+			add = releaseAdd;
+			limit = ENV_MAX;
+			break;
+		default:
+			return;
+		}
+		//Samples until the one that reaches the limit and changes state, the ones before it
+		//only add to the volume and can be done in one go
+		Bitu steps = 1;
+		if ( volume < limit ) {
+			if ( !add )
+				return;
+			uint64_t need = ( (uint64_t)( limit - volume ) << RATE_SH ) - rateIndex;
+			steps = ( need + add - 1 ) / add;
+		}
+		Bitu bulk = steps <= samples ? steps - 1 : samples;
+		uint64_t total = rateIndex + (uint64_t)add * bulk;
+		volume += (Bit32s)( total >> RATE_SH );
+		rateIndex = (Bit32u)( total & RATE_MASK );
+		samples -= bulk;
+		if ( samples ) {
+			ForwardVolume();
+			samples--;
+		}
+	}
+}
+
+INLINE void Operator::Prepare( const LFORun& run )  {
+	currentLevel = totalLevel + (run.tremoloValue & tremoloMask);
 	waveCurrent = waveAdd;
-	if ( vibStrength >> chip->vibratoShift ) {
-		Bit32s add = vibrato >> chip->vibratoShift;
+	if ( vibStrength >> run.vibratoShift ) {
+		Bit32s add = vibrato >> run.vibratoShift;
 		//Sign extend over the shift value
-		Bit32s neg = chip->vibratoSign;
+		Bit32s neg = run.vibratoSign;
 		//Negate the add with -1 or 0
 		add = ( add ^ neg ) - neg; 
 		waveCurrent += add;
@@ -587,7 +768,8 @@ INLINE Bits Operator::GetWave( Bitu index, Bitu vol ) {
 #endif
 }
 
-Bits INLINE Operator::GetSample( Bits modulation ) {
+template< bool sineOnly >
+Bits INLINE Operator::TemplateSample( Bits modulation ) {
 	Bitu vol = ForwardVolume();
 	if ( ENV_SILENT( vol ) ) {
 		//Simply forward the wave
@@ -596,10 +778,27 @@ Bits INLINE Operator::GetSample( Bits modulation ) {
 	} else {
 		Bitu index = ForwardWave();
 		index += modulation;
+#if ( DBOPL_WAVE == WAVE_TABLEMUL )
+		//The sine starts the wave table
+		if ( sineOnly )
+			return (WaveTable[ index & 1023 ] * MulTable[ vol >> ENV_EXTRA ]) >> MUL_SH;
+#endif
 		return GetWave( index, vol );
 	}
 }
 
+Bits INLINE Operator::GetSample( Bits modulation ) {
+	return TemplateSample< false >( modulation );
+}
+
+INLINE bool Operator::IsSine() const {
+#if ( DBOPL_WAVE == WAVE_TABLEMUL )
+	return waveBase == WaveTable + WaveBaseTable[ 0 ];
+#else
+	return false;
+#endif
+}
+
 Operator::Operator() {
 	chanData = 0;
 	freqMul = 0;
@@ -607,6 +806,7 @@ Operator::Operator() {
 	waveAdd = 0;
 	waveCurrent = 0;
 	keyOn = 0;
+	dirty = 0;
 	ksr = 0;
 	reg20 = 0;
 	reg40 = 0;
@@ -635,6 +835,7 @@ Channel::Channel() {
 	maskRight = -1;
 	feedback = 31;
 	fourMask = 0;
+	dirty = 0;
 	synthHandler = &Channel::BlockTemplate< sm2FM >;
 }
 
@@ -682,7 +883,11 @@ void Channel::WriteA0( const Chip* chip, Bit8u val ) {
 	Bit32u change = (chanData ^ val ) & 0xff;
 	if ( change ) {
 		chanData ^= change;
-		UpdateFrequency( chip, fourOp );
+		if ( chip->deferUpdates ) {
+			dirty |= DIRTY_FREQUENCY;
+		} else {
+			UpdateFrequency( chip, fourOp );
+		}
 	}
 }
 
@@ -694,7 +899,11 @@ void Channel::WriteB0( const Chip* chip, Bit8u val ) {
 	Bitu change = (chanData ^ ( val << 8 ) ) & 0x1f00;
 	if ( change ) {
 		chanData ^= change;
-		UpdateFrequency( chip, fourOp );
+		if ( chip->deferUpdates ) {
+			dirty |= DIRTY_FREQUENCY;
+		} else {
+			UpdateFrequency( chip, fourOp );
+		}
 	}
 	//Check for a change in the keyon/off state
 	if ( !(( val ^ regB0) & 0x20))
@@ -730,7 +939,11 @@ void Channel::WriteC0(const Chip* chip, Bit8u val) {
 	else {
 		feedback = 31;
 	}
-	UpdateSynth(chip);
+	if ( chip->deferUpdates ) {
+		dirty |= DIRTY_SYNTH;
+	} else {
+		UpdateSynth(chip);
+	}
 }
 
 void Channel::UpdateSynth( const Chip* chip ) {
@@ -788,188 +1001,291 @@ void Channel::UpdateSynth( const Chip* chip ) {
 	}
 }
 
-template< bool opl3Mode>
-INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
+template< bool opl3Mode, bool bassDrum, bool hihatSnare, bool tomCymbal >
+void Channel::PercussionBlock( Chip* chip, Bitu start, Bitu end, Bit32s* output ) {
 	Channel* chan = this;
+	for ( Bitu i = start; i < end; i++ ) {
+		Bit32s sample = 0;
+		if ( bassDrum ) {
+			Bit32s mod = (Bit32u)((old[0] + old[1])) >> feedback;
+			old[0] = old[1];
+			old[1] = Op(0)->GetSample( mod ); 
+
+			//When bassdrum is in AM mode first operator is ignoed
+			if ( chan->regC0 & 1 ) {
+				mod = 0;
+			} else {
+				mod = old[0];
+			}
+			sample = Op(1)->GetSample( mod ); 
+		}
 
-	//BassDrum
-	Bit32s mod = (Bit32u)((old[0] + old[1])) >> feedback;
-	old[0] = old[1];
-	old[1] = Op(0)->GetSample( mod ); 
+		Bit32s sample7 = 0;
+		Bit32s sample8 = 0;
+		if ( hihatSnare || tomCymbal ) {
+			//Precalculate stuff used by other outputs
+			Bit32u c2 = Op(2)->ForwardWave();
+			Bit32u c5 = Op(5)->ForwardWave();
+			Bit32u phaseBit = (((c2 & 0x88) ^ ((c2<<5) & 0x80)) | ((c5 ^ (c5<<2)) & 0x20)) ? 0x02 : 0x00;
+
+			//Hi-Hat and Snare Drum belong to channel 7
+			if ( hihatSnare ) {
+				Bit32u noiseBit = chip->ForwardNoise() & 0x1;
+				Bit32u hhVol = Op(2)->ForwardVolume();
+				if ( !ENV_SILENT( hhVol ) ) {
+					Bit32u hhIndex = (phaseBit<<8) | (0x34 << ( phaseBit ^ (noiseBit << 1 )));
+					sample7 += Op(2)->GetWave( hhIndex, hhVol );
+				}
+				Bit32u sdVol = Op(3)->ForwardVolume();
+				if ( !ENV_SILENT( sdVol ) ) {
+					Bit32u sdIndex = ( 0x100 + (c2 & 0x100) ) ^ ( noiseBit << 8 );
+					sample7 += Op(3)->GetWave( sdIndex, sdVol );
+				}
+			}
+			//Tom-tom and Top-Cymbal belong to channel 8
+			if ( tomCymbal ) {
+				sample8 = Op(4)->GetSample( 0 );
+				Bit32u tcVol = Op(5)->ForwardVolume();
+				if ( !ENV_SILENT( tcVol ) ) {
+					Bit32u tcIndex = (1 + phaseBit) << 8;
+					sample8 += Op(5)->GetWave( tcIndex, tcVol );
+				}
+			}
+		}
+		Bitu index = opl3Mode ? i * 2 : i;
+		//Split the voices over the stems of their own channels when requested
+		if ( GCC_UNLIKELY( chip->percussionStems[0] != 0 ) ) {
+			Bit32s* stem7 = chip->percussionStems[0] + index;
+			Bit32s* stem8 = chip->percussionStems[1] + index;
+			sample <<= 1;
+			sample7 <<= 1;
+			sample8 <<= 1;
+			stem7[0] += sample7;
+			stem8[0] += sample8;
+			if ( opl3Mode ) {
+				stem7[1] += sample7;
+				stem8[1] += sample8;
+			}
+		} else {
+			sample = ( sample + sample7 + sample8 ) << 1;
+		}
+		if ( opl3Mode ) {
+			output[index + 0] += sample;
+			output[index + 1] += sample;
+		} else {
+			output[index] += sample;
+		}
+	}
+	//Idle operators only need their phase moved along to stay where the sample loop would have left them
+	Bitu samples = end - start;
+	if ( !bassDrum ) {
+		old[0] = samples > 1 ? 0 : old[1];
+		old[1] = 0;
+		Op(0)->waveIndex += Op(0)->waveCurrent * (Bit32u)samples;
+		Op(1)->waveIndex += Op(1)->waveCurrent * (Bit32u)samples;
+	}
+	if ( !hihatSnare && !tomCymbal ) {
+		Op(2)->waveIndex += Op(2)->waveCurrent * (Bit32u)samples;
+		Op(5)->waveIndex += Op(5)->waveCurrent * (Bit32u)samples;
+	}
+	if ( !hihatSnare ) {
+		chip->SkipNoise( samples );
+	}
+	if ( !tomCymbal ) {
+		Op(4)->waveIndex += Op(4)->waveCurrent * (Bit32u)samples;
+	}
+}
 
-	//When bassdrum is in AM mode first operator is ignoed
-	if ( chan->regC0 & 1 ) {
-		mod = 0;
-	} else {
-		mod = old[0];
-	}
-	Bit32s sample = Op(1)->GetSample( mod ); 
-
-
-	//Precalculate stuff used by other outputs
-	Bit32u noiseBit = chip->ForwardNoise() & 0x1;
-	Bit32u c2 = Op(2)->ForwardWave();
-	Bit32u c5 = Op(5)->ForwardWave();
-	Bit32u phaseBit = (((c2 & 0x88) ^ ((c2<<5) & 0x80)) | ((c5 ^ (c5<<2)) & 0x20)) ? 0x02 : 0x00;
-
-	//Hi-Hat
-	Bit32u hhVol = Op(2)->ForwardVolume();
-	if ( !ENV_SILENT( hhVol ) ) {
-		Bit32u hhIndex = (phaseBit<<8) | (0x34 << ( phaseBit ^ (noiseBit << 1 )));
-		sample += Op(2)->GetWave( hhIndex, hhVol );
-	}
-	//Snare Drum
-	Bit32u sdVol = Op(3)->ForwardVolume();
-	if ( !ENV_SILENT( sdVol ) ) {
-		Bit32u sdIndex = ( 0x100 + (c2 & 0x100) ) ^ ( noiseBit << 8 );
-		sample += Op(3)->GetWave( sdIndex, sdVol );
-	}
-	//Tom-tom
-	sample += Op(4)->GetSample( 0 );
-
-	//Top-Cymbal
-	Bit32u tcVol = Op(5)->ForwardVolume();
-	if ( !ENV_SILENT( tcVol ) ) {
-		Bit32u tcIndex = (1 + phaseBit) << 8;
-		sample += Op(5)->GetWave( tcIndex, tcVol );
-	}
-	sample <<= 1;
-	if ( opl3Mode ) {
-		output[0] += sample;
-		output[1] += sample;
-	} else {
-		output[0] += sample;
+template< bool opl3Mode >
+INLINE void Channel::GeneratePercussion( Chip* chip, Bitu start, Bitu end, Bit32s* output ) {
+	//Pick a kernel that leaves out the drum pairs that can't be heard
+	Bitu playing = 0;
+	if ( !Op(0)->Idle() || !Op(1)->Idle() )
+		playing |= 1;
+	if ( !Op(2)->Idle() || !Op(3)->Idle() )
+		playing |= 2;
+	if ( !Op(4)->Idle() || !Op(5)->Idle() )
+		playing |= 4;
+	switch ( playing ) {
+	case 0: PercussionBlock< opl3Mode, false, false, false >( chip, start, end, output ); break;
+	case 1: PercussionBlock< opl3Mode, true, false, false >( chip, start, end, output ); break;
+	case 2: PercussionBlock< opl3Mode, false, true, false >( chip, start, end, output ); break;
+	case 3: PercussionBlock< opl3Mode, true, true, false >( chip, start, end, output ); break;
+	case 4: PercussionBlock< opl3Mode, false, false, true >( chip, start, end, output ); break;
+	case 5: PercussionBlock< opl3Mode, true, false, true >( chip, start, end, output ); break;
+	case 6: PercussionBlock< opl3Mode, false, true, true >( chip, start, end, output ); break;
+	case 7: PercussionBlock< opl3Mode, true, true, true >( chip, start, end, output ); break;
 	}
 }
 
 template<SynthMode mode>
-Channel* Channel::BlockTemplate( Chip* chip, Bit32u samples, Bit32s* output ) {
+INLINE bool Channel::Culled( Bit32s level ) {
 	switch( mode ) {
 	case sm2AM:
 	case sm3AM:
-		if ( Op(0)->Silent() && Op(1)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 1);
-		}
-		break;
+		return Op(0)->Inaudible( level ) && Op(1)->Inaudible( level );
 	case sm2FM:
 	case sm3FM:
-		if ( Op(1)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 1);
-		}
-		break;
+		return Op(1)->Inaudible( level );
 	case sm3FMFM:
-		if ( Op(3)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 2);
-		}
-		break;
+		return Op(3)->Inaudible( level );
 	case sm3AMFM:
-		if ( Op(0)->Silent() && Op(3)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 2);
-		}
-		break;
+		return Op(0)->Inaudible( level ) && Op(3)->Inaudible( level );
 	case sm3FMAM:
-		if ( Op(1)->Silent() && Op(3)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 2);
-		}
-		break;
+		return Op(1)->Inaudible( level ) && Op(3)->Inaudible( level );
 	case sm3AMAM:
-		if ( Op(0)->Silent() && Op(2)->Silent() && Op(3)->Silent() ) {
-			old[0] = old[1] = 0;
-			return (this + 2);
-		}
-		break;
+		return Op(0)->Inaudible( level ) && Op(2)->Inaudible( level ) && Op(3)->Inaudible( level );
 	default:
-		break;
-	}
-	//Init the operators with the the current vibrato and tremolo values
-	Op( 0 )->Prepare( chip );
-	Op( 1 )->Prepare( chip );
-	if ( mode > sm4Start ) {
-		Op( 2 )->Prepare( chip );
-		Op( 3 )->Prepare( chip );
-	}
-	if ( mode > sm6Start ) {
-		Op( 4 )->Prepare( chip );
-		Op( 5 )->Prepare( chip );
+		return false;
 	}
-	for ( Bitu i = 0; i < samples; i++ ) {
-		//Early out for percussion handlers
-		if ( mode == sm2Percussion ) {
-			GeneratePercussion<false>( chip, output + i );
-			continue;	//Prevent some unitialized value bitching
-		} else if ( mode == sm3Percussion ) {
-			GeneratePercussion<true>( chip, output + i * 2 );
-			continue;	//Prevent some unitialized value bitching
-		}
+}
 
-		//Do unsigned shift so we can shift out all bits but still stay in 10 bit range otherwise
-		Bit32s mod = (Bit32u)((old[0] + old[1])) >> feedback;
-		old[0] = old[1];
-		old[1] = Op(0)->GetSample( mod );
-		Bit32s sample;
-		Bit32s out0 = old[0];
-		if ( mode == sm2AM || mode == sm3AM ) {
-			sample = out0 + Op(1)->GetSample( 0 );
-		} else if ( mode == sm2FM || mode == sm3FM ) {
-			sample = Op(1)->GetSample( out0 );
-		} else if ( mode == sm3FMFM ) {
-			Bits next = Op(1)->GetSample( out0 ); 
-			next = Op(2)->GetSample( next );
-			sample = Op(3)->GetSample( next );
-		} else if ( mode == sm3AMFM ) {
-			sample = out0;
-			Bits next = Op(1)->GetSample( 0 ); 
-			next = Op(2)->GetSample( next );
-			sample += Op(3)->GetSample( next );
-		} else if ( mode == sm3FMAM ) {
-			sample = Op(1)->GetSample( out0 );
-			Bits next = Op(2)->GetSample( 0 );
-			sample += Op(3)->GetSample( next );
-		} else if ( mode == sm3AMAM ) {
-			sample = out0;
-			Bits next = Op(1)->GetSample( 0 ); 
-			sample += Op(2)->GetSample( next );
-			sample += Op(3)->GetSample( 0 );
-		}
+//Kept out of line, inlining all the variants into BlockTemplate makes the compiler give up on the inner loop
+template<SynthMode mode, bool hasLFO, bool hasFeedback, bool sineOnly>
+DB_NOINLINE void Channel::BlockKernel( Chip* chip, Bit32u samples, Bit32s* output ) {
+	const LFORun* run = chip->lfoRuns;
+	for ( Bitu start = 0; start < samples; start += run->samples, run++ ) {
+		//A silent channel stays silent until a register write, skip all the runs that are left
+		bool silent;
 		switch( mode ) {
 		case sm2AM:
-		case sm2FM:
-			output[ i ] += sample;
-			break;
 		case sm3AM:
+			silent = Op(0)->Silent() && Op(1)->Silent();
+			break;
+		case sm2FM:
 		case sm3FM:
+			silent = Op(1)->Silent();
+			break;
 		case sm3FMFM:
+			silent = Op(3)->Silent();
+			break;
 		case sm3AMFM:
+			silent = Op(0)->Silent() && Op(3)->Silent();
+			break;
 		case sm3FMAM:
+			silent = Op(1)->Silent() && Op(3)->Silent();
+			break;
 		case sm3AMAM:
-			output[ i * 2 + 0 ] += sample & maskLeft;
-			output[ i * 2 + 1 ] += sample & maskRight;
+			silent = Op(0)->Silent() && Op(2)->Silent() && Op(3)->Silent();
 			break;
 		default:
+			silent = false;
 			break;
 		}
+		if ( silent ) {
+			DBOPL_COUNT( silentBlocks, 1 );
+			old[0] = old[1] = 0;
+			return;
+		}
+		//Carriers too quiet to hear only need their phase and envelope kept going
+		if ( Culled< mode >( chip->cullLevel ) ) {
+			DBOPL_COUNT( culledBlocks, 1 );
+			old[0] = old[1] = 0;
+			for ( ; start < samples; start += run->samples, run++ ) {
+				for ( Bitu o = 0; o < ( mode > sm4Start ? 4u : 2u ); o++ ) {
+					Op( o )->Prepare( *run );
+					Op( o )->Skip( run->samples );
+				}
+			}
+			return;
+		}
+		//Init the operators with the the current vibrato and tremolo values, without LFO once is enough
+		if ( hasLFO || start == 0 ) {
+			Op( 0 )->Prepare( *run );
+			Op( 1 )->Prepare( *run );
+			if ( mode > sm4Start ) {
+				Op( 2 )->Prepare( *run );
+				Op( 3 )->Prepare( *run );
+			}
+		}
+		DBOPL_COUNT( modeSamples[ mode ], run->samples );
+		const Bitu end = start + run->samples;
+		for ( Bitu i = start; i < end; i++ ) {
+			//Do unsigned shift so we can shift out all bits but still stay in 10 bit range otherwise
+			//Without feedback this still leaves the sign bit of the sum
+			Bit32s mod = (Bit32u)((old[0] + old[1])) >> ( hasFeedback ? feedback : 31 );
+			old[0] = old[1];
+			old[1] = Op(0)->TemplateSample<sineOnly>( mod );
+			Bit32s sample;
+			Bit32s out0 = old[0];
+			if ( mode == sm2AM || mode == sm3AM ) {
+				sample = out0 + Op(1)->TemplateSample<sineOnly>( 0 );
+			} else if ( mode == sm2FM || mode == sm3FM ) {
+				sample = Op(1)->TemplateSample<sineOnly>( out0 );
+			} else if ( mode == sm3FMFM ) {
+				Bits next = Op(1)->TemplateSample<sineOnly>( out0 ); 
+				next = Op(2)->TemplateSample<sineOnly>( next );
+				sample = Op(3)->TemplateSample<sineOnly>( next );
+			} else if ( mode == sm3AMFM ) {
+				sample = out0;
+				Bits next = Op(1)->TemplateSample<sineOnly>( 0 ); 
+				next = Op(2)->TemplateSample<sineOnly>( next );
+				sample += Op(3)->TemplateSample<sineOnly>( next );
+			} else if ( mode == sm3FMAM ) {
+				sample = Op(1)->TemplateSample<sineOnly>( out0 );
+				Bits next = Op(2)->TemplateSample<sineOnly>( 0 );
+				sample += Op(3)->TemplateSample<sineOnly>( next );
+			} else if ( mode == sm3AMAM ) {
+				sample = out0;
+				Bits next = Op(1)->TemplateSample<sineOnly>( 0 ); 
+				sample += Op(2)->TemplateSample<sineOnly>( next );
+				sample += Op(3)->TemplateSample<sineOnly>( 0 );
+			}
+			switch( mode ) {
+			case sm2AM:
+			case sm2FM:
+				output[ i ] += sample;
+				break;
+			case sm3AM:
+			case sm3FM:
+			case sm3FMFM:
+			case sm3AMFM:
+			case sm3FMAM:
+			case sm3AMAM:
+				output[ i * 2 + 0 ] += sample & maskLeft;
+				output[ i * 2 + 1 ] += sample & maskRight;
+				break;
+			default:
+				break;
+			}
+		}
 	}
-	switch( mode ) {
-	case sm2AM:
-	case sm2FM:
-	case sm3AM:
-	case sm3FM:
-		return ( this + 1 );
-	case sm3FMFM:
-	case sm3AMFM:
-	case sm3FMAM:
-	case sm3AMAM:
-		return( this + 2 );
-	case sm2Percussion:
-	case sm3Percussion:
+}
+
+template<SynthMode mode>
+Channel* Channel::BlockTemplate( Chip* chip, Bit32u samples, Bit32s* output ) {
+	//Percussion picks its own kernel for every run
+	if ( mode == sm2Percussion || mode == sm3Percussion ) {
+		const LFORun* run = chip->lfoRuns;
+		for ( Bitu start = 0; start < samples; start += run->samples, run++ ) {
+			for ( Bitu o = 0; o < 6; o++ ) {
+				Op( o )->Prepare( *run );
+			}
+			DBOPL_COUNT( modeSamples[ mode ], run->samples );
+			GeneratePercussion< mode == sm3Percussion >( chip, start, start + run->samples, output );
+		}
 		return( this + 3 );
 	}
-	return 0;
+	//Pick a kernel that leaves out the features none of the operators use
+	const Bitu ops = mode > sm4Start ? 4 : 2;
+	Bitu lfo = 0;
+	bool sine = true;
+	for ( Bitu o = 0; o < ops; o++ ) {
+		lfo |= Op( o )->tremoloMask | Op( o )->vibStrength;
+		sine = sine && Op( o )->IsSine();
+	}
+	Bitu kernel = ( lfo ? 1 : 0 ) | ( feedback != 31 ? 2 : 0 ) | ( sine ? 4 : 0 );
+	switch ( kernel ) {
+	case 0: BlockKernel< mode, false, false, false >( chip, samples, output ); break;
+	case 1: BlockKernel< mode, true, false, false >( chip, samples, output ); break;
+	case 2: BlockKernel< mode, false, true, false >( chip, samples, output ); break;
+	case 3: BlockKernel< mode, true, true, false >( chip, samples, output ); break;
+	case 4: BlockKernel< mode, false, false, true >( chip, samples, output ); break;
+	case 5: BlockKernel< mode, true, false, true >( chip, samples, output ); break;
+	case 6: BlockKernel< mode, false, true, true >( chip, samples, output ); break;
+	case 7: BlockKernel< mode, true, true, true >( chip, samples, output ); break;
+	}
+	return ( this + ops / 2 );
 }
 
 /*
@@ -982,44 +1298,84 @@ Chip::Chip() {
 	regBD = 0;
 	reg104 = 0;
 	opl3Active = 0;
+	percussionStems[0] = 0;
+	percussionStems[1] = 0;
+	cullLevel = 0x7fffffff;
+	powerOn = 0;
+	deferUpdates = 0;
+	synthsDirty = 0;
+	memset( regShadow, 0, sizeof( regShadow ) );
+	memset( shadowValid, 0, sizeof( shadowValid ) );
+}
+
+//Step the noise generator count times using the jump tables, one lookup per nibble for every set bit
+static INLINE Bit32u NoiseJump( Bit32u value, Bitu count ) {
+	for ( Bitu bit = 0; count; bit++, count >>= 1 ) {
+		if ( !( count & 1 ) )
+			continue;
+		const Bit32u (*table)[16] = NoiseJumpTable[ bit ];
+		value = table[0][ value & 0xf ] ^ table[1][ ( value >> 4 ) & 0xf ] ^
+			table[2][ ( value >> 8 ) & 0xf ] ^ table[3][ ( value >> 12 ) & 0xf ] ^
+			table[4][ ( value >> 16 ) & 0xf ] ^ table[5][ ( value >> 20 ) & 0xf ];
+	}
+	return value;
 }
 
 INLINE Bit32u Chip::ForwardNoise() {
 	noiseCounter += noiseAdd;
 	Bitu count = noiseCounter >> LFO_SH;
 	noiseCounter &= WAVE_MASK;
-	for ( ; count > 0; --count ) {
-		//Noise calculation from mame
-		noiseValue ^= ( 0x800302 ) & ( 0 - (noiseValue & 1 ) );
-		noiseValue >>= 1;
-	}
+	noiseValue = NoiseJump( noiseValue, count );
 	return noiseValue;
 }
 
+void Chip::SkipNoise( Bitu samples ) {
+	Bitu total = 0;
+	for ( Bitu i = 0; i < samples; i++ ) {
+		noiseCounter += noiseAdd;
+		total += noiseCounter >> LFO_SH;
+		noiseCounter &= WAVE_MASK;
+		//Stay within the range of the jump tables
+		if ( total >= ( 1u << ( NOISE_JUMPS - 2 ) ) ) {
+			noiseValue = NoiseJump( noiseValue, total );
+			total = 0;
+		}
+	}
+	noiseValue = NoiseJump( noiseValue, total );
+}
+
 INLINE Bit32u Chip::ForwardLFO( Bit32u samples ) {
-	//Current vibrato value, runs 4x slower than tremolo
-	vibratoSign = ( VibratoTable[ vibratoIndex >> 2] ) >> 7;
-	vibratoShift = ( VibratoTable[ vibratoIndex >> 2] & 7) + vibratoStrength; 
-	tremoloValue = TremoloTable[ tremoloIndex ] >> tremoloStrength;
-
-	//Check hom many samples there can be done before the value changes
-	Bit32u todo = LFO_MAX - lfoCounter;
-	Bit32u count = (todo + lfoAdd - 1) / lfoAdd;
-	if ( count > samples ) {
-		count = samples;
-		lfoCounter += count * lfoAdd;
-	} else {
-		lfoCounter += count * lfoAdd;
-		lfoCounter &= (LFO_MAX - 1);
-		//Maximum of 7 vibrato value * 4
-		vibratoIndex = ( vibratoIndex + 1 ) & 31;
-		//Clip tremolo to the the table size
-		if ( tremoloIndex + 1 < TREMOLO_TABLE  )
-			++tremoloIndex;
-		else
-			tremoloIndex = 0;
+	Bit32u done = 0;
+	for ( Bitu r = 0; r < LFO_RUNS && done < samples; r++ ) {
+		LFORun& run = lfoRuns[ r ];
+		//Current vibrato value, runs 4x slower than tremolo
+		run.vibratoSign = ( VibratoTable[ vibratoIndex >> 2] ) >> 7;
+		run.vibratoShift = ( VibratoTable[ vibratoIndex >> 2] & 7) + vibratoStrength; 
+		run.tremoloValue = TremoloTable[ tremoloIndex ] >> tremoloStrength;
+
+		//Check hom many samples there can be done before the value changes
+		Bit32u todo = LFO_MAX - lfoCounter;
+		Bit32u count = (todo + lfoAdd - 1) / lfoAdd;
+		if ( count > samples - done ) {
+			count = samples - done;
+			lfoCounter += count * lfoAdd;
+		} else {
+			lfoCounter += count * lfoAdd;
+			lfoCounter &= (LFO_MAX - 1);
+			//Maximum of 7 vibrato value * 4
+			vibratoIndex = ( vibratoIndex + 1 ) & 31;
+			//Clip tremolo to the the table size
+			if ( tremoloIndex + 1 < TREMOLO_TABLE  )
+				++tremoloIndex;
+			else
+				tremoloIndex = 0;
+		}
+		run.samples = count;
+		done += count;
+		DBOPL_COUNT( lfoRuns, 1 );
 	}
-	return count;
+	DBOPL_COUNT( lfoBlocks, 1 );
+	return done;
 }
 
 
@@ -1103,14 +1459,90 @@ void Chip::WriteBD( Bit8u val ) {
 
 //Update the 0xc0 register for all channels to signal the switch to mono/stereo handlers
 void Chip::UpdateSynths() {
+	if ( deferUpdates ) {
+		synthsDirty = 1;
+		return;
+	}
+	DBOPL_COUNT( synthUpdates, 1 );
 	for (int i = 0; i < 18; i++) {
 		chan[i].UpdateSynth(this);
 	}
 }
 
+//Forget the frequency registers, writes to silent 4-op channels get dropped so the shadow can't be trusted
+void Chip::InvalidateFrequencyShadow() {
+	//0xa0-0xa8, 0xb0-0xb8 and the same in the second bank
+	const Bit32u mask = 0x1ff;
+	shadowValid[ 0xa0 >> 5 ] &= ~mask;
+	shadowValid[ 0xb0 >> 5 ] &= ~( mask << 16 );
+	shadowValid[ 0x1a0 >> 5 ] &= ~mask;
+	shadowValid[ 0x1b0 >> 5 ] &= ~( mask << 16 );
+}
+
+void Chip::SetCullThreshold( Bitu decibels ) {
+	//The envelope covers 96dB in 512 steps
+	if ( !decibels || decibels >= 96 * 2 )
+		cullLevel = 0x7fffffff;
+	else
+		cullLevel = (Bit32s)( ( decibels * 16 / 3 ) << ENV_EXTRA );
+}
+
+//Run the updates that were deferred during a bulk write
+void Chip::FlushUpdates() {
+	for ( int i = 0; i < 18; i++ ) {
+		Channel* ch = &chan[i];
+		if ( ch->dirty & Channel::DIRTY_FREQUENCY ) {
+			Bit8u fourOp = reg104 & opl3Active & ch->fourMask;
+			ch->UpdateFrequency( this, fourOp > 0x80 ? 0 : fourOp );
+		}
+	}
+	for ( int i = 0; i < 18; i++ ) {
+		Channel* ch = &chan[i];
+		if ( !synthsDirty && ( ch->dirty & Channel::DIRTY_SYNTH ) ) {
+			ch->UpdateSynth( this );
+		}
+		ch->dirty = 0;
+		for ( int o = 0; o < 2; o++ ) {
+			Operator* op = &ch->op[o];
+			if ( !op->dirty )
+				continue;
+			if ( op->dirty & Operator::DIRTY_RATES )
+				op->UpdateRates( this );
+			if ( op->dirty & Operator::DIRTY_FREQUENCY )
+				op->UpdateFrequency();
+			if ( op->dirty & Operator::DIRTY_ATTENUATION )
+				op->UpdateAttenuation();
+			op->dirty = 0;
+		}
+	}
+	if ( synthsDirty ) {
+		synthsDirty = 0;
+		UpdateSynths();
+	}
+}
+
+void Chip::WriteRegs( const RegWrite* writes, Bitu count ) {
+	deferUpdates = 1;
+	for ( Bitu i = 0; i < count; i++ ) {
+		Bit32u reg = writes[i].reg & 0x1ff;
+		Bit8u val = writes[i].val;
+		//Writing the value a register already holds never changes anything
+		if ( regShadow[ reg ] == val && ( shadowValid[ reg >> 5 ] & ( 1u << ( reg & 31 ) ) ) ) {
+			DBOPL_COUNT( skippedWrites, 1 );
+			continue;
+		}
+		WriteReg( reg, val );
+	}
+	deferUpdates = 0;
+	FlushUpdates();
+}
+
 
 void Chip::WriteReg( Bit32u reg, Bit8u val ) {
 	Bitu index;
+	DBOPL_COUNT( regWrites[ ( reg & 0xf0 ) >> 4 ], 1 );
+	regShadow[ reg & 0x1ff ] = val;
+	shadowValid[ ( reg & 0x1ff ) >> 5 ] |= 1u << ( reg & 31 );
 	switch ( (reg & 0xf0) >> 4 ) {
 	case 0x00 >> 4:
 		if ( reg == 0x01 ) {
@@ -1119,6 +1551,10 @@ void Chip::WriteReg( Bit32u reg, Bit8u val ) {
 			//Only detect changes in lowest 6 bits
 			if ( !((reg104 ^ val) & 0x3f) )
 				return;
+			//Pending frequency updates still belong to the old 4-op layout
+			if ( deferUpdates )
+				FlushUpdates();
+			InvalidateFrequencyShadow();
 			//Always keep the highest bit enabled, for checking > 0x80
 			reg104 = 0x80 | ( val & 0x3f );
 			//Switch synths when changing the 4op combinations
@@ -1127,11 +1563,17 @@ void Chip::WriteReg( Bit32u reg, Bit8u val ) {
 			//MAME says the real opl3 doesn't reset anything on opl3 disable/enable till the next write in another register
 			if ( !((opl3Active ^ val) & 1 ) )
 				return;
+			if ( deferUpdates )
+				FlushUpdates();
+			InvalidateFrequencyShadow();
 			opl3Active = ( val & 1 ) ? 0xff : 0;
 			//Just tupdate the synths now that opl3 most have been enabled
 			//This isn't how the real card handles it but need to switch to stereo generating handlers
 			UpdateSynths();
 		} else if ( reg == 0x08 ) {
+			//The note select bit changes how pending frequencies get their keycode
+			if ( deferUpdates && reg08 != val )
+				FlushUpdates();
 			reg08 = val;
 		}
 	case 0x10 >> 4:
@@ -1215,7 +1657,40 @@ void Chip::GenerateBlock3( Bitu total, Bit32s* output  ) {
 	}
 }
 
-void Chip::Setup( Bit32u rate ) {
+template< bool opl3Mode >
+void Chip::GenerateStems( Bitu total, Bit32s* output, Bit32s** stems ) {
+	const Bitu channels = opl3Mode ? 18 : 9;
+	const Bitu stride = opl3Mode ? 2 : 1;
+	Bitu offset = 0;
+	while ( total > 0 ) {
+		Bit32u samples = ForwardLFO( total );
+		Bitu count = samples * stride;
+		//Channels that get skipped or are part of a 4-op pair stay silent
+		for ( Bitu c = 0; c < channels; c++ ) {
+			memset( stems[ c ] + offset, 0, sizeof(Bit32s) * count );
+		}
+		percussionStems[0] = stems[7] + offset;
+		percussionStems[1] = stems[8] + offset;
+		for( Channel* ch = chan; ch < chan + channels; ) {
+			ch = (ch->*(ch->synthHandler))( this, samples, stems[ ch - chan ] + offset );
+		}
+		percussionStems[0] = 0;
+		percussionStems[1] = 0;
+		//Mix down the stems in the same channel order as the regular generators
+		memcpy( output, stems[0] + offset, sizeof(Bit32s) * count );
+		for ( Bitu c = 1; c < channels; c++ ) {
+			const Bit32s* stem = stems[ c ] + offset;
+			for ( Bitu i = 0; i < count; i++ ) {
+				output[ i ] += stem[ i ];
+			}
+		}
+		total -= samples;
+		output += count;
+		offset += count;
+	}
+}
+
+void Chip::SetupRates( Bit32u rate ) {
 	double original = OPLRATE;
 //	double original = rate;
 	double scale = original / (double)rate;
@@ -1303,6 +1778,10 @@ void Chip::Setup( Bit32u rate ) {
 		//This should provide instant volume maximizing
 		attackRates[i] = 8 << RATE_SH;
 	}
+}
+
+void Chip::Setup( Bit32u rate ) {
+	SetupRates( rate );
 	//Setup the channels with the correct four op flags
 	//Channels are accessed through a table so they appear linear here
 	chan[ 0].fourMask = 0x00 | ( 1 << 0 );
@@ -1434,6 +1913,32 @@ void InitTables( void ) {
 		TremoloTable[i] = val;
 		TremoloTable[TREMOLO_TABLE - 1 - i] = val;
 	}
+	//Create the noise jump tables, stepping the noise generator is linear so a jump is
+	//the xor of where every set bit of the state ends up
+	for ( Bitu n = 0; n < NOISE_JUMPS; n++ ) {
+		Bit32u basis[ 24 ];
+		for ( Bitu b = 0; b < 24; b++ ) {
+			Bit32u value = 1 << b;
+			if ( n == 0 ) {
+				//Noise calculation from mame
+				value ^= ( 0x800302 ) & ( 0 - (value & 1 ) );
+				value >>= 1;
+			} else {
+				value = NoiseJump( NoiseJump( value, 1 << ( n - 1 ) ), 1 << ( n - 1 ) );
+			}
+			basis[ b ] = value;
+		}
+		for ( Bitu nibble = 0; nibble < 6; nibble++ ) {
+			for ( Bitu v = 0; v < 16; v++ ) {
+				Bit32u value = 0;
+				for ( Bitu b = 0; b < 4; b++ ) {
+					if ( v & ( 1 << b ) )
+						value ^= basis[ nibble * 4 + b ];
+				}
+				NoiseJumpTable[ n ][ nibble ][ v ] = value;
+			}
+		}
+	}
 	//Create a table with offsets of the channels from the start of the chip
 	for ( Bitu i = 0; i < 32; i++ ) {
 		Bitu index = i & 0xf;
@@ -1493,19 +1998,280 @@ void InitTables( void ) {
 #endif
 }
 
+//Power on state for every rate in use, built once and then copied by Reset and SetRate
+struct PowerOnState {
+	Chip chip;
+	Bit32u rate;
+	PowerOnState* next;
+};
+
+static std::mutex powerOnLock;
+static PowerOnState* powerOnStates = 0;
+
+const Chip* Chip::PowerOn( Bit32u rate ) {
+	std::lock_guard< std::mutex > guard( powerOnLock );
+	InitTables();
+	for ( PowerOnState* state = powerOnStates; state; state = state->next ) {
+		if ( state->rate == rate )
+			return &state->chip;
+	}
+	PowerOnState* state = new PowerOnState();
+	state->chip.Setup( rate );
+	state->chip.powerOn = &state->chip;
+	state->rate = rate;
+	state->next = powerOnStates;
+	powerOnStates = state;
+	return &state->chip;
+}
+
+void Chip::Reset() {
+	Bit32s cull = cullLevel;
+	*this = *powerOn;
+	cullLevel = cull;
+}
+
+/*
+	Saving and restoring state
+*/
+
+void Operator::SaveState( OperatorState& s ) const {
+	s.waveIndex = waveIndex;
+	s.waveCurrent = waveCurrent;
+	s.currentLevel = currentLevel;
+	s.volume = volume;
+	s.rateIndex = rateIndex;
+	s.attackAdd = attackAdd;
+	s.decayAdd = decayAdd;
+	s.releaseAdd = releaseAdd;
+	s.sustainLevel = sustainLevel;
+	s.waveAdd = waveAdd;
+	s.vibrato = vibrato;
+	s.totalLevel = totalLevel;
+	s.chanData = chanData;
+	s.freqMul = freqMul;
+	s.reg20 = reg20;
+	s.reg40 = reg40;
+	s.reg60 = reg60;
+	s.reg80 = reg80;
+	s.regE0 = regE0;
+	s.state = state;
+	s.waveForm = WaveForm();
+	s.rateZero = rateZero;
+	s.tremoloMask = tremoloMask;
+	s.vibStrength = vibStrength;
+	s.keyOn = keyOn;
+	s.ksr = ksr;
+}
+
+void Operator::LoadState( const OperatorState& s ) {
+	waveIndex = s.waveIndex;
+	waveCurrent = s.waveCurrent;
+	currentLevel = s.currentLevel;
+	volume = s.volume;
+	rateIndex = s.rateIndex;
+	attackAdd = s.attackAdd;
+	decayAdd = s.decayAdd;
+	releaseAdd = s.releaseAdd;
+	sustainLevel = s.sustainLevel;
+	waveAdd = s.waveAdd;
+	vibrato = s.vibrato;
+	totalLevel = s.totalLevel;
+	chanData = s.chanData;
+	freqMul = s.freqMul;
+	reg20 = s.reg20;
+	reg40 = s.reg40;
+	reg60 = s.reg60;
+	reg80 = s.reg80;
+	regE0 = s.regE0;
+	SetState( s.state <= ATTACK ? s.state : (Bit8u)OFF );
+	SetWaveForm( s.waveForm & 7 );
+	rateZero = s.rateZero;
+	tremoloMask = s.tremoloMask;
+	vibStrength = s.vibStrength;
+	keyOn = s.keyOn;
+	ksr = s.ksr;
+	dirty = 0;
+}
+
+//Every handler UpdateSynth and WriteBD can select, a state keeps the index in here
+static const SynthHandler SynthHandlers[] = {
+	&Channel::BlockTemplate< sm2AM >,
+	&Channel::BlockTemplate< sm2FM >,
+	&Channel::BlockTemplate< sm3AM >,
+	&Channel::BlockTemplate< sm3FM >,
+	&Channel::BlockTemplate< sm3FMFM >,
+	&Channel::BlockTemplate< sm3AMFM >,
+	&Channel::BlockTemplate< sm3FMAM >,
+	&Channel::BlockTemplate< sm3AMAM >,
+	&Channel::BlockTemplate< sm2Percussion >,
+	&Channel::BlockTemplate< sm3Percussion >,
+};
+static const Bitu SynthHandlerCount = sizeof( SynthHandlers ) / sizeof( SynthHandlers[0] );
+
+void Channel::SaveState( ChannelState& s ) const {
+	s.old[0] = old[0];
+	s.old[1] = old[1];
+	s.chanData = chanData;
+	s.synth = 0;
+	for ( Bitu i = 0; i < SynthHandlerCount; i++ ) {
+		if ( synthHandler == SynthHandlers[ i ] )
+			s.synth = (Bit8u)i;
+	}
+	s.feedback = feedback;
+	s.regC0 = regC0;
+	s.regB0 = regB0;
+	s.fourMask = fourMask;
+	s.maskLeft = maskLeft;
+	s.maskRight = maskRight;
+}
+
+void Channel::LoadState( const ChannelState& s ) {
+	old[0] = s.old[0];
+	old[1] = s.old[1];
+	chanData = s.chanData;
+	synthHandler = SynthHandlers[ s.synth < SynthHandlerCount ? s.synth : 0 ];
+	feedback = s.feedback;
+	regC0 = s.regC0;
+	regB0 = s.regB0;
+	fourMask = s.fourMask;
+	maskLeft = s.maskLeft;
+	maskRight = s.maskRight;
+	dirty = 0;
+}
+
+void Chip::SaveState( ChipState& s ) const {
+	for ( int i = 0; i < 18; i++ ) {
+		chan[i].SaveState( s.chan[i] );
+		chan[i].op[0].SaveState( s.op[ i * 2 ] );
+		chan[i].op[1].SaveState( s.op[ i * 2 + 1 ] );
+	}
+	s.lfoCounter = lfoCounter;
+	s.noiseCounter = noiseCounter;
+	s.noiseValue = noiseValue;
+	s.vibratoIndex = vibratoIndex;
+	s.tremoloIndex = tremoloIndex;
+	s.vibratoStrength = vibratoStrength;
+	s.tremoloStrength = tremoloStrength;
+	s.opl3Active = opl3Active;
+	s.reg104 = reg104;
+	s.reg08 = reg08;
+	s.reg04 = reg04;
+	s.regBD = regBD;
+	s.waveFormMask = waveFormMask;
+	memcpy( s.regShadow, regShadow, sizeof( regShadow ) );
+	memcpy( s.shadowValid, shadowValid, sizeof( shadowValid ) );
+}
+
+void Chip::LoadState( const ChipState& s ) {
+	for ( int i = 0; i < 18; i++ ) {
+		chan[i].LoadState( s.chan[i] );
+		chan[i].op[0].LoadState( s.op[ i * 2 ] );
+		chan[i].op[1].LoadState( s.op[ i * 2 + 1 ] );
+	}
+	lfoCounter = s.lfoCounter;
+	noiseCounter = s.noiseCounter;
+	noiseValue = s.noiseValue;
+	vibratoIndex = s.vibratoIndex;
+	tremoloIndex = s.tremoloIndex;
+	vibratoStrength = s.vibratoStrength;
+	tremoloStrength = s.tremoloStrength;
+	opl3Active = s.opl3Active;
+	reg104 = s.reg104;
+	reg08 = s.reg08;
+	reg04 = s.reg04;
+	regBD = s.regBD;
+	waveFormMask = s.waveFormMask;
+	memcpy( regShadow, s.regShadow, sizeof( regShadow ) );
+	memcpy( shadowValid, s.shadowValid, sizeof( shadowValid ) );
+	deferUpdates = 0;
+	synthsDirty = 0;
+}
+
+void Chip::SetRate( Bit32u rate ) {
+	const Chip* source = PowerOn( rate );
+	powerOn = source;
+	noiseAdd = source->noiseAdd;
+	lfoAdd = source->lfoAdd;
+	memcpy( freqMul, source->freqMul, sizeof( freqMul ) );
+	memcpy( linearRates, source->linearRates, sizeof( linearRates ) );
+	memcpy( attackRates, source->attackRates, sizeof( attackRates ) );
+	for ( int i = 0; i < 18; i++ ) {
+		chan[i].op[0].UpdateRateTables( this );
+		chan[i].op[1].UpdateRateTables( this );
+	}
+}
+
 Bit32u Handler::WriteAddr( Bit32u port, Bit8u val ) {
 	return chip.WriteAddr( port, val );
 
 }
 void Handler::WriteReg( Bit32u addr, Bit8u val ) {
+	if ( GCC_UNLIKELY( traceHandler != 0 ) )
+		traceHandler( traceData, sampleClock, addr, val );
 	chip.WriteReg( addr, val );
 }
 
+void Handler::WriteRegs( const RegWrite* writes, Bitu count ) {
+	if ( GCC_UNLIKELY( traceHandler != 0 ) ) {
+		for ( Bitu i = 0; i < count; i++ ) {
+			traceHandler( traceData, sampleClock, writes[i].reg, writes[i].val );
+		}
+	}
+	chip.WriteRegs( writes, count );
+}
+
+//Interpolate from the chip rate up to the output rate, running one chip frame behind
+static void Upsample( Bit32s* output, const Bit32s* input, Bitu samples, Bitu phase, Bitu shift,
+	Bit32s (*frames)[2], bool stereo ) {
+	const Bitu mask = ( 1 << shift ) - 1;
+	for ( Bitu i = 0; i < samples; i++ ) {
+		if ( phase == 0 ) {
+			frames[0][0] = frames[1][0];
+			frames[0][1] = frames[1][1];
+			frames[1][0] = input[0];
+			frames[1][1] = stereo ? input[1] : input[0];
+			input += stereo ? 2 : 1;
+		}
+		output[0] = frames[0][0] + ( ( ( frames[1][0] - frames[0][0] ) * (Bit32s)phase ) >> shift );
+		if ( stereo ) {
+			output[1] = frames[0][1] + ( ( ( frames[1][1] - frames[0][1] ) * (Bit32s)phase ) >> shift );
+			output += 2;
+		} else {
+			output += 1;
+		}
+		phase = ( phase + 1 ) & mask;
+	}
+}
+
+//Chip frames needed to produce samples output samples from the current phase
+static Bitu UpsampleFrames( Bitu phase, Bitu samples, Bitu shift ) {
+	const Bitu step = 1 << shift;
+	return ( phase + samples + step - 1 ) / step - ( phase + step - 1 ) / step;
+}
+
 void Handler::Generate( Bit32s *buffer, Bitu samples ) {
-	if ( !chip.opl3Active )
-		chip.GenerateBlock2( samples, buffer );
-	else
-		chip.GenerateBlock3( samples, buffer );
+	sampleClock += samples;
+	if ( GCC_LIKELY( rateShift == 0 ) ) {
+		if ( !chip.opl3Active )
+			chip.GenerateBlock2( samples, buffer );
+		else
+			chip.GenerateBlock3( samples, buffer );
+		return;
+	}
+	Bit32s frames[ 256 * 2 ];
+	const bool stereo = chip.opl3Active != 0;
+	while ( samples > 0 ) {
+		Bitu todo = samples < ( 255u << rateShift ) ? samples : ( 255u << rateShift );
+		Bitu count = UpsampleFrames( upsamplePhase, todo, rateShift );
+		if ( !stereo )
+			chip.GenerateBlock2( count, frames );
+		else
+			chip.GenerateBlock3( count, frames );
+		Upsample( buffer, frames, todo, upsamplePhase, rateShift, upsample[0], stereo );
+		upsamplePhase = ( upsamplePhase + todo ) & ( ( 1 << rateShift ) - 1 );
+		buffer += stereo ? todo * 2 : todo;
+		samples -= todo;
+	}
 #if 0
 	Bit32s buffer[ 512 * 2 ];
 	if ( GCC_UNLIKELY(samples > 512) )
@@ -1520,9 +2286,77 @@ void Handler::Generate( Bit32s *buffer, Bitu samples ) {
 #endif
 }
 
-void Handler::Init( Bitu rate ) {
-	InitTables();
-	chip.Setup( rate );
+void Handler::GenerateStems( Bit32s *buffer, Bit32s **stems, Bitu samples ) {
+	sampleClock += samples;
+	const bool stereo = chip.opl3Active != 0;
+	if ( GCC_LIKELY( rateShift == 0 ) ) {
+		if ( !stereo )
+			chip.GenerateStems< false >( samples, buffer, stems );
+		else
+			chip.GenerateStems< true >( samples, buffer, stems );
+		return;
+	}
+	const Bitu channels = stereo ? 18 : 9;
+	const Bitu stride = stereo ? 2 : 1;
+	Bit32s frames[ 1 + 18 ][ 64 * 2 ];
+	Bit32s* frameStems[ 18 ];
+	for ( Bitu c = 0; c < channels; c++ ) {
+		frameStems[ c ] = frames[ 1 + c ];
+	}
+	Bitu offset = 0;
+	while ( samples > 0 ) {
+		Bitu todo = samples < ( 63u << rateShift ) ? samples : ( 63u << rateShift );
+		Bitu count = UpsampleFrames( upsamplePhase, todo, rateShift );
+		if ( !stereo )
+			chip.GenerateStems< false >( count, frames[0], frameStems );
+		else
+			chip.GenerateStems< true >( count, frames[0], frameStems );
+		Upsample( buffer + offset, frames[0], todo, upsamplePhase, rateShift, upsample[0], stereo );
+		for ( Bitu c = 0; c < channels; c++ ) {
+			Upsample( stems[ c ] + offset, frames[ 1 + c ], todo, upsamplePhase, rateShift, upsample[ 1 + c ], stereo );
+		}
+		upsamplePhase = ( upsamplePhase + todo ) & ( ( 1 << rateShift ) - 1 );
+		offset += todo * stride;
+		samples -= todo;
+	}
+}
+
+void Handler::SetCullThreshold( Bitu decibels ) {
+	chip.SetCullThreshold( decibels );
+}
+
+void Handler::Reset() {
+	upsamplePhase = 0;
+	memset( upsample, 0, sizeof( upsample ) );
+	sampleClock = 0;
+	traceHandler = 0;
+	traceData = 0;
+	chip.Reset();
+}
+
+void Handler::SetRate( Bitu rate ) {
+	chip.SetRate( rate >> rateShift );
+}
+
+void Handler::SaveState( HandlerState& state ) const {
+	chip.SaveState( state.chip );
+	state.sampleClock = sampleClock;
+	state.upsamplePhase = upsamplePhase;
+	memcpy( state.upsample, upsample, sizeof( upsample ) );
+}
+
+void Handler::LoadState( const HandlerState& state ) {
+	chip.LoadState( state.chip );
+	sampleClock = state.sampleClock;
+	upsamplePhase = state.upsamplePhase & ( ( 1 << rateShift ) - 1 );
+	memcpy( upsample, state.upsample, sizeof( upsample ) );
+}
+
+void Handler::Init( Bitu rate, Quality quality ) {
+	rateShift = quality == qualityQuarter ? 2 : ( quality == qualityHalf ? 1 : 0 );
+	chip.powerOn = Chip::PowerOn( rate >> rateShift );
+	chip.cullLevel = 0x7fffffff;
+	Reset();
 }
 
 
@@ -16,6 +16,8 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#ifndef DOSBOX_DBOPL_H
+#define DOSBOX_DBOPL_H
 
 /*
 	define Bits, Bitu, Bit32s, Bit32u, Bit16s, Bit16u, Bit8s, Bit8u here
@@ -24,6 +26,7 @@
 #include <stdbool.h>
 typedef uintptr_t	Bitu;
 typedef intptr_t	Bits;
+typedef uint64_t	Bit64u;
 typedef uint32_t	Bit32u;
 typedef int32_t		Bit32s;
 typedef uint16_t	Bit16u;
@@ -34,6 +37,30 @@ typedef int8_t		Bit8s;
 #define GCC_UNLIKELY(x) (x)
 #define GCC_LIKELY(x) (x)
 #define INLINE inline
+#if defined( __GNUC__ )
+#define DB_NOINLINE __attribute__(( noinline ))
+#elif defined( _MSC_VER )
+#define DB_NOINLINE __declspec( noinline )
+#else
+#define DB_NOINLINE
+#endif
+
+//Pack the emulator state as small as possible instead of aligning operators to cache lines,
+//the volume handler is then looked up from the envelope state for every sample
+#ifndef DBOPL_COMPACT
+#define DBOPL_COMPACT 0
+#endif
+
+//Count which paths the emulator takes, see DBOPL::Counters, compiled out unless enabled
+#ifndef DBOPL_COUNTERS
+#define DBOPL_COUNTERS 0
+#endif
+
+#if DBOPL_COMPACT
+#define DBOPL_CACHE_ALIGN
+#else
+#define DBOPL_CACHE_ALIGN alignas( 64 )
+#endif
 
 //Use 8 handlers based on a small logatirmic wavetabe and an exponential table for volume
 #define WAVE_HANDLER	10
@@ -57,6 +84,8 @@ typedef Bits ( DB_FASTCALL *WaveHandler) ( Bitu i, Bitu volume );
 
 typedef Bits ( DBOPL::Operator::*VolumeHandler) ( );
 typedef Channel* ( DBOPL::Channel::*SynthHandler) ( Chip* chip, Bit32u samples, Bit32s* output );
+//Sees every register write along with the number of samples generated before it
+typedef void ( *TraceHandler) ( void* data, Bit64u sample, Bit32u reg, Bit8u val );
 
 //Different synth modes that can generate blocks of data
 typedef enum {
@@ -80,7 +109,117 @@ enum {
 	SHIFT_KEYCODE = 24,
 };
 
-struct Operator {
+//Vibrato and tremolo for a run of samples, the LFO values only change every few hundred samples
+struct LFORun {
+	Bit32u samples;
+	Bit8u tremoloValue;
+	Bit8u vibratoShift;
+	Bit8s vibratoSign;
+};
+
+#if DBOPL_COUNTERS
+//Events counted per thread, on their own cache lines so threads running separate chips don't
+//share them. Counts are added per block or per register write, never per sample
+struct alignas( 64 ) Counters {
+	//Samples generated by the channel kernels in every synth mode, a 4-op pair or the
+	//percussion channels count once
+	Bit64u modeSamples[ sm3Percussion + 1 ];
+	//Channel blocks that stopped early because the carriers were silent or culled
+	Bit64u silentBlocks;
+	Bit64u culledBlocks;
+	//ForwardLFO calls and the runs of constant vibrato and tremolo they split blocks into
+	Bit64u lfoBlocks;
+	Bit64u lfoRuns;
+	//WriteReg calls by register group, ( reg & 0xf0 ) >> 4 for both banks
+	Bit64u regWrites[ 16 ];
+	//Writes WriteRegs dropped because the register already held the value
+	Bit64u skippedWrites;
+	//Passes of UpdateSynths over every channel
+	Bit64u synthUpdates;
+};
+
+//The counters of the calling thread
+const Counters& ThreadCounters();
+//Sum over every thread that used the emulator so far, exited threads included. Other threads
+//keep counting while this runs, so the sum can miss their last few blocks
+void CollectCounters( Counters& total );
+#endif
+
+//A single register write for the bulk write interface
+struct RegWrite {
+	Bit16u reg;
+	Bit8u val;
+};
+
+//Snapshots of everything that changes while a chip plays, without the rate tables and with
+//handler pointers replaced by table indices, so they can be saved to disk and restored in
+//another process. Only valid on a handler set up with the same rate and quality
+struct OperatorState {
+	Bit32u waveIndex;
+	Bit32u waveCurrent;
+	Bit32u currentLevel;
+	Bit32s volume;
+	Bit32u rateIndex;
+	Bit32u attackAdd;
+	Bit32u decayAdd;
+	Bit32u releaseAdd;
+	Bit32s sustainLevel;
+	Bit32u waveAdd;
+	Bit32u vibrato;
+	Bit32s totalLevel;
+	Bit32u chanData;
+	Bit32u freqMul;
+	Bit8u reg20, reg40, reg60, reg80, regE0;
+	Bit8u state;
+	Bit8u waveForm;
+	Bit8u rateZero;
+	Bit8u tremoloMask;
+	Bit8u vibStrength;
+	Bit8u keyOn;
+	Bit8u ksr;
+};
+
+struct ChannelState {
+	Bit32s old[2];
+	Bit32u chanData;
+	//Index in the list of synth handlers, not a SynthMode
+	Bit8u synth;
+	Bit8u feedback;
+	Bit8u regC0;
+	Bit8u regB0;
+	Bit8u fourMask;
+	Bit8s maskLeft;
+	Bit8s maskRight;
+};
+
+struct ChipState {
+	OperatorState op[36];
+	ChannelState chan[18];
+	Bit32u lfoCounter;
+	Bit32u noiseCounter;
+	Bit32u noiseValue;
+	Bit8u vibratoIndex;
+	Bit8u tremoloIndex;
+	Bit8u vibratoStrength;
+	Bit8u tremoloStrength;
+	Bit8s opl3Active;
+	Bit8u reg104;
+	Bit8u reg08;
+	Bit8u reg04;
+	Bit8u regBD;
+	Bit8u waveFormMask;
+	Bit8u regShadow[512];
+	Bit32u shadowValid[512 / 32];
+};
+
+struct HandlerState {
+	ChipState chip;
+	Bit64u sampleClock;
+	Bit8u upsamplePhase;
+	Bit32s upsample[ 1 + 18 ][ 2 ][ 2 ];
+};
+
+struct DBOPL_CACHE_ALIGN Operator {
 public:
 	//Masks for operator 20 values
 	enum {
@@ -98,52 +237,74 @@ public:
 		ATTACK,
 	} State;
 
-	VolumeHandler volHandler;
+	//Derived values that still need updating after a bulk write
+	enum {
+		DIRTY_RATES = 0x01,
+		DIRTY_FREQUENCY = 0x02,
+		DIRTY_ATTENUATION = 0x04,
+	};
 
+	//Per sample state, kept together at the start of the operator so generating
+	//a sample only touches the first cache line
+#if !DBOPL_COMPACT
+	VolumeHandler volHandler;
+#endif
 #if (DBOPL_WAVE == WAVE_HANDLER)
 	WaveHandler waveHandler;	//Routine that generate a wave 
 #else
 	Bit16s* waveBase;
-	Bit32u waveMask;
-	Bit32u waveStart;
 #endif
 	Bit32u waveIndex;			//WAVE_BITS shifted counter of the frequency index
-	Bit32u waveAdd;				//The base frequency without vibrato
 	Bit32u waveCurrent;			//waveAdd + vibratao
-
-	Bit32u chanData;			//Frequency/octave and derived data coming from whatever channel controls this
-	Bit32u freqMul;				//Scale channel frequency with this, TODO maybe remove?
-	Bit32u vibrato;				//Scaled up vibrato strength
-	Bit32s sustainLevel;		//When stopping at sustain level stop here
-	Bit32s totalLevel;			//totalLevel is added to every generated volume
 	Bit32u currentLevel;		//totalLevel + tremolo
 	Bit32s volume;				//The currently active volume
-	
+	Bit32u rateIndex;			//Current position of the evenlope
 	Bit32u attackAdd;			//Timers for the different states of the envelope
 	Bit32u decayAdd;
 	Bit32u releaseAdd;
-	Bit32u rateIndex;			//Current position of the evenlope
-
-	Bit8u rateZero;				//Bits for the different states of the envelope having no changes
-	Bit8u keyOn;				//Bitmask of different values that can generate keyon
-	//Registers, also used to check for changes
-	Bit8u reg20, reg40, reg60, reg80, regE0;
+	Bit32s sustainLevel;		//When stopping at sustain level stop here
+#if (DBOPL_WAVE != WAVE_HANDLER)
+	Bit16u waveMask;
+#endif
+	Bit8u reg20;
 	//Active part of the envelope we're in
 	Bit8u state;
+
+	//Per block state, used when preparing a block or checking for silence
+	Bit32u waveAdd;				//The base frequency without vibrato
+	Bit32u vibrato;				//Scaled up vibrato strength
+	Bit32s totalLevel;			//totalLevel is added to every generated volume
+	Bit8u rateZero;				//Bits for the different states of the envelope having no changes
 	//0xff when tremolo is enabled
 	Bit8u tremoloMask;
 	//Strength of the vibrato
 	Bit8u vibStrength;
+
+	//Only changed by register writes
+	Bit32u chanData;			//Frequency/octave and derived data coming from whatever channel controls this
+	Bit32u freqMul;				//Scale channel frequency with this, TODO maybe remove?
+#if (DBOPL_WAVE != WAVE_HANDLER)
+	Bit32u waveStart;
+#endif
+	Bit8u keyOn;				//Bitmask of different values that can generate keyon
+	//Registers, also used to check for changes
+	Bit8u reg40, reg60, reg80, regE0;
 	//Keep track of the calculated KSR so we can check for changes
 	Bit8u ksr;
+	//Updates deferred during a bulk write
+	Bit8u dirty;
 private:
 	void SetState( Bit8u s );
+	void SetWaveForm( Bit8u waveForm );
+	Bit8u WaveForm() const;
 	void UpdateAttack( const Chip* chip );
 	void UpdateRelease( const Chip* chip );
 	void UpdateDecay( const Chip* chip );
 public:
 	void UpdateAttenuation();
 	void UpdateRates( const Chip* chip );
+	//Pick up new rate tables of the chip, keeping the envelope and phase
+	void UpdateRateTables( const Chip* chip );
 	void UpdateFrequency( );
 
 	void Write20( const Chip* chip, Bit8u val );
@@ -153,11 +314,17 @@ public:
 	void WriteE0( const Chip* chip, Bit8u val );
 
 	bool Silent() const;
-	void Prepare( const Chip* chip );
+	bool Idle() const;
+	bool Inaudible( Bit32s level ) const;
+	void Skip( Bitu samples );
+	void Prepare( const LFORun& run );
 
 	void KeyOn( Bit8u mask);
 	void KeyOff( Bit8u mask);
 
+	void SaveState( OperatorState& state ) const;
+	void LoadState( const OperatorState& state );
+
 	template< State state>
 	Bits TemplateVolume( );
 
@@ -165,29 +332,41 @@ public:
 	Bitu ForwardWave();
 	Bitu ForwardVolume();
 
+	template< bool sineOnly >
+	Bits TemplateSample( Bits modulation );
 	Bits GetSample( Bits modulation );
+	bool IsSine() const;
 	Bits GetWave( Bitu index, Bitu vol );
 public:
 	Operator();
 };
 
 struct Channel {
+	//Derived values that still need updating after a bulk write
+	enum {
+		DIRTY_FREQUENCY = 0x01,
+		DIRTY_SYNTH = 0x02,
+	};
+
 	Operator op[2]; //Leave on top of struct for simpler pointer math.
 	inline Operator* Op( Bitu index ) {
 		return &( ( this + (index >> 1) )->op[ index & 1 ]);
 	}
+	//Used while generating a block
 	SynthHandler synthHandler;
-	Bit32u chanData;		//Frequency/octave and derived values
 	Bit32s old[2];			//Old data for feedback
-
 	Bit8u feedback;			//Feedback shift
-	Bit8u regB0;			//Register values to check for changes
 	Bit8u regC0;
-	//This should correspond with reg104, bit 6 indicates a Percussion channel, bit 7 indicates a silent channel
-	Bit8u fourMask;
 	Bit8s maskLeft;		//Sign extended values for both channel's panning
 	Bit8s maskRight;
 
+	//Only changed by register writes
+	Bit32u chanData;		//Frequency/octave and derived values
+	Bit8u regB0;			//Register values to check for changes
+	//This should correspond with reg104, bit 6 indicates a Percussion channel, bit 7 indicates a silent channel
+	Bit8u fourMask;
+	Bit8u dirty;			//Updates deferred during a bulk write
+
 	//Forward the channel data to the operators of the channel
 	void SetChanData( const Chip* chip, Bit32u data );
 	//Change in the chandata, check for new values and if we have to forward to operators
@@ -197,13 +376,26 @@ struct Channel {
 	void WriteB0( const Chip* chip, Bit8u val );
 	void WriteC0( const Chip* chip, Bit8u val );
 
+	void SaveState( ChannelState& state ) const;
+	void LoadState( const ChannelState& state );
+
 	//call this for the first channel
 	template< bool opl3Mode >
-	void GeneratePercussion( Chip* chip, Bit32s* output );
+	void GeneratePercussion( Chip* chip, Bitu start, Bitu end, Bit32s* output );
+	//Block of percussion with only the drum pairs that can be heard
+	template< bool opl3Mode, bool bassDrum, bool hihatSnare, bool tomCymbal >
+	void PercussionBlock( Chip* chip, Bitu start, Bitu end, Bit32s* output );
 
+	//All the carriers are attenuated by at least level for the rest of the block
+	template<SynthMode mode>
+	bool Culled( Bit32s level );
 	//Generate blocks of data in specific modes
 	template<SynthMode mode>
 	Channel* BlockTemplate( Chip* chip, Bit32u samples, Bit32s* output );
+	//Generate a block with only the features the operators use, feedback and lfo compiled in or out
+	//and the waveform lookup fixed to a sine when all operators use one
+	template<SynthMode mode, bool hasLFO, bool hasFeedback, bool sineOnly>
+	void BlockKernel( Chip* chip, Bit32u samples, Bit32s* output );
 	Channel();
 };
 
@@ -220,56 +412,146 @@ struct Chip {
 	Bit32u noiseAdd;
 	Bit32u noiseValue;
 
-	//Frequency scales for the different multiplications
-	Bit32u freqMul[16];
-	//Rates for decay and release for rate of this chip
-	Bit32u linearRates[76];
-	//Best match attack rates for the rate of this chip
-	Bit32u attackRates[76];
+	//LFO values for the block being generated
+	enum {
+		LFO_RUNS = 16,
+	};
+	LFORun lfoRuns[ LFO_RUNS ];
 
-	Bit8u reg104;
-	Bit8u reg08;
-	Bit8u reg04;
-	Bit8u regBD;
 	Bit8u vibratoIndex;
 	Bit8u tremoloIndex;
-	Bit8s vibratoSign;
-	Bit8u vibratoShift;
-	Bit8u tremoloValue;
 	Bit8u vibratoStrength;
 	Bit8u tremoloStrength;
-	//Mask for allowed wave forms
-	Bit8u waveFormMask;
 	//0 or -1 when enabled
 	Bit8s opl3Active;
 
-	//Return the maximum amount of samples before and LFO change
+	Bit8u reg104;
+	Bit8u reg08;
+	Bit8u reg04;
+	Bit8u regBD;
+	//Mask for allowed wave forms
+	Bit8u waveFormMask;
+
+	//Frequency scales for the different multiplications
+	Bit32u freqMul[16];
+	//Rates for decay and release for rate of this chip
+	Bit32u linearRates[76];
+	//Best match attack rates for the rate of this chip
+	Bit32u attackRates[76];
+
+	//Stems for the channel 7 and 8 percussion voices, only set while generating stems
+	Bit32s* percussionStems[2];
+
+	//Channels whose carriers are attenuated this much or more are only advanced, not generated
+	Bit32s cullLevel;
+
+	//Shared state right after Setup at the current rate, see PowerOn
+	const Chip* powerOn;
+
+	//Set during a bulk write, register handlers only mark what needs updating
+	Bit8u deferUpdates;
+	Bit8u synthsDirty;
+	//Last value written to every register and whether it can be trusted for skipping writes
+	Bit8u regShadow[512];
+	Bit32u shadowValid[512 / 32];
+
+	//Fill lfoRuns for the next samples, returns how many samples the runs cover
 	Bit32u ForwardLFO( Bit32u samples );
 	Bit32u ForwardNoise();
+	//Advance the noise generator as if ForwardNoise was called for every sample
+	void SkipNoise( Bitu samples );
 
 	void WriteBD( Bit8u val );
 	void WriteReg(Bit32u reg, Bit8u val );
+	//Write a batch of registers, skipping unchanged values and updating derived state once at the end
+	void WriteRegs( const RegWrite* writes, Bitu count );
+	void FlushUpdates();
+	void InvalidateFrequencyShadow();
+	//Cull channels attenuated by at least decibels, 0 generates every channel
+	void SetCullThreshold( Bitu decibels );
 
 	Bit32u WriteAddr( Bit32u port, Bit8u val );
 
 	void GenerateBlock2( Bitu samples, Bit32s* output );
 	void GenerateBlock3( Bitu samples, Bit32s* output );
+	//Generate every channel into its own stem and mix them into output
+	template< bool opl3Mode >
+	void GenerateStems( Bitu samples, Bit32s* output, Bit32s** stems );
 
 	//Update the synth handlers in all channels
 	void UpdateSynths();
 	void Generate( Bit32u samples );
+	//Compute the tables for rate r
+	void SetupRates( Bit32u r );
+	//SetupRates and clear every register, slow, mostly spent in the attack rate search
 	void Setup( Bit32u r );
+	//A chip set up at rate r, built on first use and kept for the lifetime of the process
+	static const Chip* PowerOn( Bit32u r );
+	//Back to the power on state by copying it, the rate and cull threshold stay
+	void Reset();
+	//Switch to the tables of rate r, voices keep playing where they are
+	void SetRate( Bit32u r );
+	//Copy out or restore the playing state, a bulk write must not be in progress
+	void SaveState( ChipState& state ) const;
+	void LoadState( const ChipState& state );
 
 	Chip();
 };
 
+//Emulation quality tiers. Below full quality the chip runs at half or a quarter of the output
+//rate, envelopes and LFO included, and the output is linearly interpolated back up. This adds
+//one internal sample of latency. Cost is per output sample against full quality, error is the
+//difference with latency aligned full quality output over mixed opl2/opl3/percussion material,
+//the same at 44.1 and 48kHz. Most of the error is phase drift and aliasing, not audible noise
+//	qualityFull		reference
+//	qualityHalf		50-60% of the cost, error -13 to -25dB, loses everything above rate / 4
+//	qualityQuarter	28-34% of the cost, error -6 to -15dB, loses everything above rate / 8
+typedef enum {
+	qualityFull,
+	qualityHalf,
+	qualityQuarter,
+} Quality;
+
 struct Handler {
 	DBOPL::Chip chip;
+	//Output rate is the chip rate shifted left by this
+	Bit8u rateShift;
+	//Position within the current interpolated internal sample
+	Bit8u upsamplePhase;
+	//Previous and current internal frame for the mix and every stem
+	Bit32s upsample[ 1 + 18 ][ 2 ][ 2 ];
+	//Output samples generated since Init or Reset
+	Bit64u sampleClock;
+	//Register writes are passed to this when set, Init and Reset clear it
+	TraceHandler traceHandler;
+	void* traceData;
 	Bit32u WriteAddr( Bit32u port, Bit8u val );
 	void WriteReg( Bit32u addr, Bit8u val );
+	//Write full register addresses in order, cheaper than separate WriteReg calls
+	void WriteRegs( const RegWrite* writes, Bitu count );
 	void Generate( Bit32s *buffer, Bitu samples );
-	void Init( Bitu rate );
+	//Same as Generate but also write every channel to stems[ channel ] in the same layout as buffer
+	//A 4-op pair ends up in the stem of its first channel, in percussion mode the bass drum
+	//goes into stem 6, hi-hat and snare into stem 7, tom-tom and top cymbal into stem 8
+	//Needs 9 stems in opl2 mode and 18 stems in opl3 mode
+	void GenerateStems( Bit32s *buffer, Bit32s **stems, Bitu samples );
+	//Stop generating channels that can't reach the output above this attenuation, they keep
+	//their phase and envelope running so they pick up in the right place after a key on.
+	//Anything from 72dB up only drops output below 1 LSB, 0 disables culling, the default
+	void SetCullThreshold( Bitu decibels );
+	void Init( Bitu rate, Quality quality = qualityFull );
+	//Return to the state of a fresh Init with the same rate, quality and cull threshold, a copy
+	//of a cached chip instead of rebuilding the tables and clearing every register
+	void Reset();
+	//Change the output rate, notes keep playing at the same pitch and envelope position
+	void SetRate( Bitu rate );
+	//Snapshot the chip and output clock, and go back to one taken at the same rate and quality.
+	//The trace handler and cull threshold are left as they are
+	void SaveState( HandlerState& state ) const;
+	void LoadState( const HandlerState& state );
 };
 
 
 }
+
+#endif
@@ -0,0 +1,343 @@
+#include <string.h>
+
+#include "flac.h"
+
+static const int kBitsPerSample = 16;
+static const int kMaxFixedOrder = 4;
+static const int kMaxPartitionOrder = 8;
+static const int kMaxRiceParameter = 14;
+
+// Channel assignments from the frame header, below these it is the channel count - 1
+static const uint8_t kLeftSide = 0x8;
+static const uint8_t kSideRight = 0x9;
+static const uint8_t kMidSide = 0xa;
+
+struct bit_writer_t
+{
+	std::vector<uint8_t> * out;
+	uint64_t acc;
+	int bits;
+};
+
+static void put_bits(bit_writer_t &w, uint32_t value, int count)
+{
+	if (count == 0)
+		return;
+	w.acc = (w.acc << count) | (value & (0xffffffffu >> (32 - count)));
+	w.bits += count;
+	while (w.bits >= 8) {
+		w.bits -= 8;
+		w.out->push_back((uint8_t)(w.acc >> w.bits));
+	}
+}
+
+static void put_rice(bit_writer_t &w, int32_t value, int k)
+{
+	uint32_t u = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+	uint32_t q = u >> k;
+	while (q >= 32) {
+		put_bits(w, 0, 32);
+		q -= 32;
+	}
+	put_bits(w, 1, q + 1);
+	put_bits(w, u, k);
+}
+
+static void align_bits(bit_writer_t &w)
+{
+	if (w.bits)
+		put_bits(w, 0, 8 - w.bits);
+}
+
+static uint8_t crc8(const uint8_t * data, size_t len)
+{
+	uint8_t crc = 0;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; b++)
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+	}
+	return crc;
+}
+
+// Built at compile time, the sink writer threads all encode at once
+struct crc16_table_t
+{
+	uint16_t entries[256];
+
+	constexpr crc16_table_t() : entries()
+	{
+		for (int i = 0; i < 256; i++) {
+			uint16_t crc = i << 8;
+			for (int b = 0; b < 8; b++)
+				crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+			entries[i] = crc;
+		}
+	}
+};
+
+static constexpr crc16_table_t kCrc16Table;
+
+static uint16_t crc16(const uint8_t * data, size_t len)
+{
+	uint16_t crc = 0;
+	for (size_t i = 0; i < len; i++)
+		crc = (uint16_t)(crc << 8) ^ kCrc16Table.entries[(crc >> 8) ^ data[i]];
+	return crc;
+}
+
+// Residual of the fixed predictor of order at sample i
+static int32_t fixed_residual(const int32_t * x, size_t i, int order)
+{
+	switch (order) {
+		case 0: return x[i];
+		case 1: return x[i] - x[i - 1];
+		case 2: return x[i] - 2 * x[i - 1] + x[i - 2];
+		case 3: return x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+		default: return x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+	}
+}
+
+static void compute_residual(const int32_t * x, size_t n, int order, std::vector<uint32_t> &residual)
+{
+	residual.resize(n);
+	for (size_t i = order; i < n; i++) {
+		int32_t r = fixed_residual(x, i, order);
+		residual[i] = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+	}
+}
+
+static int rice_parameter(uint64_t sum, size_t count)
+{
+	int k = 0;
+	while (k < kMaxRiceParameter && ((uint64_t)count << (k + 1)) < sum)
+		k++;
+	return k;
+}
+
+static uint64_t rice_estimate(uint64_t sum, size_t count)
+{
+	int k = rice_parameter(sum, count);
+	return count * (k + 1) + (sum >> k);
+}
+
+struct subframe_plan_t
+{
+	int order;            // -1 for a constant subframe, past kMaxFixedOrder for verbatim
+	int partition_order;
+	uint64_t bits;
+};
+
+// Pick the fixed predictor and partitioning that codes x in the fewest bits
+static subframe_plan_t plan_subframe(const int32_t * x, size_t n, int bps, std::vector<uint32_t> &residual)
+{
+	subframe_plan_t best{ -1, 0, (uint64_t)bps };
+	bool constant = true;
+	for (size_t i = 1; i < n && constant; i++)
+		constant = x[i] == x[0];
+	if (constant)
+		return best;
+	best = { 0, 0, ~0ull };
+	uint64_t sums[kMaxFixedOrder + 1] = {};
+	for (size_t i = kMaxFixedOrder; i < n; i++) {
+		for (int o = 0; o <= kMaxFixedOrder; o++) {
+			int32_t r = fixed_residual(x, i, o);
+			sums[o] += r < 0 ? -(int64_t)r : r;
+		}
+	}
+	int order = 0;
+	for (int o = 1; o <= kMaxFixedOrder && (size_t)o < n; o++) {
+		if (sums[o] < sums[order])
+			order = o;
+	}
+	compute_residual(x, n, order, residual);
+	// Sum the residual over the smallest partitions once, then merge them pairwise
+	if (n > (size_t)order) {
+		int max_order = 0;
+		while (max_order < kMaxPartitionOrder && ((n >> (max_order + 1)) << (max_order + 1)) == n &&
+			(n >> (max_order + 1)) > (size_t)order)
+			max_order++;
+		uint64_t part_sums[1 << kMaxPartitionOrder];
+		size_t size = n >> max_order;
+		for (size_t part = 0; part < ((size_t)1 << max_order); part++) {
+			uint64_t sum = 0;
+			for (size_t i = part == 0 ? order : part * size; i < (part + 1) * size; i++)
+				sum += residual[i];
+			part_sums[part] = sum;
+		}
+		for (int p = max_order; p >= 0; p--) {
+			size_t parts = (size_t)1 << p;
+			uint64_t bits = order * bps + 6;
+			for (size_t part = 0; part < parts; part++)
+				bits += 4 + rice_estimate(part_sums[part], (n >> p) - (part == 0 ? order : 0));
+			if (bits < best.bits)
+				best = { order, p, bits };
+			for (size_t part = 0; part < parts / 2; part++)
+				part_sums[part] = part_sums[part * 2] + part_sums[part * 2 + 1];
+		}
+	}
+	// Verbatim when prediction doesn't pay
+	if (best.bits > n * bps)
+		best = { kMaxFixedOrder + 1, 0, n * bps };
+	return best;
+}
+
+static void write_subframe(bit_writer_t &w, const int32_t * x, size_t n, int bps,
+	const subframe_plan_t &plan, std::vector<uint32_t> &residual)
+{
+	if (plan.order < 0) {
+		put_bits(w, 0x00, 8);
+		put_bits(w, x[0], bps);
+		return;
+	}
+	if (plan.order > kMaxFixedOrder) {
+		put_bits(w, 0x02, 8);
+		for (size_t i = 0; i < n; i++)
+			put_bits(w, x[i], bps);
+		return;
+	}
+	compute_residual(x, n, plan.order, residual);
+	put_bits(w, (0x08 | plan.order) << 1, 8);
+	for (int i = 0; i < plan.order; i++)
+		put_bits(w, x[i], bps);
+	put_bits(w, 0, 2);
+	put_bits(w, plan.partition_order, 4);
+	size_t size = n >> plan.partition_order;
+	for (size_t part = 0; part < ((size_t)1 << plan.partition_order); part++) {
+		size_t begin = part == 0 ? plan.order : part * size;
+		uint64_t sum = 0;
+		for (size_t i = begin; i < (part + 1) * size; i++)
+			sum += residual[i];
+		int k = rice_parameter(sum, (part + 1) * size - begin);
+		put_bits(w, k, 4);
+		for (size_t i = begin; i < (part + 1) * size; i++) {
+			uint32_t u = residual[i];
+			int32_t r = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+			put_rice(w, r, k);
+		}
+	}
+}
+
+// Frame numbers are coded like UTF-8, extended to 36 bits
+static void put_utf8(bit_writer_t &w, uint64_t v)
+{
+	if (v < 0x80) {
+		put_bits(w, v, 8);
+		return;
+	}
+	// Continuation bytes hold 6 bits each, the lead byte 6 - extra
+	int extra = 1;
+	while (extra < 6 && (v >> (6 * extra + 6 - extra)) != 0)
+		extra++;
+	put_bits(w, ((0xff00 >> (extra + 1)) & 0xff) | (uint32_t)(v >> (6 * extra)), 8);
+	for (int i = extra - 1; i >= 0; i--)
+		put_bits(w, 0x80 | ((v >> (6 * i)) & 0x3f), 8);
+}
+
+static void encode_frame(flac_info_t &info, const int16_t * pcm, size_t n, std::vector<uint8_t> &out)
+{
+	size_t start = out.size();
+	bit_writer_t w{ &out, 0, 0 };
+	std::vector<int32_t> x[4];
+	std::vector<uint32_t> residual;
+	for (int c = 0; c < 4; c++)
+		x[c].resize(n);
+	for (size_t i = 0; i < n; i++) {
+		int32_t l = pcm[i * info.channels];
+		int32_t r = info.channels == 2 ? pcm[i * 2 + 1] : 0;
+		x[0][i] = l;
+		x[1][i] = r;
+		x[2][i] = (l + r) >> 1;
+		x[3][i] = l - r;
+	}
+	// Plan left, right, mid and side, then take the cheapest pair
+	subframe_plan_t plans[4];
+	int channels = info.channels;
+	for (int c = 0; c < (channels == 2 ? 4 : 1); c++)
+		plans[c] = plan_subframe(x[c].data(), n, kBitsPerSample + (c == 3), residual);
+	uint8_t assignment = channels - 1;
+	int first = 0, second = 1;
+	if (channels == 2) {
+		uint64_t independent = plans[0].bits + plans[1].bits;
+		uint64_t left_side = plans[0].bits + plans[3].bits;
+		uint64_t side_right = plans[3].bits + plans[1].bits;
+		uint64_t mid_side = plans[2].bits + plans[3].bits;
+		uint64_t best = independent;
+		if (left_side < best) {
+			best = left_side;
+			assignment = kLeftSide;
+			first = 0, second = 3;
+		}
+		if (side_right < best) {
+			best = side_right;
+			assignment = kSideRight;
+			first = 3, second = 1;
+		}
+		if (mid_side < best) {
+			assignment = kMidSide;
+			first = 2, second = 3;
+		}
+	}
+
+	put_bits(w, 0xfff8, 16);
+	put_bits(w, 0x70, 8);           // 16 bit block size at the end of the header, rate from STREAMINFO
+	put_bits(w, (assignment << 4) | 0x08, 8);
+	put_utf8(w, info.frame_number);
+	put_bits(w, n - 1, 16);
+	out.push_back(crc8(out.data() + start, out.size() - start));
+
+	int order[2] = { first, second };
+	for (int c = 0; c < channels; c++) {
+		int s = order[c];
+		write_subframe(w, x[s].data(), n, kBitsPerSample + (s == 3), plans[s], residual);
+	}
+	align_bits(w);
+	uint16_t crc = crc16(out.data() + start, out.size() - start);
+	out.push_back(crc >> 8);
+	out.push_back(crc & 0xff);
+
+	uint32_t size = out.size() - start;
+	if (info.min_frame_size == 0 || size < info.min_frame_size)
+		info.min_frame_size = size;
+	if (size > info.max_frame_size)
+		info.max_frame_size = size;
+	info.frame_number++;
+	info.frames += n;
+}
+
+void flac_init(flac_info_t &info, uint32_t rate, uint16_t channels)
+{
+	info = flac_info_t{};
+	info.rate = rate;
+	info.channels = channels;
+}
+
+void flac_header(const flac_info_t &info, uint8_t * header)
+{
+	std::vector<uint8_t> out;
+	bit_writer_t w{ &out, 0, 0 };
+	put_bits(w, 0x664c6143, 32);    // fLaC
+	put_bits(w, 0x80, 8);           // last metadata block, STREAMINFO
+	put_bits(w, 34, 24);
+	put_bits(w, kFlacBlockSize, 16);
+	put_bits(w, kFlacBlockSize, 16);
+	put_bits(w, info.min_frame_size, 24);
+	put_bits(w, info.max_frame_size, 24);
+	put_bits(w, info.rate, 20);
+	put_bits(w, info.channels - 1, 3);
+	put_bits(w, kBitsPerSample - 1, 5);
+	put_bits(w, info.frames >> 32, 4);
+	put_bits(w, info.frames & 0xffffffff, 32);
+	// No MD5 of the audio, all zero means unknown
+	for (int i = 0; i < 4; i++)
+		put_bits(w, 0, 32);
+	memcpy(header, out.data(), kFlacHeaderSize);
+}
+
+void flac_encode(flac_info_t &info, const int16_t * pcm, size_t frames, std::vector<uint8_t> &out)
+{
+	for (size_t done = 0; done < frames; done += kFlacBlockSize) {
+		size_t n = frames - done < kFlacBlockSize ? frames - done : kFlacBlockSize;
+		encode_frame(info, pcm + done * info.channels, n, out);
+	}
+}
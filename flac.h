@@ -0,0 +1,37 @@
+#ifndef OPERATIC_FLAC_H
+#define OPERATIC_FLAC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// A small FLAC encoder for 16 bit interleaved PCM: fixed block size, fixed
+// predictors of order 0-4 with Rice coded residuals and the best of the four
+// stereo decorrelation modes per frame. No LPC, so files come out somewhat
+// larger than from the reference encoder, in exchange for encoding at a
+// small fraction of the cost of the emulator.
+
+static const size_t kFlacBlockSize = 4096;
+static const size_t kFlacHeaderSize = 42;
+
+struct flac_info_t
+{
+	uint32_t rate;
+	uint16_t channels;        // 1 or 2
+	uint64_t frames;          // sample frames written so far
+	uint32_t min_frame_size;  // bytes, for STREAMINFO
+	uint32_t max_frame_size;
+	uint64_t frame_number;    // next FLAC frame
+};
+
+void flac_init(flac_info_t &info, uint32_t rate, uint16_t channels);
+
+// The stream marker and STREAMINFO, written first and again with the final
+// totals once the stream is done
+void flac_header(const flac_info_t &info, uint8_t * header);
+
+// Append frames of pcm as FLAC frames of kFlacBlockSize, only the last call
+// of a stream may pass a count that is not a multiple of it
+void flac_encode(flac_info_t &info, const int16_t * pcm, size_t frames, std::vector<uint8_t> &out);
+
+#endif
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <poll.h>
+
+#include "midi.h"
+
+const midi_event_t * midi_peek(midi_input_t &midi)
+{
+	if (midi.events.empty())
+		return nullptr;
+	size_t head = midi.head.load(std::memory_order_relaxed);
+	if (head == midi.tail.load(std::memory_order_acquire))
+		return nullptr;
+	return &midi.events[head & (midi.events.size() - 1)];
+}
+
+void midi_play(midi_input_t &midi)
+{
+	size_t head = midi.head.load(std::memory_order_relaxed);
+	const midi_event_t &ev = midi.events[head & (midi.events.size() - 1)];
+	switch (ev.type) {
+		case kMidiNoteOn:
+			voices_note_on(midi.voices, ev.channel, ev.note, ev.velocity);
+			break;
+		case kMidiNoteOff:
+			voices_note_off(midi.voices, ev.channel, ev.note);
+			break;
+		case kMidiPitchBend:
+			voices_pitch_bend(midi.voices, ev.channel, ev.value);
+			break;
+		case kMidiAllOff:
+			voices_all_off(midi.voices);
+			break;
+	}
+	midi.head.store(head + 1, std::memory_order_release);
+}
+
+#ifdef OPERATIC_ALSA
+#include <alsa/asoundlib.h>
+
+static const int kPollTimeout = 100; // ms, only bounds how long midi_close waits
+// Events waiting for the audio side, a power of two
+static const size_t kQueueSize = 1024;
+
+// Waits for the audio side to make room rather than dropping a note off
+static void push(midi_input_t &midi, const midi_event_t &event)
+{
+	size_t tail = midi.tail.load(std::memory_order_relaxed);
+	while (tail - midi.head.load(std::memory_order_acquire) == midi.events.size()) {
+		if (!midi.running.load(std::memory_order_relaxed))
+			return;
+		std::this_thread::yield();
+	}
+	midi.events[tail & (midi.events.size() - 1)] = event;
+	midi.tail.store(tail + 1, std::memory_order_release);
+}
+
+static void handle_event(midi_input_t &midi, const snd_seq_event_t * ev)
+{
+	midi_event_t event{};
+	event.time = midi.clock();
+	switch (ev->type) {
+		case SND_SEQ_EVENT_NOTEON:
+			event.type = kMidiNoteOn;
+			event.channel = ev->data.note.channel;
+			event.note = ev->data.note.note;
+			event.velocity = ev->data.note.velocity;
+			break;
+		case SND_SEQ_EVENT_NOTEOFF:
+			event.type = kMidiNoteOff;
+			event.channel = ev->data.note.channel;
+			event.note = ev->data.note.note;
+			break;
+		case SND_SEQ_EVENT_PITCHBEND:
+			event.type = kMidiPitchBend;
+			event.channel = ev->data.control.channel;
+			event.value = ev->data.control.value;
+			break;
+		case SND_SEQ_EVENT_CONTROLLER:
+			// All sound off / all notes off
+			if (ev->data.control.param != 120 && ev->data.control.param != 123)
+				return;
+			event.type = kMidiAllOff;
+			break;
+		default:
+			return;
+	}
+	push(midi, event);
+}
+
+static void midi_thread(midi_input_t * midi)
+{
+	snd_seq_t * seq = (snd_seq_t*)midi->seq;
+	struct pollfd pfd[4];
+	int npfd = snd_seq_poll_descriptors_count(seq, POLLIN);
+	if (npfd > 4)
+		npfd = 4;
+	snd_seq_poll_descriptors(seq, pfd, npfd, POLLIN);
+	while (midi->running) {
+		if (poll(pfd, npfd, kPollTimeout) <= 0)
+			continue;
+		snd_seq_event_t * ev;
+		while (snd_seq_event_input(seq, &ev) >= 0)
+			handle_event(*midi, ev);
+	}
+}
+
+int midi_open(midi_input_t &midi, DBOPL::Handler * synth, std::mutex * lock, bool four_op, const char * connect, uint32_t (*clock)())
+{
+	snd_seq_t * seq;
+	int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK);
+	if (err < 0) {
+		fprintf(stderr, "Could not open ALSA sequencer: %s\n", snd_strerror(err));
+		return -1;
+	}
+	snd_seq_set_client_name(seq, "operatic");
+	midi.port = snd_seq_create_simple_port(seq, "operatic",
+		SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+		SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_SYNTHESIZER | SND_SEQ_PORT_TYPE_APPLICATION);
+	if (midi.port < 0) {
+		fprintf(stderr, "Could not create MIDI port: %s\n", snd_strerror(midi.port));
+		snd_seq_close(seq);
+		return -1;
+	}
+	if (connect != nullptr) {
+		snd_seq_addr_t addr;
+		if (snd_seq_parse_address(seq, &addr, connect) < 0 ||
+			snd_seq_connect_from(seq, midi.port, addr.client, addr.port) < 0) {
+			fprintf(stderr, "Could not connect to MIDI port %s\n", connect);
+		}
+	}
+	printf("MIDI input on port %d:%d\n", snd_seq_client_id(seq), midi.port);
+
+	midi.seq = seq;
+	midi.clock = clock;
+	midi.events.assign(kQueueSize, midi_event_t{});
+	midi.head = 0;
+	midi.tail = 0;
+	lock->lock();
+	voices_init(midi.voices, synth, four_op);
+	lock->unlock();
+	midi.running = true;
+	midi.thread = std::thread(midi_thread, &midi);
+	return 0;
+}
+
+void midi_close(midi_input_t &midi)
+{
+	if (midi.seq == nullptr)
+		return;
+	midi.running = false;
+	midi.thread.join();
+	snd_seq_close((snd_seq_t*)midi.seq);
+	midi.seq = nullptr;
+}
+
+#else
+
+int midi_open(midi_input_t &, DBOPL::Handler *, std::mutex *, bool, const char *, uint32_t (*)())
+{
+	fprintf(stderr, "operatic was built without ALSA, MIDI input is not available\n");
+	return -1;
+}
+
+void midi_close(midi_input_t &)
+{
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef OPERATIC_MIDI_H
+#define OPERATIC_MIDI_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "voices.h"
+
+// Live MIDI input through the ALSA sequencer. A virtual port named
+// "operatic" is always created so other clients can connect to it with
+// aconnect; connect optionally names a source port ("client:port") to
+// subscribe to right away.
+//
+// The MIDI thread only decodes events and queues them, stamped with clock
+// when they arrived. Whoever generates audio plays them on the chip with
+// midi_play at the sample their time maps to, so the MIDI thread never
+// touches the chip or a lock the audio side takes.
+
+struct midi_event_t
+{
+	uint64_t time;
+	uint8_t type;        // a kMidi* below
+	uint8_t channel;
+	uint8_t note;
+	uint8_t velocity;
+	int16_t value;       // pitch bend, -8192..8191
+};
+
+static const uint8_t kMidiNoteOn = 0;
+static const uint8_t kMidiNoteOff = 1;
+static const uint8_t kMidiPitchBend = 2;
+static const uint8_t kMidiAllOff = 3;
+
+struct midi_input_t
+{
+	void * seq;
+	int port;
+	uint32_t (*clock)();
+	voice_allocator_t voices;
+	// Lock free from the MIDI thread to the audio side, a power of two long
+	std::vector<midi_event_t> events;
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+	std::atomic<bool> running;
+	std::thread thread;
+};
+
+// Sets up the voices on synth, with lock held, before the MIDI thread starts
+int midi_open(midi_input_t &midi, DBOPL::Handler * synth, std::mutex * lock, bool four_op, const char * connect, uint32_t (*clock)());
+void midi_close(midi_input_t &midi);
+// The oldest event not played yet, nullptr when there is none
+const midi_event_t * midi_peek(midi_input_t &midi);
+// Play the event midi_peek returned on the voices and drop it, with the lock
+// that protects the chip held. Does not allocate or block
+void midi_play(midi_input_t &midi);
+
+#endif
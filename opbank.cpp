@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bank.h"
+
+static int list_bank(const char * path)
+{
+	bank_t bank;
+	if (0 != bank_open(bank, path))
+		return -1;
+	for (uint32_t i = 0; i < bank.count; i++) {
+		const bank_instrument_t &ins = bank.instruments[i];
+		if (ins.flags & BANK_BLANK)
+			continue;
+		printf("%4u %-32s%s%s%s\n", i, bank_name(bank, i),
+			(ins.flags & BANK_FOUR_OP) ? " 4-op" : "",
+			(ins.flags & BANK_DOUBLE_VOICE) ? " double" : "",
+			(ins.flags & BANK_FIXED_NOTE) ? " fixed" : "");
+	}
+	bank_close(bank);
+	return 0;
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc == 3 && strcmp(argv[1], "-l") == 0) {
+		return list_bank(argv[2]) == 0 ? 0 : 1;
+	}
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s output.opb input.{sbi,op2,wopl}...\n", argv[0]);
+		fprintf(stderr, "       %s -l bank.opb\n", argv[0]);
+		return 1;
+	}
+	std::vector<bank_entry_t> entries;
+	for (int i = 2; i < argc; i++) {
+		if (0 != bank_import(argv[i], entries))
+			return 1;
+	}
+	if (0 != bank_write(argv[1], entries))
+		return 1;
+	printf("Wrote %zu instruments to %s\n", entries.size(), argv[1]);
+	return 0;
+}
@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#include <clap/clap.h>
+
+#include "dbopl.h"
+#include "params.h"
+#include "voices.h"
+
+// CLAP instrument around one chip. The host calls process with blocks of any
+// size; notes and parameter changes take effect at the frame the host gave
+// them, and the chip writes straight into the host's float buffers through a
+// small scratch block. Nothing in process allocates or locks.
+//
+// The parameters are the patch of the editor: every operator parameter of the
+// modulator and the carrier, and the channel feedback. A change reaches the
+// notes already sounding as well as the ones started after it.
+
+using namespace DBOPL;
+
+static const uint32_t kScratchFrames = 512;
+static const float kGain = 2.0f / 32768.0f;
+static const clap_id kFeedbackParam = 2 * OP_COUNT;
+static const uint32_t kParamCount = 2 * OP_COUNT + 1;
+// Operator offsets of the modulator and carrier of the patch channel
+static const uint8_t kPatchOperators[2] = { 0x00, 0x03 };
+
+static const char * const operator_param_name[OP_COUNT] = {
+	"Tremolo",
+	"Vibrato",
+	"Sustain Mode",
+	"Key-scale Ratio",
+	"Frequency Multiplier",
+	"Key-scale Level",
+	"Output Level",
+	"Attack",
+	"Decay",
+	"Sustain",
+	"Release"
+};
+
+// The patch operatic starts with
+static const uint8_t kDefaults[kParamCount] = {
+	0, 1, 1, 0, 0x08, 0, 0x1f, 0x0e, 0x04, 0x09, 0x06,
+	0, 0, 1, 0, 0x02, 0, 0x00, 0x0e, 0x04, 0x04, 0x04,
+	0
+};
+
+struct plugin_t
+{
+	clap_plugin_t plugin;
+	const clap_host_t * host;
+	Handler synth;
+	voice_allocator_t voices;
+	double rate;
+	bool active;
+	Bit32s scratch[kScratchFrames * 2];
+	// Set from the main thread by state loads, written to the chip by process
+	std::atomic<uint8_t> values[kParamCount];
+	std::atomic<bool> patch_dirty;
+};
+
+static plugin_t * from(const clap_plugin_t * plugin)
+{
+	return (plugin_t *)plugin->plugin_data;
+}
+
+static uint8_t param_mask(clap_id id)
+{
+	return id == kFeedbackParam ? channel_param_mask[CH_FEEDBACK] : operator_param_mask[id % OP_COUNT];
+}
+
+// Write the whole register holding param id, built from the current values
+static void write_param(plugin_t * p, clap_id id)
+{
+	if (id == kFeedbackParam) {
+		p->synth.WriteReg(0xc0, p->values[kFeedbackParam] << 1);
+		return;
+	}
+	uint8_t op = id / OP_COUNT;
+	uint8_t reg = operator_param_reg[id % OP_COUNT];
+	uint8_t val = 0;
+	for (uint8_t i = 0; i < OP_COUNT; i++) {
+		if (operator_param_reg[i] == reg)
+			val |= p->values[op * OP_COUNT + i] << operator_param_shift[i];
+	}
+	p->synth.WriteReg(reg + kPatchOperators[op], val);
+}
+
+static void write_patch(plugin_t * p)
+{
+	for (uint8_t op = 0; op < 2; op++) {
+		write_param(p, op * OP_COUNT + OP_TREM);
+		write_param(p, op * OP_COUNT + OP_KSL);
+		write_param(p, op * OP_COUNT + OP_A);
+		write_param(p, op * OP_COUNT + OP_S);
+	}
+	write_param(p, kFeedbackParam);
+}
+
+static void reset_synth(plugin_t * p)
+{
+	p->synth.Reset();
+	// Also turns on opl3 mode, every voice goes to both speakers
+	voices_init(p->voices, &p->synth, false);
+	write_patch(p);
+}
+
+static uint8_t clamp_param(clap_id id, double value)
+{
+	if (value <= 0)
+		return 0;
+	return value >= param_mask(id) ? param_mask(id) : (uint8_t)(value + 0.5);
+}
+
+static void set_param(plugin_t * p, clap_id id, double value)
+{
+	if (id >= kParamCount)
+		return;
+	p->values[id] = clamp_param(id, value);
+	write_param(p, id);
+	voices_update_patch(p->voices);
+}
+
+static void handle_event(plugin_t * p, const clap_event_header_t * e)
+{
+	if (e->space_id != CLAP_CORE_EVENT_SPACE_ID)
+		return;
+	switch (e->type) {
+		case CLAP_EVENT_NOTE_ON: {
+			const clap_event_note_t * n = (const clap_event_note_t *)e;
+			if (n->key >= 0)
+				voices_note_on(p->voices, n->channel < 0 ? 0 : n->channel, n->key, 1 + (uint8_t)(n->velocity * 126.0 + 0.5));
+			break;
+		}
+		case CLAP_EVENT_NOTE_OFF:
+		case CLAP_EVENT_NOTE_CHOKE: {
+			const clap_event_note_t * n = (const clap_event_note_t *)e;
+			// A key of -1 is a wildcard
+			if (n->key < 0)
+				voices_all_off(p->voices);
+			else
+				voices_note_off(p->voices, n->channel < 0 ? 0 : n->channel, n->key);
+			break;
+		}
+		case CLAP_EVENT_PARAM_VALUE: {
+			const clap_event_param_value_t * v = (const clap_event_param_value_t *)e;
+			set_param(p, v->param_id, v->value);
+			break;
+		}
+		case CLAP_EVENT_MIDI: {
+			const uint8_t * data = ((const clap_event_midi_t *)e)->data;
+			uint8_t channel = data[0] & 0x0f;
+			switch (data[0] & 0xf0) {
+				case 0x80:
+					voices_note_off(p->voices, channel, data[1]);
+					break;
+				case 0x90:
+					voices_note_on(p->voices, channel, data[1], data[2]);
+					break;
+				case 0xb0:
+					// All sound off and all notes off
+					if (data[1] == 120 || data[1] == 123)
+						voices_all_off(p->voices);
+					break;
+				case 0xe0:
+					voices_pitch_bend(p->voices, channel, ((data[2] << 7) | data[1]) - 8192);
+					break;
+			}
+			break;
+		}
+	}
+}
+
+static void render(plugin_t * p, float * left, float * right, uint32_t frames)
+{
+	while (frames > 0) {
+		uint32_t todo = frames < kScratchFrames ? frames : kScratchFrames;
+		p->synth.Generate(p->scratch, todo);
+		for (uint32_t i = 0; i < todo; i++) {
+			left[i] = p->scratch[i * 2] * kGain;
+			right[i] = p->scratch[i * 2 + 1] * kGain;
+		}
+		left += todo;
+		right += todo;
+		frames -= todo;
+	}
+}
+
+static bool plugin_init(const clap_plugin_t *)
+{
+	return true;
+}
+
+static void plugin_destroy(const clap_plugin_t * plugin)
+{
+	delete from(plugin);
+}
+
+static bool plugin_activate(const clap_plugin_t * plugin, double sample_rate, uint32_t, uint32_t)
+{
+	plugin_t * p = from(plugin);
+	p->rate = sample_rate;
+	p->synth.Init((Bitu)(sample_rate + 0.5));
+	reset_synth(p);
+	p->patch_dirty = false;
+	p->active = true;
+	return true;
+}
+
+static void plugin_deactivate(const clap_plugin_t * plugin)
+{
+	from(plugin)->active = false;
+}
+
+static bool plugin_start_processing(const clap_plugin_t *)
+{
+	return true;
+}
+
+static void plugin_stop_processing(const clap_plugin_t *)
+{
+}
+
+static void plugin_reset(const clap_plugin_t * plugin)
+{
+	reset_synth(from(plugin));
+}
+
+static clap_process_status plugin_process(const clap_plugin_t * plugin, const clap_process_t * process)
+{
+	plugin_t * p = from(plugin);
+	if (p->patch_dirty.exchange(false)) {
+		write_patch(p);
+		voices_update_patch(p->voices);
+	}
+	const clap_input_events_t * in = process->in_events;
+	uint32_t frames = process->frames_count;
+	uint32_t events = in->size(in);
+	uint32_t next = 0;
+	uint32_t done = 0;
+	float * left = nullptr;
+	float * right = nullptr;
+	if (process->audio_outputs_count > 0 && process->audio_outputs[0].channel_count >= 2) {
+		left = process->audio_outputs[0].data32[0];
+		right = process->audio_outputs[0].data32[1];
+		process->audio_outputs[0].constant_mask = 0;
+	}
+	// Events come sorted by time, the block is split at every one of them
+	while (done < frames) {
+		uint32_t until = frames;
+		for (; next < events; next++) {
+			const clap_event_header_t * e = in->get(in, next);
+			if (e->time > done) {
+				until = e->time < frames ? e->time : frames;
+				break;
+			}
+			handle_event(p, e);
+		}
+		if (left != nullptr)
+			render(p, left + done, right + done, until - done);
+		done = until;
+	}
+	for (; next < events; next++)
+		handle_event(p, in->get(in, next));
+	return CLAP_PROCESS_CONTINUE;
+}
+
+static uint32_t params_count(const clap_plugin_t *)
+{
+	return kParamCount;
+}
+
+static bool params_get_info(const clap_plugin_t *, uint32_t index, clap_param_info_t * info)
+{
+	if (index >= kParamCount)
+		return false;
+	memset(info, 0, sizeof(*info));
+	info->id = index;
+	info->flags = CLAP_PARAM_IS_STEPPED | CLAP_PARAM_IS_AUTOMATABLE;
+	info->min_value = 0;
+	info->max_value = param_mask(index);
+	info->default_value = kDefaults[index];
+	if (index == kFeedbackParam) {
+		snprintf(info->name, sizeof(info->name), "Feedback");
+		snprintf(info->module, sizeof(info->module), "Channel");
+	} else {
+		snprintf(info->name, sizeof(info->name), "%s %s", index < OP_COUNT ? "Modulator" : "Carrier", operator_param_name[index % OP_COUNT]);
+		snprintf(info->module, sizeof(info->module), "%s", index < OP_COUNT ? "Modulator" : "Carrier");
+	}
+	return true;
+}
+
+static bool params_get_value(const clap_plugin_t * plugin, clap_id id, double * value)
+{
+	if (id >= kParamCount)
+		return false;
+	*value = from(plugin)->values[id];
+	return true;
+}
+
+static bool params_value_to_text(const clap_plugin_t *, clap_id id, double value, char * text, uint32_t size)
+{
+	if (id >= kParamCount)
+		return false;
+	snprintf(text, size, "%d", (int)(value + 0.5));
+	return true;
+}
+
+static bool params_text_to_value(const clap_plugin_t *, clap_id id, const char * text, double * value)
+{
+	if (id >= kParamCount)
+		return false;
+	char * end;
+	long v = strtol(text, &end, 0);
+	if (end == text || v < 0 || v > param_mask(id))
+		return false;
+	*value = v;
+	return true;
+}
+
+// Called instead of process while the plugin is not processing, never both at once
+static void params_flush(const clap_plugin_t * plugin, const clap_input_events_t * in, const clap_output_events_t *)
+{
+	plugin_t * p = from(plugin);
+	uint32_t events = in->size(in);
+	for (uint32_t i = 0; i < events; i++) {
+		const clap_event_header_t * e = in->get(in, i);
+		if (e->space_id != CLAP_CORE_EVENT_SPACE_ID || e->type != CLAP_EVENT_PARAM_VALUE)
+			continue;
+		const clap_event_param_value_t * v = (const clap_event_param_value_t *)e;
+		if (p->active)
+			set_param(p, v->param_id, v->value);
+		else if (v->param_id < kParamCount)
+			p->values[v->param_id] = clamp_param(v->param_id, v->value);
+	}
+}
+
+static const clap_plugin_params_t params_extension = {
+	params_count,
+	params_get_info,
+	params_get_value,
+	params_value_to_text,
+	params_text_to_value,
+	params_flush,
+};
+
+static uint32_t audio_ports_count(const clap_plugin_t *, bool is_input)
+{
+	return is_input ? 0 : 1;
+}
+
+static bool audio_ports_get(const clap_plugin_t *, uint32_t index, bool is_input, clap_audio_port_info_t * info)
+{
+	if (is_input || index != 0)
+		return false;
+	info->id = 0;
+	snprintf(info->name, sizeof(info->name), "Output");
+	info->flags = CLAP_AUDIO_PORT_IS_MAIN;
+	info->channel_count = 2;
+	info->port_type = CLAP_PORT_STEREO;
+	info->in_place_pair = CLAP_INVALID_ID;
+	return true;
+}
+
+static const clap_plugin_audio_ports_t audio_ports_extension = {
+	audio_ports_count,
+	audio_ports_get,
+};
+
+static uint32_t note_ports_count(const clap_plugin_t *, bool is_input)
+{
+	return is_input ? 1 : 0;
+}
+
+static bool note_ports_get(const clap_plugin_t *, uint32_t index, bool is_input, clap_note_port_info_t * info)
+{
+	if (!is_input || index != 0)
+		return false;
+	info->id = 0;
+	info->supported_dialects = CLAP_NOTE_DIALECT_CLAP | CLAP_NOTE_DIALECT_MIDI;
+	info->preferred_dialect = CLAP_NOTE_DIALECT_CLAP;
+	snprintf(info->name, sizeof(info->name), "Notes");
+	return true;
+}
+
+static const clap_plugin_note_ports_t note_ports_extension = {
+	note_ports_count,
+	note_ports_get,
+};
+
+// The state is the parameter values in id order, one byte each
+static bool state_save(const clap_plugin_t * plugin, const clap_ostream_t * stream)
+{
+	uint8_t values[kParamCount];
+	for (uint32_t i = 0; i < kParamCount; i++)
+		values[i] = from(plugin)->values[i];
+	size_t written = 0;
+	while (written < kParamCount) {
+		int64_t n = stream->write(stream, values + written, kParamCount - written);
+		if (n <= 0)
+			return false;
+		written += n;
+	}
+	return true;
+}
+
+static bool state_load(const clap_plugin_t * plugin, const clap_istream_t * stream)
+{
+	plugin_t * p = from(plugin);
+	uint8_t values[kParamCount];
+	size_t read = 0;
+	while (read < kParamCount) {
+		int64_t n = stream->read(stream, values + read, kParamCount - read);
+		if (n <= 0)
+			return false;
+		read += n;
+	}
+	for (uint32_t i = 0; i < kParamCount; i++)
+		p->values[i] = values[i] & param_mask(i);
+	p->patch_dirty = true;
+	return true;
+}
+
+static const clap_plugin_state_t state_extension = {
+	state_save,
+	state_load,
+};
+
+static const void * plugin_get_extension(const clap_plugin_t *, const char * id)
+{
+	if (strcmp(id, CLAP_EXT_PARAMS) == 0)
+		return &params_extension;
+	if (strcmp(id, CLAP_EXT_AUDIO_PORTS) == 0)
+		return &audio_ports_extension;
+	if (strcmp(id, CLAP_EXT_NOTE_PORTS) == 0)
+		return &note_ports_extension;
+	if (strcmp(id, CLAP_EXT_STATE) == 0)
+		return &state_extension;
+	return nullptr;
+}
+
+static void plugin_on_main_thread(const clap_plugin_t *)
+{
+}
+
+static const char * const features[] = {
+	CLAP_PLUGIN_FEATURE_INSTRUMENT,
+	CLAP_PLUGIN_FEATURE_SYNTHESIZER,
+	CLAP_PLUGIN_FEATURE_STEREO,
+	nullptr,
+};
+
+static const clap_plugin_descriptor_t descriptor = {
+	CLAP_VERSION_INIT,
+	"com.github.pmlt.operatic",
+	"operatic",
+	"operatic",
+	"https://github.com/pmlt/operatic",
+	"",
+	"",
+	"1.0",
+	"OPL3 FM synthesizer",
+	features,
+};
+
+static const clap_plugin_t * create_plugin(const clap_plugin_factory_t *, const clap_host_t * host, const char * id)
+{
+	if (!clap_version_is_compatible(host->clap_version) || strcmp(id, descriptor.id) != 0)
+		return nullptr;
+	plugin_t * p = new plugin_t();
+	p->plugin.desc = &descriptor;
+	p->plugin.plugin_data = p;
+	p->plugin.init = plugin_init;
+	p->plugin.destroy = plugin_destroy;
+	p->plugin.activate = plugin_activate;
+	p->plugin.deactivate = plugin_deactivate;
+	p->plugin.start_processing = plugin_start_processing;
+	p->plugin.stop_processing = plugin_stop_processing;
+	p->plugin.reset = plugin_reset;
+	p->plugin.process = plugin_process;
+	p->plugin.get_extension = plugin_get_extension;
+	p->plugin.on_main_thread = plugin_on_main_thread;
+	p->host = host;
+	p->active = false;
+	for (uint32_t i = 0; i < kParamCount; i++)
+		p->values[i] = kDefaults[i];
+	p->patch_dirty = false;
+	return &p->plugin;
+}
+
+static uint32_t factory_count(const clap_plugin_factory_t *)
+{
+	return 1;
+}
+
+static const clap_plugin_descriptor_t * factory_descriptor(const clap_plugin_factory_t *, uint32_t index)
+{
+	return index == 0 ? &descriptor : nullptr;
+}
+
+static const clap_plugin_factory_t factory = {
+	factory_count,
+	factory_descriptor,
+	create_plugin,
+};
+
+static bool entry_init(const char *)
+{
+	return true;
+}
+
+static void entry_deinit()
+{
+}
+
+static const void * entry_get_factory(const char * id)
+{
+	return strcmp(id, CLAP_PLUGIN_FACTORY_ID) == 0 ? &factory : nullptr;
+}
+
+extern "C" CLAP_EXPORT const clap_plugin_entry_t clap_entry = {
+	CLAP_VERSION_INIT,
+	entry_init,
+	entry_deinit,
+	entry_get_factory,
+};
@@ -1,12 +1,28 @@
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <thread>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_video.h>
 #include <SDL2/SDL_events.h>
 #include <SDL2/SDL_keyboard.h>
 #include <SDL2/SDL_ttf.h>
 
+#include "bank.h"
 #include "dbopl.h"
+#include "midi.h"
+#include "osc.h"
+#include "params.h"
+#include "shmstream.h"
+#include "pcmring.h"
+#include "realtime.h"
+#include "regqueue.h"
+#include "regtrace.h"
+#include "timeline.h"
 
 using namespace DBOPL;
 
@@ -16,52 +32,23 @@ static const Bitu kBufferSize = 256;
 static const Bit32u kPort = 0x220;
 static const int16_t kGain = (1 << 15) / (1 << 12);
 static const uint16_t kFNumberMask = (1 << 10) - 1;
-
-enum operator_param
-{
-	OP_TREM,
-	OP_VIB,
-	OP_SUSTAIN,
-	OP_KSR,
-	OP_FMULTI,
-	OP_KSL,
-	OP_OLVL,
-	OP_A,
-	OP_D,
-	OP_S,
-	OP_R,
-	OP_COUNT
-};
-
-enum channel_param
-{
-	CH_FNUMBER = 0,
-	CH_FEEDBACK,
-	CH_OCTAVE,
-	CH_KEYON,
-	CH_COUNT
-};
-
-uint8_t operator_param_mask[OP_COUNT] = {
-	0x01,
-	0x01,
-	0x01,
-	0x01,
-	0x0F, // multi: 4 bits
-	0x03, // ksl: 3 bits
-	0x3f, // output level: 6 bits
-	0x0F,
-	0x0F,
-	0x0F,
-	0x0F
-};
-
-uint16_t channel_param_mask[CH_COUNT] = {
-	0x03ff, // f-number: 10 bits
-	0x0007, // feedback: 3 bits
-	0x0007, // octave: 3 bits
-	0x0001, // key-on: 1 bit
-};
+// About 20 minutes of busy MIDI playing, 8 MB
+static const size_t kTraceRecords = 1 << 20;
+static const size_t kTimelineEvents = 1 << 16;
+// Editor writes waiting for the audio callback, a full patch is under 200
+static const size_t kRegisterQueueSize = 4096;
+// Writes made while one buffer plays are placed in the next, this much later
+static const Uint32 kBufferTicks = kBufferSize * 1000 / kRate;
+// The editor is drawn about 60 times a second
+static const Uint32 kFrameTicks = 16;
+// Stack the audio callback may use without faulting in realtime mode
+static const size_t kRealtimeStack = 256 * 1024;
+static const int kTimelineKey = 70; // Print Screen
+// Render-ahead: the worker generates this many frames at a time, and the lead
+// it keeps adapts between one callback and the maximum
+static const Bitu kAheadBlock = 64;
+static const uint32_t kAheadDefaultMs = 10;
+static const uint32_t kAheadMaxMs = 100;
 
 uint8_t operator_param_shortcut[OP_COUNT] = {
 	20, // Q
@@ -156,6 +143,12 @@ struct app_renderer_t
 	int y;
 	int lineheight;
 	int lineskip;
+#if DBOPL_COUNTERS
+	// Emulator counters per second, refreshed once a second
+	DBOPL::Counters counters;
+	DBOPL::Counters counter_rates;
+	uint32_t counter_ticks;
+#endif
 };
 
 struct app_state_t
@@ -169,12 +162,46 @@ struct app_state_t
 	uint8_t current_param_type;
 	uint8_t current_param;
 	Handler synth;
-	Bit32s buffer[kBufferSize];
+	// Stereo frames while the chip is in opl3 mode, mixed down in place
+	Bit32s buffer[kBufferSize * 2];
 	app_renderer_t render_state;
 	bool bContinue;
 } app_state;
 
 std::mutex synth_lock;
+// Register writes from the main thread to the audio callback, in SDL ticks
+regqueue_t register_queue;
+midi_input_t midi_input;
+osc_input_t osc_input;
+// Register stream of an external producer, not mapped without --shm
+shmstream_t shm_input;
+regtrace_t trace;
+const char * timeline_path = nullptr;
+// Set before the audio device starts
+bool realtime = false;
+int realtime_cpu = -1;
+
+// A worker keeps lead frames generated ahead of the audio callback, which
+// then only copies them out of the ring
+struct ahead_t
+{
+	pcmring_t ring;
+	std::thread thread;
+	std::atomic<bool> running;
+	std::atomic<uint32_t> lead;
+	uint32_t min_lead;
+	uint32_t max_lead;
+	// Set by the callback: SDL ticks in the top half, ring frames read at
+	// that time in the bottom half
+	std::atomic<uint64_t> clock;
+	// Lowest fill the callback found over the last second, and how many
+	// seconds it has reported
+	std::atomic<uint32_t> low;
+	std::atomic<uint32_t> windows;
+	std::atomic<uint32_t> underruns;
+};
+bool ahead_enabled = false;
+ahead_t ahead;
 
 uint8_t get_operator(app_state_t &app_state)
 {
@@ -252,80 +279,311 @@ void step_param(app_state_t &app_state, int step)
 	}
 }
 
+// SDL owns the audio thread, promote it on its first callback
+static void promote_audio_thread()
+{
+	static bool promoted = false;
+	if (realtime && !promoted) {
+		realtime_promote(kRealtimePriority, realtime_cpu);
+		realtime_prefault_stack(kRealtimeStack);
+		promoted = true;
+	}
+}
+
+// Generate mono frames into out, which has room for twice as many. In opl3
+// mode, which --four-op, OSC or shm writes can switch on, the chip writes
+// stereo frames
+static void generate_mono(Handler &synth, Bit32s * out, Bitu frames)
+{
+	bool stereo = synth.chip.opl3Active != 0;
+	synth.Generate(out, frames);
+	if (stereo) {
+		for (Bitu i = 0; i < frames; i++)
+			out[i] = (out[i * 2] + out[i * 2 + 1]) / 2;
+	}
+}
+
+// Generate frames into buffer with the queued editor and OSC writes, MIDI
+// events and shm writes each at its own sample, whichever is earlier first.
+// offset_of places those stamped with SDL ticks, shm writes carry their frame
+// on the shm clock. Those that land after the end are left for the next
+// block. buffer has room for twice frames. Called with synth_lock held
+template< typename offset_fn >
+static void generate_block(app_state_t * state, Bit32s * buffer, Bitu frames, offset_fn offset_of)
+{
+	enum { kEditor, kMidi, kOsc, kShm, kSources };
+	const Sint64 later = (Sint64)frames + 1;
+	uint64_t shm_clock = shm_input.header != nullptr ? shmstream_clock(shm_input) : 0;
+	// Another process can keep the ring full, take at most one ring per block
+	size_t shm_left = shm_input.header != nullptr ? shm_input.header->write_capacity : 0;
+	Bitu done = 0;
+	for (;;) {
+		const regqueue_write_t * write = regqueue_peek(register_queue);
+		const midi_event_t * event = midi_peek(midi_input);
+		const regqueue_write_t * osc = regqueue_peek(osc_input.queue);
+		const shmstream_write_t * shm = shm_left > 0 ? shmstream_peek(shm_input) : nullptr;
+		Sint64 at[kSources] = {
+			write ? offset_of((Uint32)write->time) : later,
+			event ? offset_of((Uint32)event->time) : later,
+			osc ? offset_of((Uint32)osc->time) : later,
+			later,
+		};
+		if (shm && shm->time < shm_clock + frames)
+			at[kShm] = shm->time > shm_clock ? (Sint64)(shm->time - shm_clock) : 0;
+		int source = kEditor;
+		for (int i = 1; i < kSources; i++) {
+			if (at[i] < at[source])
+				source = i;
+		}
+		Sint64 offset = at[source];
+		if (offset > (Sint64)frames)
+			break;
+		if (offset > (Sint64)done) {
+			generate_mono(state->synth, buffer + done, offset - done);
+			done = offset;
+		}
+		switch (source) {
+		case kEditor:
+			state->synth.WriteReg(write->reg, write->val);
+			regqueue_pop(register_queue);
+			break;
+		case kMidi:
+			midi_play(midi_input);
+			break;
+		case kOsc: {
+			// OSC parameter messages only change their own bits
+			uint16_t reg = osc->reg & 0x1ff;
+			uint8_t val = (state->synth.chip.regShadow[reg] & ~osc->mask) | (osc->val & osc->mask);
+			state->synth.WriteReg(reg, val);
+			regqueue_pop(osc_input.queue);
+			break;
+		}
+		case kShm:
+			state->synth.WriteReg(shm->reg & 0x1ff, shm->val);
+			shmstream_pop(shm_input);
+			shm_left--;
+			break;
+		}
+	}
+	if (done < frames)
+		generate_mono(state->synth, buffer + done, frames - done);
+	if (shm_input.header != nullptr)
+		shmstream_advance(shm_input, frames);
+}
+
 void audio_render_cb(void* userdata, Uint8* stream, int)
 {
 	app_state_t * state = (app_state_t*)userdata;
-	synth_lock.lock();
-	state->synth.Generate(state->buffer, kBufferSize);
+	promote_audio_thread();
+	timeline_thread_name("audio");
+	timeline_scope_t scope("audio_render_cb");
+	realtime_guard_t guard(realtime);
+	{
+		timeline_scope_t wait("synth_lock wait");
+		realtime_lock(synth_lock);
+	}
+	{
+		// Writes keep their distance from each other, with a fixed latency of
+		// one buffer, instead of all landing at the start of the next buffer.
+		// Writes from after now belong to the next callback
+		timeline_scope_t generate("Handler::Generate");
+		Uint32 start = SDL_GetTicks() - kBufferTicks;
+		generate_block(state, state->buffer, kBufferSize, [start](Uint32 time) -> Sint64 {
+			Sint32 since = (Sint32)(time - start);
+			if (since > (Sint32)kBufferTicks)
+				return kBufferSize + 1;
+			Sint64 offset = since <= 0 ? 0 : (Sint64)since * kRate / 1000;
+			return offset > (Sint64)kBufferSize ? kBufferSize : offset;
+		});
+	}
 	synth_lock.unlock();
 	uint16_t * pcm = (uint16_t*)stream;
 	for (int i=0; i < (int)kBufferSize; i++)
 		pcm[i] = (int16_t)state->buffer[i] * kGain;
 }
 
-void write_register(app_state_t &state, Bit32u addr, Bit32u reg, Bit8u val)
+// With render-ahead the callback only copies from the ring, an underrun plays
+// silence for the missing part
+void audio_ahead_cb(void*, Uint8* stream, int)
+{
+	promote_audio_thread();
+	timeline_thread_name("audio");
+	timeline_scope_t scope("audio_ahead_cb");
+	realtime_guard_t guard(realtime);
+	int16_t * pcm = (int16_t*)stream;
+	size_t fill = pcmring_fill(ahead.ring);
+	size_t got = pcmring_read(ahead.ring, pcm, kBufferSize);
+	if (got < kBufferSize) {
+		memset(pcm + got, 0, (kBufferSize - got) * sizeof(int16_t));
+		ahead.underruns.fetch_add(1, std::memory_order_relaxed);
+	}
+	uint64_t played = ahead.ring.head.load(std::memory_order_relaxed);
+	ahead.clock.store(((uint64_t)SDL_GetTicks() << 32) | (uint32_t)played, std::memory_order_release);
+
+	static size_t low = SIZE_MAX;
+	static size_t frames = 0;
+	if (fill < low)
+		low = fill;
+	frames += kBufferSize;
+	if (frames >= kRate) {
+		ahead.low.store(low, std::memory_order_relaxed);
+		ahead.windows.fetch_add(1, std::memory_order_release);
+		low = SIZE_MAX;
+		frames = 0;
+	}
+}
+
+// Size the lead after the lowest fill the callback found over the last
+// second: what the worker fell behind by, plus one callback and one block.
+// Grow at once, by half at least after an underrun, and shrink slowly
+static void adapt_lead(uint32_t &underruns)
+{
+	uint32_t lead = ahead.lead.load(std::memory_order_relaxed);
+	uint32_t low = ahead.low.load(std::memory_order_relaxed);
+	uint32_t behind = low < lead ? lead - low : 0;
+	uint32_t want = behind + kBufferSize + kAheadBlock;
+	uint32_t count = ahead.underruns.load(std::memory_order_relaxed);
+	if (count != underruns && want < lead + lead / 2)
+		want = lead + lead / 2;
+	underruns = count;
+	if (want > lead)
+		lead = want;
+	else
+		lead -= (lead - want) / 8;
+	if (lead < ahead.min_lead)
+		lead = ahead.min_lead;
+	if (lead > ahead.max_lead)
+		lead = ahead.max_lead;
+	ahead.lead.store(lead, std::memory_order_relaxed);
+}
+
+// Keeps the ring filled up to the lead. Writes land lead frames after the
+// sample the callback was playing when they were made, so their spacing is
+// kept however far ahead the worker runs
+void ahead_thread(app_state_t * state)
+{
+	timeline_thread_name("ahead");
+	if (realtime)
+		realtime_promote(kRealtimePriority - 1, realtime_cpu);
+	// Room for stereo frames, generate_block mixes opl3 output down
+	Bit32s mix[kAheadBlock * 2];
+	int16_t pcm[kAheadBlock];
+	uint32_t windows = 0;
+	uint32_t underruns = 0;
+	while (ahead.running.load(std::memory_order_relaxed)) {
+		uint32_t reported = ahead.windows.load(std::memory_order_acquire);
+		if (reported != windows) {
+			windows = reported;
+			adapt_lead(underruns);
+		}
+		uint32_t lead = ahead.lead.load(std::memory_order_relaxed);
+		if (pcmring_fill(ahead.ring) + kAheadBlock > lead) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		timeline_scope_t scope("render ahead");
+		uint64_t clock = ahead.clock.load(std::memory_order_acquire);
+		Uint32 ticks = clock >> 32;
+		uint32_t played = (uint32_t)clock;
+		uint32_t written = (uint32_t)ahead.ring.tail.load(std::memory_order_relaxed);
+		{
+			std::lock_guard<std::mutex> guard(synth_lock);
+			generate_block(state, mix, kAheadBlock, [=](Uint32 time) -> Sint64 {
+				Sint32 since = (Sint32)(time - ticks);
+				uint32_t frame = played + (uint32_t)((Sint64)since * (Sint64)kRate / 1000) + lead;
+				Sint32 offset = (Sint32)(frame - written);
+				return offset < 0 ? 0 : offset;
+			});
+		}
+		for (Bitu i = 0; i < kAheadBlock; i++)
+			pcm[i] = (int16_t)mix[i] * kGain;
+		pcmring_write(ahead.ring, pcm, kAheadBlock);
+	}
+}
+
+// The clock MIDI events and OSC writes are stamped with, the same as the editor's
+static uint32_t sdl_ticks()
+{
+	return SDL_GetTicks();
+}
+
+// Queue a write for the audio callback, waiting for it to make room when the
+// queue is full
+void write_register(Uint32 time, Bit32u addr, Bit32u reg, Bit8u val)
 {
 	printf("WRITE %d-0x%02x: 0x%02x\n", addr, reg, val);
-	state.synth.WriteReg(state.synth.WriteAddr(addr, reg), val);
+	while (!regqueue_push(register_queue, time, (addr << 8) | reg, val))
+		std::this_thread::yield();
 }
 
-void handle_events(app_state_t &app_state)
-{
-	SDL_Event event;
-	while (SDL_PollEvent(&event)) {
-		int sc = event.key.keysym.scancode;
-		int param;
-		switch (event.type) {
-			case SDL_KEYDOWN:
-				printf("SDL KEYDOWN: %d\n", sc);
-				if (sc >= 58 && sc < 70) {
-					// F1-F12; select a channel
-					app_state.current_channel = sc - 58;
-					printf("Selected channel: %d\n", app_state.current_channel);
-				}
-				else if (sc >= 30 && sc < 34) {
-					// 1-4; select channel operator
-					app_state.current_operator = sc - 30;
-					printf("Selected operator: %d\n", app_state.current_operator);
-				}
-				else if ((param = is_channel_shortcut(sc)) >= 0) {
-					select_channel_param(app_state, param);
-				}
-				else if ((param = is_operator_shortcut(sc)) >= 0) {
-					select_operator_param(app_state, param);
-				}
-				else
-				{
-					switch (sc) {
-						case 81: // Arrow-Down
-							step_param(app_state, -1);
-							break;
-						case 82: // Arrow-Up
-							step_param(app_state, 1);
-							break;
-						case 44: // Spacebar
-							set_channel_param(app_state, CH_KEYON, 1);
-							break;
-					}
-				}
-				break;
-			case SDL_KEYUP:
-				printf("SDL KEYUP: %d\n", event.key.keysym.scancode);
+// Apply queued writes straight away, only while the audio device is paused
+void flush_registers(app_state_t &app_state)
+{
+	const regqueue_write_t * write;
+	while ((write = regqueue_peek(register_queue)) != nullptr) {
+		app_state.synth.WriteReg(write->reg, write->val);
+		regqueue_pop(register_queue);
+	}
+}
+
+void handle_event(app_state_t &app_state, const SDL_Event &event)
+{
+	int sc = event.key.keysym.scancode;
+	int param;
+	switch (event.type) {
+		case SDL_KEYDOWN:
+			printf("SDL KEYDOWN: %d\n", sc);
+			if (sc >= 58 && sc < 70) {
+				// F1-F12; select a channel
+				app_state.current_channel = sc - 58;
+				printf("Selected channel: %d\n", app_state.current_channel);
+			}
+			else if (sc >= 30 && sc < 34) {
+				// 1-4; select channel operator
+				app_state.current_operator = sc - 30;
+				printf("Selected operator: %d\n", app_state.current_operator);
+			}
+			else if ((param = is_channel_shortcut(sc)) >= 0) {
+				select_channel_param(app_state, param);
+			}
+			else if ((param = is_operator_shortcut(sc)) >= 0) {
+				select_operator_param(app_state, param);
+			}
+			else
+			{
 				switch (sc) {
-					case 44:
-						set_channel_param(app_state, CH_KEYON, 0);
+					case 81: // Arrow-Down
+						step_param(app_state, -1);
+						break;
+					case 82: // Arrow-Up
+						step_param(app_state, 1);
+						break;
+					case 44: // Spacebar
+						set_channel_param(app_state, CH_KEYON, 1);
+						break;
+					case kTimelineKey:
+						if (timeline_path != nullptr && 0 == timeline_export(timeline_path))
+							printf("Timeline written to %s\n", timeline_path);
 						break;
 				}
-				break;
-			case SDL_QUIT:
-				app_state.bContinue = false;
-		}
+			}
+			break;
+		case SDL_KEYUP:
+			printf("SDL KEYUP: %d\n", event.key.keysym.scancode);
+			switch (sc) {
+				case 44:
+					set_channel_param(app_state, CH_KEYON, 0);
+					break;
+			}
+			break;
+		case SDL_QUIT:
+			app_state.bContinue = false;
 	}
 }
 
-void update_synth(app_state_t &app_state)
+// Queue the writes for every edited parameter, time is when the edit was made
+void update_synth(app_state_t &app_state, Uint32 time)
 {
-	synth_lock.lock();
 	for (int i=0; i < 18; i++) {
 		if (app_state.channel_dirty[i]) {
 			uint32_t addr = i <= 8 ? 0 : 1;
@@ -333,13 +591,15 @@ void update_synth(app_state_t &app_state)
 			channel_state_t * chan = app_state.channels + i;
 			uint16_t fnumber = chan->params[CH_FNUMBER];
 			uint8_t fnlo = fnumber & 0xff;
-			write_register(app_state, addr, 0xa0 | reg_offset, fnlo);
+			write_register(time, addr, 0xa0 | reg_offset, fnlo);
 			uint8_t keyon = chan->params[CH_KEYON] << 5;
 			uint8_t block = chan->params[CH_OCTAVE] << 2;
 			uint8_t fnhi = fnumber >> 8;
-			write_register(app_state, addr, 0xb0 | reg_offset, keyon | block | fnhi);
-			uint8_t fb = chan->params[CH_FEEDBACK] << 1;
-			write_register(app_state, addr, 0xc0 | reg_offset, fb);
+			write_register(time, addr, 0xb0 | reg_offset, keyon | block | fnhi);
+			// Both speakers, opl2 mode ignores these bits but opl3 mode,
+			// which --midi turns on, plays nothing without them
+			uint8_t fb = 0x30 | chan->params[CH_FEEDBACK] << 1;
+			write_register(time, addr, 0xc0 | reg_offset, fb);
 			app_state.channel_dirty[i] = 0;
 		}
 	}
@@ -353,20 +613,19 @@ void update_synth(app_state_t &app_state)
 			uint8_t sus = op->params[OP_SUSTAIN] << 5;
 			uint8_t ksr = op->params[OP_KSR] << 4;
 			uint8_t mul = op->params[OP_FMULTI];
-			write_register(app_state, addr, 0x20 + reg_offset, trem | vib | sus | ksr | mul);
+			write_register(time, addr, 0x20 + reg_offset, trem | vib | sus | ksr | mul);
 			uint8_t ksl = op->params[OP_KSL] << 6;
 			uint8_t olvl = op->params[OP_OLVL];
-			write_register(app_state, addr, 0x40 + reg_offset, ksl | olvl);
+			write_register(time, addr, 0x40 + reg_offset, ksl | olvl);
 			uint8_t a = op->params[OP_A] << 4;
 			uint8_t d = op->params[OP_D];
-			write_register(app_state, addr, 0x60 + reg_offset, a | d);
+			write_register(time, addr, 0x60 + reg_offset, a | d);
 			uint8_t s = op->params[OP_S] << 4;
 			uint8_t r = op->params[OP_R];
-			write_register(app_state, addr, 0x80 + reg_offset, s | r);
+			write_register(time, addr, 0x80 + reg_offset, s | r);
 			app_state.operator_dirty[i] = 0;
 		}
 	}
-	synth_lock.unlock();
 }
 
 void setup_patch(app_state_t &app)
@@ -393,13 +652,94 @@ void setup_patch(app_state_t &app)
 	set_channel_param(app, CH_FNUMBER, 0x03FF);
 }
 
+// Load the editable parameters of channel 0 from a bank instrument
+void load_instrument(app_state_t &app, const bank_instrument_t &ins)
+{
+	app.current_channel = 0;
+	int ops = (ins.flags & BANK_FOUR_OP) ? 4 : 2;
+	for (int i = 0; i < ops; i++) {
+		const uint8_t * regs = ins.regs[i];
+		app.current_operator = i;
+		set_operator_param(app, OP_TREM, regs[BANK_REG_20] >> 7);
+		set_operator_param(app, OP_VIB, (regs[BANK_REG_20] >> 6) & 1);
+		set_operator_param(app, OP_SUSTAIN, (regs[BANK_REG_20] >> 5) & 1);
+		set_operator_param(app, OP_KSR, (regs[BANK_REG_20] >> 4) & 1);
+		set_operator_param(app, OP_FMULTI, regs[BANK_REG_20] & 0x0f);
+		set_operator_param(app, OP_KSL, regs[BANK_REG_40] >> 6);
+		set_operator_param(app, OP_OLVL, regs[BANK_REG_40] & 0x3f);
+		set_operator_param(app, OP_A, regs[BANK_REG_60] >> 4);
+		set_operator_param(app, OP_D, regs[BANK_REG_60] & 0x0f);
+		set_operator_param(app, OP_S, regs[BANK_REG_80] >> 4);
+		set_operator_param(app, OP_R, regs[BANK_REG_80] & 0x0f);
+	}
+	set_channel_param(app, CH_FEEDBACK, (ins.c0[0] >> 1) & 0x07);
+	app.current_operator = 0;
+}
+
 int init_video(app_state_t &app);
 void term_video(app_state_t &app);
 void render_video(app_state_t &app);
 
-int main()
+int main(int argc, char ** argv)
 {
 	app_state = app_state_t{};
+	regqueue_init(register_queue, kRegisterQueueSize);
+
+	bool midi = false;
+	bool four_op = false;
+	const char * midi_connect = nullptr;
+	const char * bank_path = nullptr;
+	const char * trace_path = nullptr;
+	uint32_t patch = 0;
+	bool osc = false;
+	uint16_t osc_port = kOscDefaultPort;
+	const char * shm_name = nullptr;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--bank=", 7) == 0) {
+			bank_path = argv[i] + 7;
+		} else if (strncmp(argv[i], "--patch=", 8) == 0) {
+			patch = strtoul(argv[i] + 8, nullptr, 0);
+		} else if (strcmp(argv[i], "--midi") == 0) {
+			midi = true;
+		} else if (strncmp(argv[i], "--midi=", 7) == 0) {
+			midi = true;
+			midi_connect = argv[i] + 7;
+		} else if (strcmp(argv[i], "--four-op") == 0) {
+			four_op = true;
+		} else if (strncmp(argv[i], "--trace=", 8) == 0) {
+			trace_path = argv[i] + 8;
+		} else if (strncmp(argv[i], "--timeline=", 11) == 0) {
+			timeline_path = argv[i] + 11;
+		} else if (strcmp(argv[i], "--realtime") == 0) {
+			realtime = true;
+		} else if (strncmp(argv[i], "--realtime=", 11) == 0) {
+			realtime = true;
+			realtime_cpu = atoi(argv[i] + 11);
+		} else if (strcmp(argv[i], "--osc") == 0) {
+			osc = true;
+		} else if (strncmp(argv[i], "--osc=", 6) == 0) {
+			osc = true;
+			osc_port = atoi(argv[i] + 6);
+		} else if (strcmp(argv[i], "--shm") == 0) {
+			shm_name = kShmDefaultName;
+		} else if (strncmp(argv[i], "--shm=", 6) == 0) {
+			shm_name = argv[i] + 6;
+		} else if (strcmp(argv[i], "--ahead") == 0) {
+			ahead_enabled = true;
+			ahead.lead = kAheadDefaultMs * kRate / 1000;
+		} else if (strncmp(argv[i], "--ahead=", 8) == 0) {
+			ahead_enabled = true;
+			ahead.lead = atoi(argv[i] + 8) * kRate / 1000;
+		} else {
+			fprintf(stderr, "Usage: %s [--bank=file.opb [--patch=N]] [--midi[=client:port]] [--four-op] [--trace=file.oplt] [--timeline=file.json] [--realtime[=cpu]] [--ahead[=ms]] [--osc[=port]] [--shm[=name]]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if (timeline_path != nullptr) {
+		timeline_init(kTimelineEvents);
+		timeline_thread_name("main");
+	}
 
 	// Setup SDL
 	int sdlcode = SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
@@ -417,7 +757,7 @@ int main()
 	spec.format = AUDIO_S16;
 	spec.channels = kChannels;
 	spec.samples = kBufferSize;
-	spec.callback = audio_render_cb;
+	spec.callback = ahead_enabled ? audio_ahead_cb : audio_render_cb;
 	spec.userdata = &app_state;
 	SDL_AudioDeviceID aid = SDL_OpenAudioDevice(nullptr, 0, &spec, &obtained_spec, 0);
 	if (!aid) {
@@ -427,27 +767,136 @@ int main()
 
 	// Initialize synthesizer
 	app_state.synth.Init(kRate);
+	if (trace_path != nullptr) {
+		regtrace_init(trace, kTraceRecords, kRate);
+		regtrace_attach(trace, app_state.synth);
+	}
 
 	// Setup patch
 	setup_patch(app_state);
+	bank_t bank{};
+	if (bank_path != nullptr) {
+		if (0 != bank_open(bank, bank_path))
+			return -1;
+		if (patch >= bank.count) {
+			fprintf(stderr, "Bank %s has no patch %u\n", bank_path, patch);
+			return -1;
+		}
+		printf("Patch %u: %s\n", patch, bank_name(bank, patch));
+		load_instrument(app_state, bank.instruments[patch]);
+	}
+	update_synth(app_state, SDL_GetTicks());
+	flush_registers(app_state);
+	// Waveforms and the connection bit are not editable, write the whole block
+	if (bank.data != nullptr) {
+		bank_apply(bank.instruments[patch], app_state.synth, 0);
+	}
+
+	// MIDI notes play the patch of channel 0 on every channel
+	if (midi && 0 != midi_open(midi_input, &app_state.synth, &synth_lock, four_op, midi_connect, sdl_ticks)) {
+		return -1;
+	}
+	if (osc && 0 != osc_open(osc_input, osc_port, sdl_ticks)) {
+		return -1;
+	}
+	// The producer listens to operatic itself, no audio goes back
+	if (shm_name != nullptr && 0 != shmstream_create(shm_input, shm_name, kRate, 1 << 16, 0)) {
+		return -1;
+	}
 
 
 	//app_state.synth.WriteReg(app_state.synth.WriteAddr(0, 0xC0), 0x06); // Set channel 0 FEEDBACK
 
 
+	// Everything the audio callback touches is allocated by now
+	if (realtime) {
+		realtime_lock_memory();
+		realtime_prefault(&app_state, sizeof(app_state));
+		realtime_prefault(register_queue.writes.data(), register_queue.writes.size() * sizeof(regqueue_write_t));
+		if (ahead_enabled)
+			realtime_prefault(ahead.ring.samples.data(), ahead.ring.samples.size() * sizeof(int16_t));
+		if (midi)
+			realtime_prefault(midi_input.events.data(), midi_input.events.size() * sizeof(midi_event_t));
+		if (osc)
+			realtime_prefault(osc_input.queue.writes.data(), osc_input.queue.writes.size() * sizeof(regqueue_write_t));
+		if (shm_input.header != nullptr)
+			realtime_prefault(shm_input.header, shm_input.size);
+		if (trace_path != nullptr)
+			realtime_prefault(trace.records.data(), trace.records.size() * sizeof(regtrace_record_t));
+	}
+
+	// The worker fills the ring before the device starts pulling from it
+	if (ahead_enabled) {
+		ahead.min_lead = kBufferSize + kAheadBlock;
+		ahead.max_lead = kAheadMaxMs * kRate / 1000;
+		if (ahead.lead < ahead.min_lead)
+			ahead.lead = ahead.min_lead;
+		if (ahead.lead > ahead.max_lead)
+			ahead.lead = ahead.max_lead;
+		pcmring_init(ahead.ring, ahead.max_lead + kBufferSize + kAheadBlock, kChannels);
+		ahead.clock = (uint64_t)SDL_GetTicks() << 32;
+		ahead.running = true;
+		ahead.thread = std::thread(ahead_thread, &app_state);
+	}
+
 	// Render!
 	printf("Rendering...\n");
 	SDL_PauseAudioDevice(aid, 0);
+
+	// SDL wants rendering and events on the thread that created the window.
+	// Frames are paced by the clock instead of vsync, so presenting never
+	// blocks and the loop waits for events until the next frame is due: a key
+	// press only waits for a frame being drawn, not for a vertical blank
 	app_state.bContinue = true;
+	Uint32 next_frame = SDL_GetTicks();
 	while (app_state.bContinue) {
-		handle_events(app_state);
-		update_synth(app_state);
-		render_video(app_state);
+		Sint32 wait = (Sint32)(next_frame - SDL_GetTicks());
+		if (wait <= 0) {
+			{
+				timeline_scope_t scope("render_video");
+				render_video(app_state);
+			}
+			next_frame += kFrameTicks;
+			// After a stall start over instead of drawing the missed frames
+			if ((Sint32)(SDL_GetTicks() - next_frame) > 0)
+				next_frame = SDL_GetTicks();
+			continue;
+		}
+		SDL_Event event;
+		if (!SDL_WaitEventTimeout(&event, wait))
+			continue;
+		{
+			timeline_scope_t scope("handle_events");
+			handle_event(app_state, event);
+		}
+		timeline_scope_t scope("update_synth");
+		update_synth(app_state, event.common.timestamp);
+	}
+	SDL_PauseAudioDevice(aid, 1);
+	if (ahead_enabled) {
+		ahead.running = false;
+		ahead.thread.join();
 	}
 	printf("Rendering complete.\n");
 
 	// Clean up
+	midi_close(midi_input);
+	osc_close(osc_input);
+	shmstream_close(shm_input);
+	if (trace_path != nullptr) {
+		synth_lock.lock();
+		regtrace_detach(app_state.synth);
+		synth_lock.unlock();
+		if (0 == regtrace_save(trace, trace_path, app_state.synth.sampleClock))
+			printf("Register trace written to %s\n", trace_path);
+	}
+	bank_close(bank);
 	SDL_CloseAudioDevice(aid);
+	if (timeline_path != nullptr) {
+		if (0 == timeline_export(timeline_path))
+			printf("Timeline written to %s\n", timeline_path);
+		timeline_free();
+	}
 
 	term_video(app_state);
 
@@ -472,6 +921,60 @@ void render_line(app_state_t &app, const char * msg, SDL_Color * color)
 
 }
 
+#if DBOPL_COUNTERS
+static const char * const synth_mode_str[] = {
+	"2op AM", "2op FM", "3 AM", "3 FM", nullptr, "4op FM-FM", "4op AM-FM", "4op FM-AM", "4op AM-AM", nullptr,
+	"2 drums", "3 drums",
+};
+static const int kCounterColumn = 480;
+
+// Emulator counters in the right hand column, as rates over the last second
+void render_counters(app_state_t &app, SDL_Color * color)
+{
+	app_renderer_t &rs = app.render_state;
+	uint32_t now = SDL_GetTicks();
+	if (now - rs.counter_ticks >= 1000) {
+		DBOPL::Counters total;
+		DBOPL::CollectCounters(total);
+		const Bit64u * from = (const Bit64u *)&rs.counters;
+		const Bit64u * to = (const Bit64u *)&total;
+		Bit64u * rate = (Bit64u *)&rs.counter_rates;
+		for (size_t i = 0; i < sizeof(total) / sizeof(Bit64u); i++)
+			rate[i] = (to[i] - from[i]) * 1000 / (now - rs.counter_ticks);
+		rs.counters = total;
+		rs.counter_ticks = now;
+	}
+	const DBOPL::Counters &c = rs.counter_rates;
+	char msg[256];
+	rs.y = 0;
+	rs.x = kCounterColumn;
+	render_line(app, "Emulator, per second", color);
+	for (size_t i = 0; i < sizeof(synth_mode_str) / sizeof(synth_mode_str[0]); i++) {
+		if (synth_mode_str[i] == nullptr || c.modeSamples[i] == 0)
+			continue;
+		snprintf(msg, sizeof(msg), "  %-10s %8llu smp", synth_mode_str[i], (unsigned long long)c.modeSamples[i]);
+		rs.x = kCounterColumn;
+		render_line(app, msg, color);
+	}
+	snprintf(msg, sizeof(msg), "  silent %llu culled %llu", (unsigned long long)c.silentBlocks, (unsigned long long)c.culledBlocks);
+	rs.x = kCounterColumn;
+	render_line(app, msg, color);
+	snprintf(msg, sizeof(msg), "  LFO %llu blocks %llu runs", (unsigned long long)c.lfoBlocks, (unsigned long long)c.lfoRuns);
+	rs.x = kCounterColumn;
+	render_line(app, msg, color);
+	for (size_t i = 0; i < 16; i++) {
+		if (c.regWrites[i] == 0)
+			continue;
+		snprintf(msg, sizeof(msg), "  writes %02zx %llu", i << 4, (unsigned long long)c.regWrites[i]);
+		rs.x = kCounterColumn;
+		render_line(app, msg, color);
+	}
+	snprintf(msg, sizeof(msg), "  skipped %llu synth %llu", (unsigned long long)c.skippedWrites, (unsigned long long)c.synthUpdates);
+	rs.x = kCounterColumn;
+	render_line(app, msg, color);
+}
+#endif
+
 void render_video(app_state_t &app)
 {
 	SDL_Renderer * renderer = app.render_state.renderer;
@@ -510,11 +1013,21 @@ void render_video(app_state_t &app)
 	render_line(app, "Press letter shortcut to select a parameter", &normal);
 	render_line(app, "Use the arrow up/down keys to change parameter values", &normal);
 	render_line(app, "Press spacebar for Note ON/OFF", &normal);
-
+	if (timeline_path != nullptr)
+		render_line(app, "Press Print Screen to save the timeline", &normal);
+	if (ahead_enabled) {
+		sprintf(msg, "Rendering %.1f ms ahead, %u underruns", ahead.lead * 1000.0 / kRate, (unsigned)ahead.underruns);
+		render_line(app, msg, &normal);
+	}
+#if DBOPL_COUNTERS
+	render_counters(app, &opcolor);
+#endif
 
 	// Render whole texture
 	SDL_Texture * tex = SDL_CreateTextureFromSurface(renderer, app_state.render_state.surface);
 	SDL_RenderCopy(renderer, tex, nullptr, &app.render_state.dim);
+	SDL_DestroyTexture(tex);
+	timeline_scope_t scope("SDL_RenderPresent");
 	SDL_RenderPresent(renderer);
 }
 
@@ -551,8 +1064,9 @@ int init_video(app_state_t &app)
 		return -1;
 	}
 
-	app.render_state.renderer = SDL_CreateRenderer(app.render_state.window, -1, SDL_RENDERER_PRESENTVSYNC);
-	if (app.render_state.renderer == nullptr) {
+	// No vsync, the main loop paces the frames
+	app_state.render_state.renderer = SDL_CreateRenderer(app_state.render_state.window, -1, 0);
+	if (app_state.render_state.renderer == nullptr) {
 		fprintf(stderr, "Could not create renderer: %s", SDL_GetError());
 		SDL_Quit();
 		return -1;
@@ -569,6 +1083,7 @@ int init_video(app_state_t &app)
 
 void term_video(app_state_t &app)
 {
+	SDL_DestroyRenderer(app.render_state.renderer);
 	TTF_CloseFont(app.render_state.font);
 
 	TTF_Quit();
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "oplog.h"
+#include "realtime.h"
+#include "regtrace.h"
+
+static const uint32_t kDefaultRate = 48000;
+static const int kDefaultRepeats = 5;
+static const double kDefaultTolerance = 5.0;
+
+struct bench_result_t
+{
+	std::string name;
+	uint64_t samples;
+	size_t writes;
+	double ns_per_sample;
+};
+
+static bool has_extension(const char * path, const char * ext)
+{
+	size_t len = strlen(path);
+	size_t ext_len = strlen(ext);
+	return len >= ext_len && strcasecmp(path + len - ext_len, ext) == 0;
+}
+
+// Register traces replay at their own rate, DRO and VGM logs at rate
+static int load_input(const char * path, uint32_t rate, regtrace_log_t &log)
+{
+	if (has_extension(path, ".oplt"))
+		return regtrace_load(path, log);
+	oplog_t capture;
+	if (0 != oplog_load(path, capture))
+		return -1;
+	log.events.clear();
+	log.rate = rate;
+	log.length = capture.length * rate / kLogTicksPerSecond;
+	for (const oplog_event_t &e : capture.events)
+		log.events.push_back({ e.time * rate / kLogTicksPerSecond, e.reg, e.val });
+	return 0;
+}
+
+// Best of repeats, every run on a freshly initialised chip
+static double bench_log(const regtrace_log_t &log, int repeats, std::vector<Bit32s> &buffer)
+{
+	double best = 0;
+	for (int i = 0; i < repeats; i++) {
+		DBOPL::Handler synth;
+		synth.Init(log.rate);
+		auto start = std::chrono::steady_clock::now();
+		regtrace_replay(log, synth, buffer);
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+// One "ns_per_sample name" line per input
+static int load_baseline(const char * path, std::map<std::string, double> &baseline)
+{
+	FILE * f = fopen(path, "r");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = 0;
+		double ns;
+		int name = 0;
+		if (sscanf(line, "%lf %n", &ns, &name) == 1 && line[name] != 0)
+			baseline[line + name] = ns;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int save_results(const char * path, const std::vector<bench_result_t> &results)
+{
+	FILE * f = fopen(path, "w");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not create %s\n", path);
+		return -1;
+	}
+	for (const bench_result_t &r : results)
+		fprintf(f, "%.3f %s\n", r.ns_per_sample, r.name.c_str());
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Could not write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [-n repeats] [-r rate] [-b baseline] [-s save] [-t percent] [-R cpu] input...\n", name);
+	fprintf(stderr, "Inputs are .oplt register traces, or .dro and .vgm logs replayed at rate\n");
+	fprintf(stderr, "-R runs at realtime priority on cpu with memory locked, for steadier numbers\n");
+}
+
+int main(int argc, char ** argv)
+{
+	int repeats = kDefaultRepeats;
+	uint32_t rate = kDefaultRate;
+	double tolerance = kDefaultTolerance;
+	const char * baseline_path = nullptr;
+	const char * save_path = nullptr;
+	int realtime_cpu = -1;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			repeats = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rate = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			baseline_path = argv[++i];
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			save_path = argv[++i];
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			tolerance = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+			realtime_cpu = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (i == argc || rate == 0 || repeats < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	std::map<std::string, double> baseline;
+	if (baseline_path != nullptr && 0 != load_baseline(baseline_path, baseline))
+		return 1;
+	if (realtime_cpu >= 0) {
+		realtime_lock_memory();
+		realtime_promote(kRealtimePriority, realtime_cpu);
+	}
+
+	std::vector<bench_result_t> results;
+	std::vector<Bit32s> buffer;
+	int regressions = 0;
+	for (; i < argc; i++) {
+		regtrace_log_t log;
+		if (0 != load_input(argv[i], rate, log))
+			return 1;
+		if (log.length == 0) {
+			fprintf(stderr, "%s: nothing to replay\n", argv[i]);
+			continue;
+		}
+		double elapsed = bench_log(log, repeats, buffer);
+		bench_result_t r{ argv[i], log.length, log.events.size(), elapsed * 1e9 / log.length };
+		printf("%s: %.1f s of audio, %zu writes, %.2f ns/sample, %.0fx realtime",
+			r.name.c_str(), (double)r.samples / log.rate, r.writes, r.ns_per_sample,
+			elapsed > 0 ? r.samples / (elapsed * log.rate) : 0.0);
+		auto base = baseline.find(r.name);
+		if (base != baseline.end()) {
+			double change = (r.ns_per_sample / base->second - 1) * 100;
+			printf(", %+.1f%% against baseline", change);
+			if (change > tolerance) {
+				printf(" REGRESSION");
+				regressions++;
+			}
+		}
+		printf("\n");
+		results.push_back(r);
+	}
+	if (save_path != nullptr && 0 != save_results(save_path, results))
+		return 1;
+	if (regressions) {
+		printf("%d of %zu inputs slower than the baseline by more than %.1f%%\n",
+			regressions, results.size(), tolerance);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,164 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <vector>
+
+#include "oplutil.h"
+#include "shmstream.h"
+#include "sink.h"
+
+static const uint32_t kDefaultRate = 48000;
+static const size_t kDefaultWrites = 1 << 16;
+static const size_t kDefaultFrames = 1 << 12;
+static const size_t kDefaultBlock = 64;
+static const size_t kSinkFrames = 1 << 16;
+// How long to wait for the producer to read audio before looking again
+static const long kIdleNanoseconds = 200000;
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int)
+{
+	stop = 1;
+}
+
+static void idle(long nanoseconds)
+{
+	struct timespec ts = { 0, nanoseconds };
+	nanosleep(&ts, nullptr);
+}
+
+static int record(sink_t &sink, const int16_t * pcm, size_t frames)
+{
+	while (frames > 0) {
+		size_t n = frames;
+		int16_t * out = sink_reserve(sink, n);
+		if (out == nullptr)
+			return -1;
+		memcpy(out, pcm, n * 2 * sizeof(int16_t));
+		sink_commit(sink, n);
+		pcm += n * 2;
+		frames -= n;
+	}
+	return 0;
+}
+
+static bool ends_with(const char * s, const char * suffix)
+{
+	size_t n = strlen(s), m = strlen(suffix);
+	return n >= m && strcasecmp(s + n - m, suffix) == 0;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [-n name] [-r rate] [-q full|half|quarter] [-w writes] [-p frames] [-b block] [-o out.wav|out.flac]\n", name);
+	fprintf(stderr, "Creates the shared memory register stream name, %s by default, and plays\n", kShmDefaultName);
+	fprintf(stderr, "the writes a producer puts into it. With an audio ring of -p frames the\n");
+	fprintf(stderr, "producer reads the audio back and sets the pace, with -p 0 the wall clock does.\n");
+	fprintf(stderr, "-o also records the audio to a WAV or FLAC file\n");
+}
+
+int main(int argc, char ** argv)
+{
+	const char * name = kShmDefaultName;
+	const char * output = nullptr;
+	uint32_t rate = kDefaultRate;
+	DBOPL::Quality quality = DBOPL::qualityFull;
+	size_t writes = kDefaultWrites;
+	size_t frames = kDefaultFrames;
+	size_t block = kDefaultBlock;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			name = argv[++i];
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rate = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			if (0 != parse_quality(argv[++i], quality)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			writes = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			frames = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			block = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (rate == 0 || writes == 0 || block == 0 || name[0] != '/') {
+		usage(argv[0]);
+		return 1;
+	}
+
+	DBOPL::Handler synth;
+	synth.Init(rate, quality);
+	std::vector<Bit32s> scratch(block * 2);
+	std::vector<int16_t> pcm(block * 2);
+
+	sink_t sink;
+	bool recording = output != nullptr;
+	if (recording) {
+		if (0 != sink_init(sink, kSinkFrames))
+			return 1;
+		if (0 != sink_open(sink, output, ends_with(output, ".flac") ? SINK_FLAC : SINK_WAV, rate, 2))
+			return 1;
+	}
+
+	shmstream_t stream;
+	if (0 != shmstream_create(stream, name, rate, writes, frames))
+		return 1;
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	printf("Playing register stream %s at %u Hz, %u writes, %u frames of audio\n",
+		name, rate, stream.header->write_capacity, stream.header->pcm_capacity);
+	fflush(stdout);
+
+	int ret = 0;
+	if (frames > 0) {
+		// The producer reading the audio sets the pace
+		while (!stop && ret == 0) {
+			size_t n = block;
+			int16_t * out = shmstream_pcm_reserve(stream, n);
+			if (n == 0) {
+				idle(kIdleNanoseconds);
+				continue;
+			}
+			shmstream_generate(stream, synth, out, n, scratch.data());
+			if (recording)
+				ret = record(sink, out, n);
+			shmstream_pcm_commit(stream, n);
+		}
+	} else {
+		// Nobody reads the audio, play in real time. Deadlines come from the
+		// clock so the rounding of a block to nanoseconds does not add up
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (!stop && ret == 0) {
+			shmstream_generate(stream, synth, pcm.data(), block, scratch.data());
+			if (recording)
+				ret = record(sink, pcm.data(), block);
+			uint64_t clock = shmstream_clock(stream);
+			uint64_t nanoseconds = start.tv_nsec + clock % rate * 1000000000 / rate;
+			struct timespec next = { (time_t)(start.tv_sec + clock / rate + nanoseconds / 1000000000), (long)(nanoseconds % 1000000000) };
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+		}
+	}
+
+	uint64_t clock = shmstream_clock(stream);
+	shmstream_close(stream);
+	if (recording) {
+		if (sink_close(sink) != 0)
+			ret = -1;
+		sink_free(sink);
+	}
+	printf("Played %.1f s\n", (double)clock / rate);
+	return ret == 0 ? 0 : 1;
+}
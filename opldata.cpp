@@ -0,0 +1,401 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dbopl.h"
+#include "oplutil.h"
+#include "params.h"
+
+// Renders one note for every point taken from the patch space of the editor,
+// a modulator and a carrier with every operator_param and the channel_param
+// fields but key-on, and stores the audio with the parameters that made it.
+// Points are drawn at random or walked in order; either way item n only
+// depends on n and the seed, so the result does not depend on the threads.
+//
+// Every shard is a pair of NumPy arrays, items x frames of 16 bit mono audio
+// and items x parameters of uint16, sized up front and mapped into memory.
+// Workers render straight into the mapping with a chip they reset between
+// items, nothing is allocated or opened per item.
+
+using namespace DBOPL;
+
+static const uint32_t kDefaultRate = 48000;
+static const uint64_t kDefaultCount = 100000;
+static const size_t kDefaultShardItems = 65536;
+static const double kDefaultHold = 0.4;
+static const double kDefaultTail = 0.1;
+// Items a worker takes at a time
+static const uint64_t kBatch = 64;
+static const uint32_t kScratchFrames = 512;
+static const size_t kNpyAlign = 64;
+// Every shard file is created and sized before rendering starts. 2^32 items
+// are 65536 shards of the default size, and at the default half second 68
+// years or 200 TB of audio, so a larger count is a slip on the command line
+static const uint64_t kMaxCount = 1ull << 32;
+
+// Modulator fields, carrier fields, then the channel
+static const uint32_t kVectorSize = 2 * OP_COUNT + 3;
+static const uint32_t kFNumber = 2 * OP_COUNT;
+static const uint32_t kFeedback = 2 * OP_COUNT + 1;
+static const uint32_t kOctave = 2 * OP_COUNT + 2;
+
+static const char * const operator_param_name[OP_COUNT] = {
+	"trem",
+	"vib",
+	"sus",
+	"ksr",
+	"multi",
+	"ksl",
+	"level",
+	"attack",
+	"decay",
+	"sustain",
+	"release"
+};
+
+struct range_t
+{
+	uint16_t lo;
+	uint16_t hi;
+};
+
+// A NumPy array file mapped into memory
+struct array_t
+{
+	void * map;
+	size_t size;
+	uint8_t * data;
+};
+
+struct shard_t
+{
+	array_t pcm;
+	array_t params;
+	uint64_t first;
+	uint64_t items;
+};
+
+struct dataset_t
+{
+	range_t ranges[kVectorSize];
+	bool enumerate;
+	uint64_t count;
+	uint64_t seed;
+	uint32_t rate;
+	Quality quality;
+	uint32_t hold;    // frames the key is down
+	uint32_t frames;  // frames per item, hold and release tail
+	size_t shard_items;
+	std::vector<shard_t> shards;
+	std::atomic<uint64_t> next;
+};
+
+static std::string vector_name(uint32_t index)
+{
+	if (index == kFNumber)
+		return "fnumber";
+	if (index == kFeedback)
+		return "feedback";
+	if (index == kOctave)
+		return "octave";
+	return std::string(index < OP_COUNT ? "mod." : "car.") + operator_param_name[index % OP_COUNT];
+}
+
+static uint16_t vector_mask(uint32_t index)
+{
+	if (index == kFNumber)
+		return channel_param_mask[CH_FNUMBER];
+	if (index == kFeedback)
+		return channel_param_mask[CH_FEEDBACK];
+	if (index == kOctave)
+		return channel_param_mask[CH_OCTAVE];
+	return operator_param_mask[index % OP_COUNT];
+}
+
+static void item_params(const dataset_t &d, uint64_t item, uint16_t * params)
+{
+	uint64_t state = d.seed ^ (item * 0xd1b54a32d192ed03ull);
+	for (uint32_t i = 0; i < kVectorSize; i++) {
+		uint32_t span = d.ranges[i].hi - d.ranges[i].lo + 1;
+		if (d.enumerate) {
+			params[i] = d.ranges[i].lo + item % span;
+			item /= span;
+		} else {
+			params[i] = d.ranges[i].lo + splitmix(state) % span;
+		}
+	}
+}
+
+static void generate(Handler &synth, Bit32s * scratch, int16_t * pcm, uint32_t frames)
+{
+	while (frames > 0) {
+		uint32_t todo = frames < kScratchFrames ? frames : kScratchFrames;
+		synth.Generate(scratch, todo);
+		for (uint32_t i = 0; i < todo; i++)
+			pcm[i] = opl_clip(scratch[i]);
+		pcm += todo;
+		frames -= todo;
+	}
+}
+
+// Play params as a note on channel 0 of a chip fresh out of reset
+static void render_item(const dataset_t &d, Handler &synth, Bit32s * scratch, const uint16_t * params, int16_t * pcm)
+{
+	synth.Reset();
+	for (uint8_t op = 0; op < 2; op++) {
+		const uint16_t * p = params + op * OP_COUNT;
+		uint8_t regs[4] = { 0, 0, 0, 0 };
+		for (uint8_t i = 0; i < OP_COUNT; i++)
+			regs[(operator_param_reg[i] - 0x20) >> 5] |= p[i] << operator_param_shift[i];
+		for (uint8_t r = 0; r < 4; r++)
+			synth.WriteReg(0x20 + r * 0x20 + op * 3, regs[r]);
+	}
+	synth.WriteReg(0xc0, params[kFeedback] << 1);
+	uint8_t b0 = (params[kOctave] << 2) | (params[kFNumber] >> 8);
+	synth.WriteReg(0xa0, params[kFNumber] & 0xff);
+	synth.WriteReg(0xb0, 0x20 | b0);
+	generate(synth, scratch, pcm, d.hold);
+	synth.WriteReg(0xb0, b0);
+	generate(synth, scratch, pcm + d.hold, d.frames - d.hold);
+}
+
+static void worker_thread(dataset_t * d, std::atomic<uint64_t> * rendered)
+{
+	Handler synth;
+	synth.Init(d->rate, d->quality);
+	Bit32s scratch[kScratchFrames * 2];
+	uint64_t done = 0;
+	for (;;) {
+		uint64_t first = d->next.fetch_add(kBatch);
+		if (first >= d->count)
+			break;
+		uint64_t last = first + kBatch < d->count ? first + kBatch : d->count;
+		for (uint64_t item = first; item < last; item++) {
+			shard_t &shard = d->shards[item / d->shard_items];
+			uint64_t row = item - shard.first;
+			uint16_t * params = (uint16_t *)shard.params.data + row * kVectorSize;
+			int16_t * pcm = (int16_t *)shard.pcm.data + row * d->frames;
+			item_params(*d, item, params);
+			render_item(*d, synth, scratch, params, pcm);
+		}
+		done += last - first;
+	}
+	*rendered += done;
+}
+
+// Version 1.0 NumPy header, padded so the data starts aligned
+static int create_array(array_t &a, const std::string &path, const char * descr, uint64_t rows, uint64_t cols, size_t item_size)
+{
+	char dict[256];
+	int len = snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%llu, %llu), }",
+		descr, (unsigned long long)rows, (unsigned long long)cols);
+	size_t header = (10 + len + 1 + kNpyAlign - 1) / kNpyAlign * kNpyAlign;
+	a.size = header + rows * cols * item_size;
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create %s: %s\n", path.c_str(), strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, a.size) != 0) {
+		fprintf(stderr, "Could not size %s: %s\n", path.c_str(), strerror(errno));
+		close(fd);
+		return -1;
+	}
+	a.map = mmap(nullptr, a.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (a.map == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s: %s\n", path.c_str(), strerror(errno));
+		return -1;
+	}
+	uint8_t * h = (uint8_t *)a.map;
+	memcpy(h, "\x93NUMPY\x01\x00", 8);
+	h[8] = (header - 10) & 0xff;
+	h[9] = (header - 10) >> 8;
+	memcpy(h + 10, dict, len);
+	memset(h + 10 + len, ' ', header - 10 - len - 1);
+	h[header - 1] = '\n';
+	a.data = h + header;
+	return 0;
+}
+
+static void close_array(array_t &a)
+{
+	if (a.map != nullptr && a.map != MAP_FAILED)
+		munmap(a.map, a.size);
+	a.map = nullptr;
+}
+
+// name=value or name=lo:hi, by vector name
+static int parse_range(dataset_t &d, const char * arg)
+{
+	const char * eq = strchr(arg, '=');
+	if (eq != nullptr) {
+		std::string name(arg, eq - arg);
+		for (uint32_t i = 0; i < kVectorSize; i++) {
+			if (vector_name(i) != name)
+				continue;
+			char * end;
+			unsigned long lo = strtoul(eq + 1, &end, 0);
+			unsigned long hi = *end == ':' ? strtoul(end + 1, &end, 0) : lo;
+			if (*end != 0 || lo > hi || hi > vector_mask(i))
+				break;
+			d.ranges[i].lo = lo;
+			d.ranges[i].hi = hi;
+			return 0;
+		}
+	}
+	fprintf(stderr, "Bad parameter range %s\n", arg);
+	return -1;
+}
+
+static int write_manifest(const dataset_t &d, const char * outdir)
+{
+	std::string path = std::string(outdir) + "/dataset.txt";
+	FILE * f = fopen(path.c_str(), "w");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not create %s\n", path.c_str());
+		return -1;
+	}
+	fprintf(f, "items %llu\nshards %zu\nrate %u\nframes %u\nhold %u\n",
+		(unsigned long long)d.count, d.shards.size(), d.rate, d.frames, d.hold);
+	fprintf(f, "mode %s\nseed %llu\n", d.enumerate ? "enumerate" : "sample", (unsigned long long)d.seed);
+	for (uint32_t i = 0; i < kVectorSize; i++)
+		fprintf(f, "param %u %s %u %u\n", i, vector_name(i).c_str(), d.ranges[i].lo, d.ranges[i].hi);
+	fclose(f);
+	return 0;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-r rate] [-q full|half|quarter] [-n items] [-e] [-s seed] [-p name=lo:hi]... [-d seconds] [-t seconds] [-S items] -o outdir\n", name);
+	fprintf(stderr, "Renders a note for every point drawn from the patch space, -e walks the space in order instead\n");
+	fprintf(stderr, "-p limits a parameter: mod.X or car.X with X one of trem vib sus ksr multi ksl level attack\n");
+	fprintf(stderr, "   decay sustain release, or fnumber, feedback, octave. -d holds the key, -t is the tail after\n");
+	fprintf(stderr, "Every shard of -S items is shard-N-pcm.npy (items x frames int16) and shard-N-params.npy\n");
+}
+
+int main(int argc, char ** argv)
+{
+	dataset_t d;
+	for (uint32_t i = 0; i < kVectorSize; i++) {
+		d.ranges[i].lo = 0;
+		d.ranges[i].hi = vector_mask(i);
+	}
+	d.enumerate = false;
+	d.count = 0;
+	d.seed = 1;
+	d.rate = kDefaultRate;
+	d.quality = qualityFull;
+	d.shard_items = kDefaultShardItems;
+	d.next = 0;
+	double hold = kDefaultHold;
+	double tail = kDefaultTail;
+	unsigned threads = std::thread::hardware_concurrency();
+	const char * outdir = nullptr;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			d.rate = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			if (0 != parse_quality(argv[++i], d.quality)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			d.count = strtoull(argv[++i], nullptr, 0);
+		} else if (strcmp(argv[i], "-e") == 0) {
+			d.enumerate = true;
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			d.seed = strtoull(argv[++i], nullptr, 0);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			if (0 != parse_range(d, argv[++i]))
+				return 1;
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			hold = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			tail = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+			d.shard_items = strtoull(argv[++i], nullptr, 0);
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			outdir = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	d.hold = (uint32_t)(hold * d.rate);
+	d.frames = d.hold + (uint32_t)(tail * d.rate);
+	if (outdir == nullptr || d.rate == 0 || d.frames == 0 || d.shard_items == 0 || hold < 0 || tail < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (d.enumerate) {
+		// The whole space unless -n asks for less
+		uint64_t space = 1;
+		for (uint32_t i = 0; i < kVectorSize; i++) {
+			uint64_t span = d.ranges[i].hi - d.ranges[i].lo + 1;
+			if (space > UINT64_MAX / span) {
+				fprintf(stderr, "The space is too large to walk, limit it with -p\n");
+				return 1;
+			}
+			space *= span;
+		}
+		if (d.count == 0 || d.count > space)
+			d.count = space;
+	} else if (d.count == 0) {
+		d.count = kDefaultCount;
+	}
+	if (d.count > kMaxCount) {
+		fprintf(stderr, "%llu items are too many, limit the space with -p or the items with -n\n", (unsigned long long)d.count);
+		return 1;
+	}
+
+	size_t shards = (d.count + d.shard_items - 1) / d.shard_items;
+	d.shards = std::vector<shard_t>(shards);
+	for (size_t s = 0; s < shards; s++) {
+		shard_t &shard = d.shards[s];
+		shard.first = s * d.shard_items;
+		shard.items = d.count - shard.first < d.shard_items ? d.count - shard.first : d.shard_items;
+		char name[64];
+		snprintf(name, sizeof(name), "/shard-%05zu", s);
+		std::string base = std::string(outdir) + name;
+		if (0 != create_array(shard.pcm, base + "-pcm.npy", "<i2", shard.items, d.frames, sizeof(int16_t)))
+			return 1;
+		if (0 != create_array(shard.params, base + "-params.npy", "<u2", shard.items, kVectorSize, sizeof(uint16_t)))
+			return 1;
+	}
+	if (0 != write_manifest(d, outdir))
+		return 1;
+
+	if (threads == 0)
+		threads = 1;
+	std::atomic<uint64_t> rendered(0);
+	std::vector<std::thread> workers;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned t = 0; t < threads; t++)
+		workers.push_back(std::thread(worker_thread, &d, &rendered));
+	for (unsigned t = 0; t < threads; t++)
+		workers[t].join();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	for (size_t s = 0; s < shards; s++) {
+		close_array(d.shards[s].pcm);
+		close_array(d.shards[s].params);
+	}
+
+	printf("Rendered %llu items of %u frames into %zu shards on %u threads in %.2f s\n",
+		(unsigned long long)rendered.load(), d.frames, shards, threads, elapsed);
+	if (elapsed > 0)
+		printf("%.0f items/s, %.0f items/hour\n", rendered / elapsed, rendered / elapsed * 3600);
+	return 0;
+}
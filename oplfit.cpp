@@ -0,0 +1,703 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bank.h"
+#include "dbopl.h"
+#include "oplutil.h"
+#include "params.h"
+#include "sink.h"
+
+// Searches for the 2-op or 4-op patch that sounds closest to a target
+// recording with a genetic algorithm. Every candidate plays one note of the
+// target's pitch on a chip of its own thread and is scored by the squared
+// distance between compressed magnitude spectra, frame by frame, of the note
+// and the target.
+//
+// The genes are the operator_param fields of every operator, plus its wave,
+// and the feedback and connection of every channel, which the editor does
+// not show but a bank instrument keeps. The best patch is saved as a bank of
+// one instrument.
+
+using namespace DBOPL;
+
+static const uint32_t kDefaultPopulation = 256;
+static const uint32_t kDefaultGenerations = 200;
+static const double kDefaultLength = 1.0;
+static const uint32_t kElites = 8;
+static const uint32_t kTournament = 3;
+// Steps of the hill climb from the best candidate every ten generations
+static const uint32_t kRefineRounds = 4;
+// Analysis frames, hann windowed
+static const uint32_t kFftSize = 1024;
+static const uint32_t kHop = kFftSize / 2;
+static const uint32_t kBins = kFftSize / 2 + 1;
+static const uint32_t kScratchFrames = 512;
+static const size_t kSinkFrames = 1 << 16;
+
+// Genes of one operator: the editor fields, then the wave
+static const uint32_t kOperatorGenes = OP_COUNT + 1;
+static const uint32_t kWaveGene = OP_COUNT;
+// Genes of one channel: feedback and connection
+static const uint32_t kChannelGenes = 2;
+static const uint32_t kMaxGenes = 4 * kOperatorGenes + 2 * kChannelGenes;
+
+typedef float vec4_t __attribute__((vector_size(16)));
+static const uint32_t kBinVecs = (kBins + 3) / 4;
+
+struct genome_t
+{
+	uint8_t genes[kMaxGenes];
+	float score;
+};
+
+struct fft_t
+{
+	uint16_t reverse[kFftSize];
+	float cos[kFftSize / 2];
+	float sin[kFftSize / 2];
+	float window[kFftSize];
+};
+
+struct worker_t
+{
+	Handler synth;
+	std::vector<float> pcm;
+	std::vector<vec4_t> spectrum;
+	float re[kFftSize];
+	float im[kFftSize];
+	Bit32s scratch[kScratchFrames * 2];
+	std::thread thread;
+};
+
+struct search_t
+{
+	bool four_op;
+	uint32_t genes;
+	uint8_t masks[kMaxGenes];
+	uint32_t rate;
+	Quality quality;
+	uint16_t fnum;
+	uint8_t block;
+	bool tune;         // the pitch was estimated, the climb may move fnum
+	uint32_t frames;   // rendered per candidate
+	uint32_t hold;     // frames the key is down
+	uint32_t analysis_frames;
+	fft_t fft;
+	std::vector<vec4_t> target;
+	std::vector<genome_t> population;
+	std::vector<worker_t> workers;
+	// The workers wait for a new batch, score it together and the last one
+	// to finish wakes the search
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<genome_t> * batch;
+	uint32_t batches;  // started so far
+	uint32_t busy;     // workers still on the current batch
+	bool stop;
+	std::atomic<uint32_t> next;
+	uint64_t evaluations;
+};
+
+// 16 bit PCM or 32 bit float WAV, mixed down to mono
+static int load_wav(const char * path, std::vector<float> &samples, uint32_t &rate)
+{
+	FILE * f = fopen(path, "rb");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buffer[1 << 16];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		data.insert(data.end(), buffer, buffer + n);
+	fclose(f);
+	if (data.size() < 12 || memcmp(data.data(), "RIFF", 4) != 0 || memcmp(data.data() + 8, "WAVE", 4) != 0) {
+		fprintf(stderr, "%s is not a WAV file\n", path);
+		return -1;
+	}
+	uint16_t format = 0, channels = 0, bits = 0;
+	rate = 0;
+	for (size_t pos = 12; pos + 8 <= data.size();) {
+		const uint8_t * chunk = data.data() + pos;
+		uint32_t size = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | ((uint32_t)chunk[7] << 24);
+		size_t body = pos + 8;
+		if (size > data.size() - body)
+			size = data.size() - body;
+		if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+			const uint8_t * fmt = data.data() + body;
+			format = fmt[0] | (fmt[1] << 8);
+			channels = fmt[2] | (fmt[3] << 8);
+			rate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | ((uint32_t)fmt[7] << 24);
+			bits = fmt[14] | (fmt[15] << 8);
+			// WAVE_FORMAT_EXTENSIBLE keeps the real format in the sub format
+			if (format == 0xfffe && size >= 26)
+				format = fmt[24] | (fmt[25] << 8);
+		} else if (memcmp(chunk, "data", 4) == 0 && channels > 0) {
+			bool pcm16 = format == 1 && bits == 16;
+			bool float32 = format == 3 && bits == 32;
+			if (!pcm16 && !float32)
+				break;
+			size_t frames = size / (channels * bits / 8);
+			samples.assign(frames, 0.0f);
+			const uint8_t * p = data.data() + body;
+			for (size_t i = 0; i < frames; i++) {
+				float sum = 0;
+				for (uint16_t c = 0; c < channels; c++) {
+					if (pcm16) {
+						sum += (int16_t)(p[0] | (p[1] << 8)) / 32768.0f;
+						p += 2;
+					} else {
+						float v;
+						memcpy(&v, p, 4);
+						sum += v;
+						p += 4;
+					}
+				}
+				samples[i] = sum / channels;
+			}
+			return rate > 0 ? 0 : -1;
+		}
+		pos = body + size + (size & 1);
+	}
+	fprintf(stderr, "%s is not 16 bit PCM or 32 bit float\n", path);
+	return -1;
+}
+
+static void fft_init(fft_t &fft)
+{
+	uint32_t bits = 0;
+	while ((1u << bits) < kFftSize)
+		bits++;
+	for (uint32_t i = 0; i < kFftSize; i++) {
+		uint32_t r = 0;
+		for (uint32_t b = 0; b < bits; b++)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		fft.reverse[i] = r;
+		fft.window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / kFftSize);
+	}
+	for (uint32_t i = 0; i < kFftSize / 2; i++) {
+		fft.cos[i] = cosf(2.0f * (float)M_PI * i / kFftSize);
+		fft.sin[i] = -sinf(2.0f * (float)M_PI * i / kFftSize);
+	}
+}
+
+// In place radix 2, the input already in bit reversed order
+static void fft_run(const fft_t &fft, float * re, float * im)
+{
+	for (uint32_t size = 2; size <= kFftSize; size <<= 1) {
+		uint32_t half = size / 2;
+		uint32_t step = kFftSize / size;
+		for (uint32_t start = 0; start < kFftSize; start += size) {
+			for (uint32_t k = 0; k < half; k++) {
+				float wr = fft.cos[k * step];
+				float wi = fft.sin[k * step];
+				uint32_t a = start + k;
+				uint32_t b = a + half;
+				float tr = re[b] * wr - im[b] * wi;
+				float ti = re[b] * wi + im[b] * wr;
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+static uint32_t analysis_frames(uint32_t frames)
+{
+	return frames < kFftSize ? 0 : (frames - kFftSize) / kHop + 1;
+}
+
+// Fourth root of the power of every bin, two real frames per complex FFT:
+// one goes in as the real part, the other as the imaginary part
+static void spectrum(const fft_t &fft, const float * pcm, uint32_t count, float * re, float * im, vec4_t * out)
+{
+	for (uint32_t f = 0; f < count; f += 2) {
+		const float * a = pcm + f * kHop;
+		const float * b = f + 1 < count ? a + kHop : nullptr;
+		for (uint32_t i = 0; i < kFftSize; i++) {
+			uint32_t r = fft.reverse[i];
+			re[r] = a[i] * fft.window[i];
+			im[r] = b ? b[i] * fft.window[i] : 0.0f;
+		}
+		fft_run(fft, re, im);
+		float * fa = (float *)(out + f * kBinVecs);
+		float * fb = b ? (float *)(out + (f + 1) * kBinVecs) : nullptr;
+		for (uint32_t k = 0; k < kBins; k++) {
+			uint32_t m = (kFftSize - k) & (kFftSize - 1);
+			float sr = re[k] + re[m], dr = re[k] - re[m];
+			float si = im[k] + im[m], di = im[k] - im[m];
+			fa[k] = sqrtf(sqrtf((sr * sr + di * di) * 0.25f));
+			if (fb)
+				fb[k] = sqrtf(sqrtf((si * si + dr * dr) * 0.25f));
+		}
+		for (uint32_t k = kBins; k < kBinVecs * 4; k++) {
+			fa[k] = 0.0f;
+			if (fb)
+				fb[k] = 0.0f;
+		}
+	}
+}
+
+// Four bins at a time, over two accumulators
+static float spectral_distance(const vec4_t * a, const vec4_t * b, size_t count)
+{
+	vec4_t sum0 = { 0, 0, 0, 0 };
+	vec4_t sum1 = { 0, 0, 0, 0 };
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		vec4_t d0 = a[i] - b[i];
+		vec4_t d1 = a[i + 1] - b[i + 1];
+		sum0 += d0 * d0;
+		sum1 += d1 * d1;
+	}
+	for (; i < count; i++) {
+		vec4_t d = a[i] - b[i];
+		sum0 += d * d;
+	}
+	sum0 += sum1;
+	return sum0[0] + sum0[1] + sum0[2] + sum0[3];
+}
+
+static void to_instrument(const search_t &s, const uint8_t * genes, bank_instrument_t &ins)
+{
+	memset(&ins, 0, sizeof(ins));
+	ins.flags = s.four_op ? BANK_FOUR_OP : 0;
+	uint32_t ops = s.four_op ? 4 : 2;
+	for (uint32_t o = 0; o < ops; o++) {
+		const uint8_t * g = genes + o * kOperatorGenes;
+		for (uint32_t i = 0; i < OP_COUNT; i++)
+			ins.regs[o][(operator_param_reg[i] - 0x20) >> 5] |= g[i] << operator_param_shift[i];
+		ins.regs[o][BANK_REG_E0] = g[kWaveGene];
+	}
+	const uint8_t * c = genes + ops * kOperatorGenes;
+	for (uint32_t h = 0; h < ops / 2; h++)
+		ins.c0[h] = (c[h * kChannelGenes] << 1) | c[h * kChannelGenes + 1];
+}
+
+// One note of the target's pitch on channel 0 of a chip fresh out of reset
+static void render(const search_t &s, worker_t &w, const bank_instrument_t &ins, int16_t * pcm16)
+{
+	Handler &synth = w.synth;
+	synth.Reset();
+	synth.WriteReg(0x105, 0x01);
+	if (s.four_op)
+		synth.WriteReg(0x104, 0x01);
+	bank_apply(ins, synth, 0);
+	uint8_t b0 = (s.block << 2) | (s.fnum >> 8);
+	synth.WriteReg(0xa0, s.fnum & 0xff);
+	synth.WriteReg(0xb0, 0x20 | b0);
+	for (uint32_t done = 0; done < s.frames;) {
+		uint32_t end = done < s.hold ? s.hold : s.frames;
+		uint32_t todo = end - done < kScratchFrames ? end - done : kScratchFrames;
+		synth.Generate(w.scratch, todo);
+		// Stereo out of the opl3 mode, both sides are the same
+		for (uint32_t i = 0; i < todo; i++) {
+			if (pcm16)
+				pcm16[done + i] = opl_clip(w.scratch[i * 2]);
+			w.pcm[done + i] = w.scratch[i * 2] * (kOplGain / 32768.0f);
+		}
+		done += todo;
+		if (done == s.hold)
+			synth.WriteReg(0xb0, b0);
+	}
+}
+
+static float evaluate(const search_t &s, worker_t &w, const uint8_t * genes)
+{
+	bank_instrument_t ins;
+	to_instrument(s, genes, ins);
+	render(s, w, ins, nullptr);
+	spectrum(s.fft, w.pcm.data(), s.analysis_frames, w.re, w.im, w.spectrum.data());
+	return spectral_distance(w.spectrum.data(), s.target.data(), s.target.size());
+}
+
+static void worker_thread(search_t * s, size_t self)
+{
+	worker_t &w = s->workers[self];
+	uint32_t seen = 0;
+	for (;;) {
+		std::vector<genome_t> * batch;
+		{
+			std::unique_lock<std::mutex> guard(s->lock);
+			s->cond.wait(guard, [&] { return s->stop || s->batches != seen; });
+			if (s->stop)
+				return;
+			seen = s->batches;
+			batch = s->batch;
+		}
+		uint32_t i;
+		while ((i = s->next++) < batch->size())
+			(*batch)[i].score = evaluate(*s, w, (*batch)[i].genes);
+		std::lock_guard<std::mutex> guard(s->lock);
+		if (--s->busy == 0)
+			s->cond.notify_all();
+	}
+}
+
+static void start_workers(search_t &s)
+{
+	s.batches = 0;
+	s.busy = 0;
+	s.stop = false;
+	for (size_t t = 0; t < s.workers.size(); t++)
+		s.workers[t].thread = std::thread(worker_thread, &s, t);
+}
+
+static void stop_workers(search_t &s)
+{
+	{
+		std::lock_guard<std::mutex> guard(s.lock);
+		s.stop = true;
+	}
+	s.cond.notify_all();
+	for (auto &w : s.workers)
+		w.thread.join();
+}
+
+// Score the candidates of batch from first on, spread over the workers
+static void evaluate_batch(search_t &s, std::vector<genome_t> &batch, uint32_t first)
+{
+	std::unique_lock<std::mutex> guard(s.lock);
+	s.batch = &batch;
+	s.next = first;
+	s.busy = s.workers.size();
+	s.batches++;
+	s.cond.notify_all();
+	s.cond.wait(guard, [&] { return s.busy == 0; });
+	s.evaluations += batch.size() - first;
+}
+
+// Step fnum while the best candidate scores better for it, the estimate is
+// rarely off by more than a few steps but a step costs as much as a bad gene
+static bool tune(search_t &s, std::vector<genome_t> &neighbours)
+{
+	genome_t &best = s.population[0];
+	bool moved = false;
+	for (int step = -1; step <= 1; step += 2) {
+		while (s.fnum + step > 0 && s.fnum + step <= 1023) {
+			uint16_t fnum = s.fnum;
+			s.fnum += step;
+			neighbours.assign(1, best);
+			evaluate_batch(s, neighbours, 0);
+			if (neighbours[0].score >= best.score) {
+				s.fnum = fnum;
+				break;
+			}
+			best.score = neighbours[0].score;
+			moved = true;
+		}
+	}
+	return moved;
+}
+
+// Hill climb from the best candidate: try every gene one step either way, all
+// at once, and move to the best neighbour while that improves. True when fnum
+// moved, which leaves the scores of the rest of the population stale
+static bool refine(search_t &s, std::vector<genome_t> &neighbours, uint32_t rounds)
+{
+	genome_t &best = s.population[0];
+	bool retuned = false;
+	for (uint32_t round = 0; round < rounds; round++) {
+		bool tuned = s.tune && tune(s, neighbours);
+		retuned |= tuned;
+		neighbours.clear();
+		for (uint32_t i = 0; i < s.genes; i++) {
+			genome_t g = best;
+			if (best.genes[i] > 0) {
+				g.genes[i] = best.genes[i] - 1;
+				neighbours.push_back(g);
+			}
+			if (best.genes[i] < s.masks[i]) {
+				g.genes[i] = best.genes[i] + 1;
+				neighbours.push_back(g);
+			}
+		}
+		evaluate_batch(s, neighbours, 0);
+		const genome_t * top = &best;
+		for (const genome_t &g : neighbours) {
+			if (g.score < top->score)
+				top = &g;
+		}
+		if (top == &best) {
+			if (tuned)
+				continue;
+			break;
+		}
+		best = *top;
+	}
+	return retuned;
+}
+
+static const genome_t &tournament(const search_t &s, uint64_t &rng)
+{
+	const genome_t * best = &s.population[splitmix(rng) % s.population.size()];
+	for (uint32_t i = 1; i < kTournament; i++) {
+		const genome_t * g = &s.population[splitmix(rng) % s.population.size()];
+		if (g->score < best->score)
+			best = g;
+	}
+	return *best;
+}
+
+// Uniform crossover, then every gene has about two in genes chances to mutate:
+// half of the time to any value, otherwise one step
+static void breed(const search_t &s, const genome_t &a, const genome_t &b, genome_t &child, uint64_t &rng)
+{
+	for (uint32_t i = 0; i < s.genes; i++) {
+		uint64_t r = splitmix(rng);
+		child.genes[i] = (r & 1) ? a.genes[i] : b.genes[i];
+		if ((r >> 8) % s.genes < 2) {
+			if (r & 2) {
+				child.genes[i] = (r >> 32) % (s.masks[i] + 1);
+			} else if (r & 4) {
+				child.genes[i] = child.genes[i] < s.masks[i] ? child.genes[i] + 1 : child.genes[i];
+			} else {
+				child.genes[i] = child.genes[i] > 0 ? child.genes[i] - 1 : 0;
+			}
+		}
+	}
+}
+
+// Harmonic product spectrum of the target over three harmonics, so a strong
+// overtone does not pass for the fundamental, refined between neighbours
+static double estimate_pitch(const search_t &s, uint32_t rate)
+{
+	std::vector<float> sum(kBins, 0.0f);
+	uint32_t frames = s.target.size() / kBinVecs;
+	for (uint32_t f = 0; f < frames; f++) {
+		const float * bins = (const float *)(s.target.data() + f * kBinVecs);
+		for (uint32_t k = 0; k < kBins; k++)
+			sum[k] += bins[k];
+	}
+	uint32_t peak = 1;
+	double best = 0;
+	for (uint32_t k = 1; k * 3 < kBins; k++) {
+		double product = (double)sum[k] * sum[k * 2] * sum[k * 3];
+		if (product > best) {
+			best = product;
+			peak = k;
+		}
+	}
+	double l = sum[peak - 1], c = sum[peak], r = sum[peak + 1];
+	double offset = (l - 2 * c + r) != 0 ? 0.5 * (l - r) / (l - 2 * c + r) : 0;
+	return (peak + offset) * rate / kFftSize;
+}
+
+static int write_wav(const search_t &s, worker_t &w, const bank_instrument_t &ins, const char * path)
+{
+	std::vector<int16_t> pcm(s.frames);
+	render(s, w, ins, pcm.data());
+	sink_t sink;
+	if (0 != sink_init(sink, kSinkFrames))
+		return -1;
+	if (0 != sink_open(sink, path, SINK_WAV, s.rate, 1)) {
+		sink_free(sink);
+		return -1;
+	}
+	int ret = 0;
+	for (size_t done = 0; done < pcm.size();) {
+		size_t n = pcm.size() - done;
+		int16_t * out = sink_reserve(sink, n);
+		if (out == nullptr) {
+			ret = -1;
+			break;
+		}
+		memcpy(out, pcm.data() + done, n * sizeof(int16_t));
+		sink_commit(sink, n);
+		done += n;
+	}
+	if (sink_close(sink) != 0)
+		ret = -1;
+	sink_free(sink);
+	return ret;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [-4] [-j threads] [-p population] [-g generations] [-t seconds] [-s seed] [-f hz] [-l seconds] [-d seconds] [-q full|half|quarter] [-o out.opb] [-w out.wav] target.wav\n", name);
+	fprintf(stderr, "Searches the 2-op, or with -4 the 4-op, patch that sounds closest to target.wav\n");
+	fprintf(stderr, "-f sets the pitch of the note instead of taking it from the target, -l is the length\n");
+	fprintf(stderr, "compared, 1 s by default, and -d how long of it the key is down, all of it by default.\n");
+	fprintf(stderr, "The search stops after -g generations or -t seconds; -o saves the patch as a bank\n");
+}
+
+int main(int argc, char ** argv)
+{
+	search_t s;
+	s.four_op = false;
+	s.quality = qualityFull;
+	s.evaluations = 0;
+	uint32_t population = kDefaultPopulation;
+	uint32_t generations = kDefaultGenerations;
+	double time_limit = 0;
+	uint64_t rng = 1;
+	double pitch = 0;
+	double length = kDefaultLength;
+	double hold = 0;
+	unsigned threads = std::thread::hardware_concurrency();
+	const char * bank_path = nullptr;
+	const char * wav_path = nullptr;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+		if (strcmp(argv[i], "-4") == 0) {
+			s.four_op = true;
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			population = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+			generations = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			time_limit = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			rng = strtoull(argv[++i], nullptr, 0);
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			pitch = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			length = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			hold = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			if (0 != parse_quality(argv[++i], s.quality)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			bank_path = argv[++i];
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			wav_path = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (i + 1 != argc || population <= kElites || length <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<float> target;
+	if (0 != load_wav(argv[i], target, s.rate))
+		return 1;
+	s.frames = (uint32_t)std::min<double>(target.size(), length * s.rate);
+	s.hold = hold > 0 ? (uint32_t)std::min<double>(s.frames, hold * s.rate) : s.frames;
+	s.analysis_frames = analysis_frames(s.frames);
+	if (s.analysis_frames == 0) {
+		fprintf(stderr, "%s is too short to compare\n", argv[i]);
+		return 1;
+	}
+	fft_init(s.fft);
+	s.target.resize(s.analysis_frames * kBinVecs);
+	{
+		float re[kFftSize], im[kFftSize];
+		spectrum(s.fft, target.data(), s.analysis_frames, re, im, s.target.data());
+	}
+	s.tune = pitch <= 0;
+	if (s.tune)
+		pitch = estimate_pitch(s, s.rate);
+	opl_frequency(pitch, s.fnum, s.block);
+
+	uint32_t ops = s.four_op ? 4 : 2;
+	s.genes = ops * kOperatorGenes + ops / 2 * kChannelGenes;
+	for (uint32_t o = 0; o < ops; o++) {
+		for (uint32_t g = 0; g < OP_COUNT; g++)
+			s.masks[o * kOperatorGenes + g] = operator_param_mask[g];
+		s.masks[o * kOperatorGenes + kWaveGene] = 7;
+	}
+	for (uint32_t h = 0; h < ops / 2; h++) {
+		s.masks[ops * kOperatorGenes + h * kChannelGenes] = channel_param_mask[CH_FEEDBACK];
+		s.masks[ops * kOperatorGenes + h * kChannelGenes + 1] = 1;
+	}
+
+	if (threads == 0)
+		threads = 1;
+	s.workers = std::vector<worker_t>(threads);
+	for (auto &w : s.workers) {
+		w.synth.Init(s.rate, s.quality);
+		w.pcm.resize(s.frames);
+		w.spectrum.resize(s.target.size());
+	}
+	start_workers(s);
+	s.population.resize(population);
+	for (auto &g : s.population) {
+		for (uint32_t k = 0; k < s.genes; k++)
+			g.genes[k] = splitmix(rng) % (s.masks[k] + 1);
+	}
+	printf("Fitting a %s patch to %s: %.1f Hz, fnum %u block %u, %u frames at %u Hz\n",
+		s.four_op ? "4-op" : "2-op", argv[i], pitch, s.fnum, s.block, s.frames, s.rate);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<genome_t> next(population);
+	std::vector<genome_t> neighbours;
+	neighbours.reserve(2 * kMaxGenes);
+	auto by_score = [](const genome_t &a, const genome_t &b) { return a.score < b.score; };
+	evaluate_batch(s, s.population, 0);
+	std::sort(s.population.begin(), s.population.end(), by_score);
+	uint32_t generation = 1;
+	for (; generation < generations; generation++) {
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (time_limit > 0 && elapsed >= time_limit)
+			break;
+		if (generation % 10 == 0) {
+			if (refine(s, neighbours, kRefineRounds)) {
+				evaluate_batch(s, s.population, 1);
+				std::sort(s.population.begin(), s.population.end(), by_score);
+			}
+			printf("generation %u: distance %.2f, %.0f candidates/s\n",
+				generation, s.population[0].score, s.evaluations / elapsed);
+			fflush(stdout);
+		}
+		// The best few stay as they are and are not scored again
+		for (uint32_t k = 0; k < kElites; k++)
+			next[k] = s.population[k];
+		for (uint32_t k = kElites; k < population; k++)
+			breed(s, tournament(s, rng), tournament(s, rng), next[k], rng);
+		s.population.swap(next);
+		evaluate_batch(s, s.population, kElites);
+		std::sort(s.population.begin(), s.population.end(), by_score);
+	}
+	// Climb all the way from where the search stopped
+	refine(s, neighbours, UINT32_MAX);
+	stop_workers(s);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	const genome_t &best = s.population[0];
+	bank_instrument_t ins;
+	to_instrument(s, best.genes, ins);
+	printf("Best distance %.2f after %u generations at fnum %u block %u, %llu candidates in %.1f s, %.0f candidates/s on %u threads\n",
+		best.score, generation, s.fnum, s.block, (unsigned long long)s.evaluations, elapsed, s.evaluations / elapsed, threads);
+	for (uint32_t o = 0; o < ops; o++) {
+		printf("op %u:", o);
+		for (uint32_t r = 0; r < BANK_REG_COUNT; r++)
+			printf(" %02x", ins.regs[o][r]);
+		printf("\n");
+	}
+	for (uint32_t h = 0; h < ops / 2; h++)
+		printf("c0 %u: %02x\n", h, ins.c0[h]);
+
+	if (bank_path != nullptr) {
+		std::vector<bank_entry_t> entries(1);
+		entries[0].instrument = ins;
+		memset(entries[0].name, 0, sizeof(entries[0].name));
+		snprintf(entries[0].name, sizeof(entries[0].name), "oplfit");
+		if (0 != bank_write(bank_path, entries))
+			return 1;
+	}
+	if (wav_path != nullptr && 0 != write_wav(s, s.workers[0], ins, wav_path)) {
+		fprintf(stderr, "Could not write %s\n", wav_path);
+		return 1;
+	}
+	return 0;
+}
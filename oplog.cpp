@@ -0,0 +1,546 @@
+#include <string.h>
+
+#include "oplog.h"
+#include "oplutil.h"
+
+static const uint64_t kDroTicks = kLogTicksPerSecond / 1000;
+static const uint64_t kVgmTicks = kLogTicksPerSecond / 44100;
+static const size_t kDroHeaderSize = 26;
+static const uint8_t kDroHardwareDualOpl2 = 1;
+static const size_t kVgmHeaderSize = 0x40;
+static const uint32_t kVgmDualChip = 0x40000000;
+
+static const Bitu kBlockFrames = 512;
+static const size_t kSeekHeaderSize = 40;
+static const size_t kKeyframeHeaderSize = 20;
+
+static uint16_t read_le16(const uint8_t * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t * p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t * p)
+{
+	return read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+static void write_le16(uint8_t * p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void write_le32(uint8_t * p, uint32_t v)
+{
+	write_le16(p, v & 0xffff);
+	write_le16(p + 2, v >> 16);
+}
+
+static void write_le64(uint8_t * p, uint64_t v)
+{
+	write_le32(p, v & 0xffffffff);
+	write_le32(p + 4, v >> 32);
+}
+
+static int read_file(const char * path, std::vector<uint8_t> &data)
+{
+	FILE * f = fopen(path, "rb");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data.resize(size > 0 ? size : 0);
+	size_t got = data.empty() ? 0 : fread(data.data(), 1, data.size(), f);
+	fclose(f);
+	if (got != data.size()) {
+		fprintf(stderr, "Could not read %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+// Two OPL2 chips are played on the two banks of an opl3, the first one on the
+// left speaker and the second one on the right like the original hardware
+static void start_dual(oplog_t &log)
+{
+	log.events.push_back({ 0, 0x105, 0x01 });
+}
+
+static void add_write(oplog_t &log, uint64_t time, uint16_t reg, uint8_t val, bool dual)
+{
+	if (dual && (reg & 0xff) >= 0xc0 && (reg & 0xff) <= 0xc8)
+		val = (val & 0x0f) | ((reg & 0x100) ? 0x20 : 0x10);
+	// The second chip's test, timer, note select and rhythm registers have no
+	// counterpart in the second bank, where 0x104 and 0x105 would pair 4-op
+	// channels or leave opl3 mode behind its back
+	if (dual && (reg & 0x100) && ((reg & 0xff) < 0x10 || reg == 0x1bd))
+		return;
+	log.events.push_back({ time, reg, val });
+}
+
+static int load_dro(const std::vector<uint8_t> &data, oplog_t &log)
+{
+	if (data.size() < kDroHeaderSize || read_le16(data.data() + 8) != 2)
+		return -1;
+	const uint8_t * p = data.data();
+	uint32_t pairs = read_le32(p + 12);
+	uint8_t short_delay = p[23];
+	uint8_t long_delay = p[24];
+	uint8_t codemap_size = p[25];
+	const uint8_t * codemap = p + kDroHeaderSize;
+	const uint8_t * cmd = codemap + codemap_size;
+	// The compression and format fields have only ever been 0
+	if (p[21] != 0 || p[22] != 0 || codemap_size > 128 ||
+		kDroHeaderSize + codemap_size + (uint64_t)pairs * 2 > data.size())
+		return -1;
+	bool dual = p[20] == kDroHardwareDualOpl2;
+	if (dual)
+		start_dual(log);
+	uint64_t time = 0;
+	for (uint32_t i = 0; i < pairs; i++, cmd += 2) {
+		if (cmd[0] == short_delay) {
+			time += (cmd[1] + 1) * kDroTicks;
+		} else if (cmd[0] == long_delay) {
+			time += (cmd[1] + 1) * 256 * kDroTicks;
+		} else {
+			uint8_t index = cmd[0] & 0x7f;
+			if (index >= codemap_size)
+				return -1;
+			add_write(log, time, codemap[index] | ((cmd[0] & 0x80) << 1), cmd[1], dual);
+		}
+	}
+	uint64_t length = read_le32(p + 16) * kDroTicks;
+	log.length = length > time ? length : time;
+	return 0;
+}
+
+// Operand bytes of the VGM commands that are skipped, 0xff for invalid ones
+static uint8_t vgm_operands(uint8_t cmd)
+{
+	if (cmd >= 0x30 && cmd <= 0x3f)
+		return 1;
+	if (cmd == 0x4f || cmd == 0x50)
+		return 1;
+	if (cmd >= 0x40 && cmd <= 0x5f)
+		return 2;
+	if (cmd >= 0xa0 && cmd <= 0xbf)
+		return 2;
+	if (cmd >= 0xc0 && cmd <= 0xdf)
+		return 3;
+	if (cmd >= 0xe0)
+		return 4;
+	switch (cmd) {
+		case 0x68: return 11;
+		case 0x90: return 4;
+		case 0x91: return 4;
+		case 0x92: return 5;
+		case 0x93: return 10;
+		case 0x94: return 1;
+		case 0x95: return 4;
+	}
+	return 0xff;
+}
+
+// Header fields that overlap the data, or the end of the file, read as 0
+static uint32_t vgm_field(const std::vector<uint8_t> &data, size_t offset, size_t field)
+{
+	if (field + 4 > offset || field + 4 > data.size())
+		return 0;
+	return read_le32(data.data() + field);
+}
+
+static int load_vgm(const std::vector<uint8_t> &data, oplog_t &log)
+{
+	if (data.size() < kVgmHeaderSize)
+		return -1;
+	const uint8_t * p = data.data();
+	uint32_t version = read_le32(p + 0x08);
+	size_t offset = 0x40;
+	if (version >= 0x150 && read_le32(p + 0x34) != 0)
+		offset = 0x34 + read_le32(p + 0x34);
+	bool dual = false;
+	if (version >= 0x151 && offset > 0x50) {
+		uint32_t ym3812 = vgm_field(data, offset, 0x50);
+		if ((ym3812 | vgm_field(data, offset, 0x54) | vgm_field(data, offset, 0x58) | vgm_field(data, offset, 0x5c)) == 0) {
+			fprintf(stderr, "VGM file has no OPL chip\n");
+			return -1;
+		}
+		dual = (ym3812 & kVgmDualChip) != 0;
+	}
+	if (dual)
+		start_dual(log);
+	uint64_t time = 0;
+	size_t i = offset;
+	while (i < data.size()) {
+		uint8_t cmd = p[i];
+		if (cmd == 0x66)
+			break;
+		size_t operands;
+		if (cmd == 0x67) {
+			// Data block: 0x67 0x66 type size[4]
+			if (i + 7 > data.size())
+				return -1;
+			operands = 6 + (read_le32(p + i + 3) & 0x7fffffff);
+		} else if (cmd >= 0x70 && cmd <= 0x8f) {
+			operands = 0;
+		} else if (cmd == 0x62 || cmd == 0x63) {
+			operands = 0;
+		} else if (cmd == 0x61) {
+			operands = 2;
+		} else {
+			operands = vgm_operands(cmd);
+			if (operands == 0xff) {
+				fprintf(stderr, "Unknown VGM command 0x%02x at 0x%zx\n", cmd, i);
+				return -1;
+			}
+		}
+		if (i + 1 + operands > data.size())
+			return -1;
+		const uint8_t * o = p + i + 1;
+		switch (cmd) {
+			case 0x5a: case 0x5b: case 0x5c: case 0x5e:
+				add_write(log, time, o[0], o[1], dual);
+				break;
+			case 0x5f: case 0xaa:
+				add_write(log, time, 0x100 | o[0], o[1], dual);
+				break;
+			case 0x61:
+				time += read_le16(o) * kVgmTicks;
+				break;
+			case 0x62:
+				time += 735 * kVgmTicks;
+				break;
+			case 0x63:
+				time += 882 * kVgmTicks;
+				break;
+			default:
+				if (cmd >= 0x70 && cmd <= 0x7f)
+					time += ((cmd & 0x0f) + 1) * kVgmTicks;
+				else if (cmd >= 0x80 && cmd <= 0x8f)
+					time += (cmd & 0x0f) * kVgmTicks;
+				break;
+		}
+		i += 1 + operands;
+	}
+	uint64_t length = read_le32(p + 0x18) * kVgmTicks;
+	log.length = length > time ? length : time;
+	return 0;
+}
+
+int oplog_load(const char * path, oplog_t &log)
+{
+	log.events.clear();
+	log.length = 0;
+	std::vector<uint8_t> data;
+	if (0 != read_file(path, data))
+		return -1;
+	int ret = -1;
+	if (data.size() >= 8 && memcmp(data.data(), "DBRAWOPL", 8) == 0) {
+		ret = load_dro(data, log);
+	} else if (data.size() >= 4 && memcmp(data.data(), "Vgm ", 4) == 0) {
+		ret = load_vgm(data, log);
+	} else if (data.size() >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+		fprintf(stderr, "%s: compressed VGZ files need to be unpacked first\n", path);
+		return -1;
+	} else {
+		fprintf(stderr, "%s: unknown register log format\n", path);
+		return -1;
+	}
+	if (ret != 0)
+		fprintf(stderr, "%s: truncated or unsupported file\n", path);
+	return ret;
+}
+
+static uint64_t event_frame(const oplog_event_t &event, uint32_t rate)
+{
+	return event.time * rate / kLogTicksPerSecond;
+}
+
+// Play log from position up to frame end, into sink when there is one and
+// taking keyframes into index when there is one
+static void play(const oplog_t &log, DBOPL::Handler &synth, uint32_t rate, oplog_position_t &position,
+	uint64_t end, sink_t * sink, oplog_buffers_t &buffers, oplog_index_t * index)
+{
+	buffers.mix.resize(kBlockFrames * 2);
+	const oplog_event_t * events = log.events.data();
+	size_t count = log.events.size();
+	while (position.frame < end) {
+		uint64_t keyframe = end;
+		if (index != nullptr) {
+			keyframe = index->keyframes.size() * index->interval;
+			if (keyframe == position.frame) {
+				index->keyframes.emplace_back();
+				oplog_keyframe_t &k = index->keyframes.back();
+				memset(&k.state, 0, sizeof(k.state));
+				k.position = position;
+				synth.SaveState(k.state);
+				keyframe += index->interval;
+			}
+		}
+		while (position.event < count && event_frame(events[position.event], rate) <= position.frame) {
+			synth.WriteReg(events[position.event].reg, events[position.event].val);
+			position.event++;
+		}
+		uint64_t until = position.event < count ? event_frame(events[position.event], rate) : end;
+		if (until > end)
+			until = end;
+		if (until > keyframe)
+			until = keyframe;
+		size_t frames = until - position.frame < kBlockFrames ? until - position.frame : kBlockFrames;
+		Bit32s * mix = buffers.mix.data();
+		if (sink == nullptr) {
+			synth.Generate(mix, frames);
+			position.frame += frames;
+			continue;
+		}
+		int16_t * pcm = sink_reserve(*sink, frames);
+		synth.Generate(mix, frames);
+		if (synth.chip.opl3Active) {
+			for (size_t i = 0; i < frames * 2; i++)
+				pcm[i] = opl_clip(mix[i]);
+		} else {
+			for (size_t i = 0; i < frames; i++)
+				pcm[i * 2] = pcm[i * 2 + 1] = opl_clip(mix[i]);
+		}
+		sink_commit(*sink, frames);
+		position.frame += frames;
+	}
+}
+
+static uint64_t log_frames(const oplog_t &log, uint32_t rate)
+{
+	return log.length * rate / kLogTicksPerSecond;
+}
+
+int oplog_render(const oplog_t &log, DBOPL::Handler &synth, uint32_t rate, sink_t &sink,
+	oplog_buffers_t &buffers, oplog_stats_t &stats, oplog_index_t * index)
+{
+	oplog_position_t position = { 0, 0 };
+	play(log, synth, rate, position, log_frames(log, rate), &sink, buffers, index);
+	stats.frames = position.frame;
+	stats.writes = position.event;
+	return 0;
+}
+
+int oplog_render_from(const oplog_t &log, DBOPL::Handler &synth, uint32_t rate, oplog_position_t position,
+	sink_t &sink, oplog_buffers_t &buffers, oplog_stats_t &stats)
+{
+	oplog_position_t start = position;
+	play(log, synth, rate, position, log_frames(log, rate), &sink, buffers, nullptr);
+	stats.frames = position.frame - start.frame;
+	stats.writes = position.event - start.event;
+	return 0;
+}
+
+// FNV-1a over everything that changes what the log plays
+static uint64_t log_hash(const oplog_t &log)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	auto mix = [&hash](uint64_t v, int bytes) {
+		for (int i = 0; i < bytes; i++, v >>= 8)
+			hash = (hash ^ (v & 0xff)) * 0x100000001b3ull;
+	};
+	mix(log.length, 8);
+	for (const oplog_event_t &e : log.events) {
+		mix(e.time, 8);
+		mix(e.reg, 2);
+		mix(e.val, 1);
+	}
+	return hash;
+}
+
+void oplog_index_init(oplog_index_t &index, const oplog_t &log, uint32_t rate, DBOPL::Quality quality, double seconds)
+{
+	index.rate = rate;
+	index.quality = quality;
+	index.interval = (uint64_t)(seconds * rate);
+	if (index.interval == 0)
+		index.interval = 1;
+	index.hash = log_hash(log);
+	index.keyframes.clear();
+}
+
+void oplog_index_build(const oplog_t &log, DBOPL::Handler &synth, oplog_index_t &index, oplog_buffers_t &buffers)
+{
+	oplog_position_t position = { 0, 0 };
+	play(log, synth, index.rate, position, log_frames(log, index.rate), nullptr, buffers, &index);
+}
+
+// A keyframe is stored as the xor with the one before it, as runs of zero
+// bytes and literal bytes with their lengths as varints
+static void put_varint(std::vector<uint8_t> &out, size_t v)
+{
+	while (v >= 0x80) {
+		out.push_back((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	out.push_back(v);
+}
+
+static bool get_varint(const uint8_t * &p, const uint8_t * end, size_t &v)
+{
+	v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t b = *p++;
+		v |= (size_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void encode_delta(const uint8_t * state, const uint8_t * prev, size_t size, std::vector<uint8_t> &out)
+{
+	size_t i = 0;
+	while (i < size) {
+		size_t zeros = 0;
+		while (i + zeros < size && state[i + zeros] == prev[i + zeros])
+			zeros++;
+		i += zeros;
+		// A literal run stops at the first two unchanged bytes in a row
+		size_t literals = 0;
+		while (i + literals < size && (state[i + literals] != prev[i + literals] ||
+			(i + literals + 1 < size && state[i + literals + 1] != prev[i + literals + 1])))
+			literals++;
+		put_varint(out, zeros);
+		put_varint(out, literals);
+		for (size_t j = 0; j < literals; j++)
+			out.push_back(state[i + j] ^ prev[i + j]);
+		i += literals;
+	}
+}
+
+static bool decode_delta(const uint8_t * p, const uint8_t * end, uint8_t * state, size_t size)
+{
+	size_t i = 0;
+	while (p < end) {
+		size_t zeros, literals;
+		if (!get_varint(p, end, zeros) || !get_varint(p, end, literals))
+			return false;
+		if (zeros > size - i || literals > size - i - zeros || literals > (size_t)(end - p))
+			return false;
+		i += zeros;
+		for (size_t j = 0; j < literals; j++)
+			state[i + j] ^= *p++;
+		i += literals;
+	}
+	return true;
+}
+
+int oplog_index_save(const oplog_index_t &index, const char * path)
+{
+	const size_t size = sizeof(DBOPL::HandlerState);
+	std::vector<uint8_t> data(kSeekHeaderSize);
+	uint8_t * p = data.data();
+	memcpy(p, kSeekMagic, 8);
+	write_le16(p + 8, kSeekVersion);
+	write_le16(p + 10, index.quality);
+	write_le32(p + 12, size);
+	write_le32(p + 16, index.rate);
+	write_le32(p + 20, index.keyframes.size());
+	write_le64(p + 24, index.interval);
+	write_le64(p + 32, index.hash);
+	std::vector<uint8_t> prev(size, 0);
+	std::vector<uint8_t> delta;
+	for (const oplog_keyframe_t &k : index.keyframes) {
+		delta.clear();
+		encode_delta((const uint8_t*)&k.state, prev.data(), size, delta);
+		memcpy(prev.data(), &k.state, size);
+		size_t at = data.size();
+		data.resize(at + kKeyframeHeaderSize);
+		write_le64(&data[at], k.position.frame);
+		write_le64(&data[at + 8], k.position.event);
+		write_le32(&data[at + 16], delta.size());
+		data.insert(data.end(), delta.begin(), delta.end());
+	}
+
+	FILE * f = fopen(path, "wb");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	size_t written = fwrite(data.data(), 1, data.size(), f);
+	if (fclose(f) != 0 || written != data.size()) {
+		fprintf(stderr, "Could not write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int oplog_index_load(const char * path, const oplog_t &log, uint32_t rate, DBOPL::Quality quality, oplog_index_t &index)
+{
+	index.keyframes.clear();
+	FILE * f = fopen(path, "rb");
+	if (f == nullptr)
+		return -1;
+	fclose(f);
+	std::vector<uint8_t> data;
+	if (0 != read_file(path, data))
+		return -1;
+	const size_t size = sizeof(DBOPL::HandlerState);
+	const uint8_t * p = data.data();
+	if (data.size() < kSeekHeaderSize || memcmp(p, kSeekMagic, 8) != 0 ||
+		read_le16(p + 8) != kSeekVersion || read_le32(p + 12) != size) {
+		fprintf(stderr, "%s: not a seek index of this version\n", path);
+		return -1;
+	}
+	index.quality = read_le16(p + 10);
+	index.rate = read_le32(p + 16);
+	uint32_t count = read_le32(p + 20);
+	index.interval = read_le64(p + 24);
+	index.hash = read_le64(p + 32);
+	if (index.rate != rate || index.quality != quality || index.interval == 0 || index.hash != log_hash(log)) {
+		fprintf(stderr, "%s: made for another log, rate or quality\n", path);
+		return -1;
+	}
+
+	const uint8_t * end = data.data() + data.size();
+	p += kSeekHeaderSize;
+	index.keyframes.resize(count);
+	for (uint32_t i = 0; i < count; i++) {
+		oplog_keyframe_t &k = index.keyframes[i];
+		if (i > 0)
+			k.state = index.keyframes[i - 1].state;
+		else
+			memset(&k.state, 0, size);
+		size_t delta = (size_t)(end - p) >= kKeyframeHeaderSize ? read_le32(p + 16) : 0;
+		if ((size_t)(end - p) < kKeyframeHeaderSize + delta ||
+			!decode_delta(p + kKeyframeHeaderSize, p + kKeyframeHeaderSize + delta, (uint8_t*)&k.state, size)) {
+			fprintf(stderr, "%s: truncated seek index\n", path);
+			index.keyframes.clear();
+			return -1;
+		}
+		k.position.frame = read_le64(p);
+		k.position.event = read_le64(p + 8);
+		if (k.position.frame != i * index.interval || k.position.event > log.events.size()) {
+			fprintf(stderr, "%s: corrupt seek index\n", path);
+			index.keyframes.clear();
+			return -1;
+		}
+		p += kKeyframeHeaderSize + delta;
+	}
+	return 0;
+}
+
+void oplog_seek(const oplog_t &log, const oplog_index_t * index, DBOPL::Handler &synth, uint32_t rate,
+	uint64_t frame, oplog_buffers_t &buffers, oplog_position_t &position)
+{
+	synth.Reset();
+	position = { 0, 0 };
+	if (index != nullptr && !index->keyframes.empty()) {
+		uint64_t k = frame / index->interval;
+		if (k >= index->keyframes.size())
+			k = index->keyframes.size() - 1;
+		synth.LoadState(index->keyframes[k].state);
+		position = index->keyframes[k].position;
+	}
+	play(log, synth, rate, position, frame, nullptr, buffers, nullptr);
+}
@@ -0,0 +1,111 @@
+#ifndef OPERATIC_OPLOG_H
+#define OPERATIC_OPLOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "dbopl.h"
+#include "sink.h"
+
+// OPL register logs: DOSBox raw OPL (DRO v2) and uncompressed VGM captures
+// are loaded into one flat list of timed register writes and rendered to
+// 16 bit stereo through an output sink.
+//
+// Times are kept in ticks of 1/441000 s so that both DRO milliseconds
+// (441 ticks) and VGM samples (10 ticks) convert without rounding.
+
+static const uint64_t kLogTicksPerSecond = 441000;
+
+struct oplog_event_t
+{
+	uint64_t time;    // ticks since the start of the log
+	uint16_t reg;     // full register address, 0x100 set for the second bank
+	uint8_t val;
+};
+
+struct oplog_t
+{
+	std::vector<oplog_event_t> events;
+	uint64_t length;  // ticks, at least the time of the last event
+};
+
+// Buffers used while rendering, kept by the caller so they can be reused
+// from one log to the next
+struct oplog_buffers_t
+{
+	std::vector<Bit32s> mix;
+};
+
+struct oplog_stats_t
+{
+	uint64_t frames;  // sample frames written
+	uint64_t writes;  // register writes replayed
+};
+
+// Where playback of a log stands: the next frame to generate and the first
+// event not yet written
+struct oplog_position_t
+{
+	uint64_t frame;
+	size_t event;
+};
+
+// Seek index: a snapshot of the synth every interval frames, taken before the
+// writes due on that frame. Seeking restores the last keyframe before the
+// target and plays on from there, so it never costs more than one interval
+// of emulation however long the log is.
+//
+// Saved next to the log, the snapshots are stored as the bytes that changed
+// since the previous one, usually under a kilobyte per keyframe.
+// The file only loads on a build with the same snapshot layout, for the log
+// it was made from at the same rate and quality; anything else is stale and
+// gets rebuilt.
+
+static const char kSeekMagic[8] = { 'O', 'P', 'L', 'S', 'E', 'E', 'K', 0 };
+static const uint16_t kSeekVersion = 1;
+
+struct oplog_keyframe_t
+{
+	oplog_position_t position;
+	DBOPL::HandlerState state;
+};
+
+struct oplog_index_t
+{
+	uint32_t rate;
+	uint8_t quality;
+	uint64_t interval;  // frames between keyframes
+	uint64_t hash;      // of the log events and length
+	std::vector<oplog_keyframe_t> keyframes;
+};
+
+// Load a DRO or VGM file, the format is detected from the contents
+int oplog_load(const char * path, oplog_t &log);
+
+// Replay log on synth, which must be freshly initialised at rate, into the
+// file open on sink as 2 channels at rate. When index is given, keyframes
+// are taken into it on the way, it must be set up for log by oplog_index_init
+int oplog_render(const oplog_t &log, DBOPL::Handler &synth, uint32_t rate, sink_t &sink,
+	oplog_buffers_t &buffers, oplog_stats_t &stats, oplog_index_t * index = nullptr);
+// The same from position on, as left by oplog_seek
+int oplog_render_from(const oplog_t &log, DBOPL::Handler &synth, uint32_t rate, oplog_position_t position,
+	sink_t &sink, oplog_buffers_t &buffers, oplog_stats_t &stats);
+
+// Start an empty index for log, with a keyframe every seconds
+void oplog_index_init(oplog_index_t &index, const oplog_t &log, uint32_t rate, DBOPL::Quality quality, double seconds);
+// Take the keyframes of a whole log without rendering any output, synth as
+// for oplog_render
+void oplog_index_build(const oplog_t &log, DBOPL::Handler &synth, oplog_index_t &index, oplog_buffers_t &buffers);
+int oplog_index_save(const oplog_index_t &index, const char * path);
+// Fails quietly when there is no index at path, and with a message when the
+// index is for another log, rate or quality or another build
+int oplog_index_load(const char * path, const oplog_t &log, uint32_t rate, DBOPL::Quality quality, oplog_index_t &index);
+
+// Put synth, set up at rate and the quality of index, where playing log
+// reaches frame. Without an index, or with an empty one, it plays from the
+// start. The synth is reset first, so any trace handler is dropped
+void oplog_seek(const oplog_t &log, const oplog_index_t * index, DBOPL::Handler &synth, uint32_t rate,
+	uint64_t frame, oplog_buffers_t &buffers, oplog_position_t &position);
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "oplog.h"
+#include "oplutil.h"
+
+namespace fs = std::filesystem;
+
+static const uint32_t kDefaultRate = 48000;
+// 1.5 s at 44.1kHz, large enough that the writer keeps up with a fast render
+static const size_t kSinkFrames = 1 << 16;
+
+struct job_t
+{
+	fs::path input;
+	fs::path output;
+	uint64_t size;
+};
+
+// Every worker owns a queue of jobs, largest first. Idle workers steal from
+// the front of the other queues so the longest job left always starts next.
+struct worker_t
+{
+	std::mutex lock;
+	std::deque<size_t> jobs;
+	oplog_buffers_t buffers;
+	sink_t sink;
+	DBOPL::Handler synth;  // reset between jobs instead of set up again
+	std::thread thread;
+};
+
+struct batch_t
+{
+	std::vector<job_t> jobs;
+	std::vector<worker_t> workers;
+	uint32_t rate;
+	DBOPL::Quality quality;
+	sink_format_t format;
+	double keyframes;  // seconds between keyframes of the seek index, 0 for none
+	double start;      // seconds into every log to start rendering at
+	std::atomic<uint64_t> frames;
+	std::atomic<uint64_t> writes;
+	std::atomic<uint32_t> failed;
+};
+
+static bool is_log(const fs::path &path)
+{
+	std::string ext = path.extension().string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return ext == ".dro" || ext == ".vgm";
+}
+
+static const char * output_extension(const batch_t &batch)
+{
+	return batch.format == SINK_FLAC ? ".flac" : ".wav";
+}
+
+static void add_job(batch_t &batch, const fs::path &input, const fs::path &relative, const char * outdir)
+{
+	job_t job;
+	job.input = input;
+	job.output = outdir ? fs::path(outdir) / relative : input;
+	job.output.replace_extension(output_extension(batch));
+	std::error_code ec;
+	job.size = fs::file_size(input, ec);
+	batch.jobs.push_back(job);
+}
+
+// Directories are searched for .dro and .vgm files, @file reads a list of paths
+static int add_input(batch_t &batch, const char * arg, const char * outdir)
+{
+	std::error_code ec;
+	if (arg[0] == '@') {
+		FILE * f = fopen(arg + 1, "r");
+		if (f == nullptr) {
+			fprintf(stderr, "Could not open %s\n", arg + 1);
+			return -1;
+		}
+		char line[4096];
+		int ret = 0;
+		while (ret == 0 && fgets(line, sizeof(line), f)) {
+			line[strcspn(line, "\r\n")] = 0;
+			if (line[0] != 0)
+				ret = add_input(batch, line, outdir);
+		}
+		fclose(f);
+		return ret;
+	}
+	fs::path path(arg);
+	if (fs::is_directory(path, ec)) {
+		for (auto it = fs::recursive_directory_iterator(path, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+			if (it->is_regular_file(ec) && is_log(it->path()))
+				add_job(batch, it->path(), fs::relative(it->path(), path, ec), outdir);
+		}
+		if (ec) {
+			fprintf(stderr, "Could not read %s: %s\n", arg, ec.message().c_str());
+			return -1;
+		}
+		return 0;
+	}
+	if (!fs::is_regular_file(path, ec)) {
+		fprintf(stderr, "Could not open %s\n", arg);
+		return -1;
+	}
+	add_job(batch, path, path.filename(), outdir);
+	return 0;
+}
+
+// The seek index of a log is kept next to it as song.dro.seek
+static fs::path index_path(const job_t &job)
+{
+	fs::path path = job.input;
+	path += ".seek";
+	return path;
+}
+
+static int render_job(batch_t &batch, const job_t &job, worker_t &w)
+{
+	oplog_t log;
+	if (0 != oplog_load(job.input.c_str(), log))
+		return -1;
+	oplog_index_t index;
+	bool indexed = false;
+	bool record = false;
+	if (batch.keyframes > 0 || batch.start > 0)
+		indexed = 0 == oplog_index_load(index_path(job).c_str(), log, batch.rate, batch.quality, index);
+	if (!indexed && batch.keyframes > 0) {
+		oplog_index_init(index, log, batch.rate, batch.quality, batch.keyframes);
+		// Starting later needs the index before rendering, otherwise it is
+		// taken along the way
+		if (batch.start > 0) {
+			w.synth.Reset();
+			oplog_index_build(log, w.synth, index, w.buffers);
+			indexed = 0 == oplog_index_save(index, index_path(job).c_str());
+		} else {
+			record = true;
+		}
+	}
+
+	std::error_code ec;
+	if (job.output.has_parent_path())
+		fs::create_directories(job.output.parent_path(), ec);
+	if (0 != sink_open(w.sink, job.output.c_str(), batch.format, batch.rate, 2))
+		return -1;
+	oplog_stats_t stats;
+	int ret;
+	if (batch.start > 0) {
+		oplog_position_t position;
+		oplog_seek(log, indexed ? &index : nullptr, w.synth, batch.rate,
+			(uint64_t)(batch.start * batch.rate), w.buffers, position);
+		ret = oplog_render_from(log, w.synth, batch.rate, position, w.sink, w.buffers, stats);
+	} else {
+		w.synth.Reset();
+		ret = oplog_render(log, w.synth, batch.rate, w.sink, w.buffers, stats, record ? &index : nullptr);
+	}
+	if (sink_close(w.sink) != 0)
+		ret = -1;
+	if (ret != 0) {
+		fprintf(stderr, "Could not write %s\n", job.output.c_str());
+		return -1;
+	}
+	batch.frames += stats.frames;
+	batch.writes += stats.writes;
+	if (record && 0 != oplog_index_save(index, index_path(job).c_str()))
+		return -1;
+	return 0;
+}
+
+static bool next_job(batch_t &batch, size_t self, size_t &job)
+{
+	size_t count = batch.workers.size();
+	for (size_t i = 0; i < count; i++) {
+		worker_t &w = batch.workers[(self + i) % count];
+		std::lock_guard<std::mutex> guard(w.lock);
+		if (!w.jobs.empty()) {
+			job = w.jobs.front();
+			w.jobs.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+static void worker_thread(batch_t * batch, size_t self)
+{
+	worker_t &w = batch->workers[self];
+	size_t job;
+	while (next_job(*batch, self, job)) {
+		if (0 != render_job(*batch, batch->jobs[job], w))
+			batch->failed++;
+	}
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-r rate] [-q full|half|quarter] [-f wav|flac] [-o outdir] [-k seconds] [-s seconds] input...\n", name);
+	fprintf(stderr, "Inputs are .dro or .vgm files, directories searched for them, or @list files\n");
+	fprintf(stderr, "-k saves a seek index with a keyframe every seconds next to every input\n");
+	fprintf(stderr, "-s starts rendering seconds into every input, through its seek index when there is one\n");
+}
+
+int main(int argc, char ** argv)
+{
+	batch_t batch;
+	batch.rate = kDefaultRate;
+	batch.quality = DBOPL::qualityFull;
+	batch.format = SINK_WAV;
+	batch.keyframes = 0;
+	batch.start = 0;
+	batch.frames = 0;
+	batch.writes = 0;
+	batch.failed = 0;
+	unsigned threads = std::thread::hardware_concurrency();
+	const char * outdir = nullptr;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			batch.rate = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			if (0 != parse_quality(argv[++i], batch.quality)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			const char * f = argv[++i];
+			if (strcmp(f, "wav") == 0) {
+				batch.format = SINK_WAV;
+			} else if (strcmp(f, "flac") == 0) {
+				batch.format = SINK_FLAC;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			outdir = argv[++i];
+		} else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+			batch.keyframes = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			batch.start = atof(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (i == argc || batch.rate == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (; i < argc; i++) {
+		if (0 != add_input(batch, argv[i], outdir))
+			return 1;
+	}
+	if (batch.jobs.empty()) {
+		fprintf(stderr, "No register logs found\n");
+		return 1;
+	}
+
+	// song.dro and song.vgm next to each other keep their extension in the output name
+	std::sort(batch.jobs.begin(), batch.jobs.end(), [](const job_t &a, const job_t &b) {
+		return a.output < b.output;
+	});
+	for (size_t j = 1; j < batch.jobs.size(); j++) {
+		if (batch.jobs[j].output == batch.jobs[j - 1].output) {
+			batch.jobs[j - 1].output.replace_extension(batch.jobs[j - 1].input.extension().string() + output_extension(batch));
+			batch.jobs[j].output.replace_extension(batch.jobs[j].input.extension().string() + output_extension(batch));
+		}
+	}
+
+	// Hand out the largest files first so a long job never starts last
+	std::stable_sort(batch.jobs.begin(), batch.jobs.end(), [](const job_t &a, const job_t &b) {
+		return a.size > b.size;
+	});
+	if (threads == 0)
+		threads = 1;
+	if (threads > batch.jobs.size())
+		threads = batch.jobs.size();
+	batch.workers = std::vector<worker_t>(threads);
+	for (size_t j = 0; j < batch.jobs.size(); j++)
+		batch.workers[j % threads].jobs.push_back(j);
+
+	for (size_t t = 0; t < threads; t++) {
+		if (0 != sink_init(batch.workers[t].sink, kSinkFrames))
+			return 1;
+		batch.workers[t].synth.Init(batch.rate, batch.quality);
+	}
+	auto start = std::chrono::steady_clock::now();
+	for (size_t t = 0; t < threads; t++)
+		batch.workers[t].thread = std::thread(worker_thread, &batch, t);
+	for (size_t t = 0; t < threads; t++)
+		batch.workers[t].thread.join();
+	for (size_t t = 0; t < threads; t++)
+		sink_free(batch.workers[t].sink);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double audio = (double)batch.frames / batch.rate;
+	size_t done = batch.jobs.size() - batch.failed;
+	printf("Rendered %zu of %zu files on %u threads: %.1f s of audio in %.2f s\n",
+		done, batch.jobs.size(), threads, audio, elapsed);
+	if (elapsed > 0) {
+		printf("%.1fx realtime, %.1f files/s, %.0f register writes/s\n",
+			audio / elapsed, done / elapsed, batch.writes / elapsed);
+	}
+	return batch.failed ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+#ifndef OPERATIC_OPLUTIL_H
+#define OPERATIC_OPLUTIL_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dbopl.h"
+
+// Small helpers shared by everything that plays notes on the chip or turns
+// its output into 16 bit audio.
+
+// The chip runs at its 14.318 MHz clock divided by 288
+static const double kOplClock = 14318180.0 / 288.0;
+// Generate output to 16 bit samples, a single voice is quiet otherwise
+static const int32_t kOplGain = 2;
+
+static inline int16_t opl_clip(Bit32s sample)
+{
+	sample *= kOplGain;
+	if (sample > 32767)
+		return 32767;
+	if (sample < -32768)
+		return -32768;
+	return sample;
+}
+
+// F-number and block of a frequency in Hz
+static inline void opl_frequency(double freq, uint16_t &fnum, uint8_t &block)
+{
+	// Use the lowest block that fits for the best frequency resolution
+	for (block = 0; block < 7; block++) {
+		if (freq * (1 << (20 - block)) / kOplClock < 1023.5)
+			break;
+	}
+	double f = freq * (1 << (20 - block)) / kOplClock + 0.5;
+	fnum = f > 1023.0 ? 1023 : (uint16_t)f;
+}
+
+// F-number and block of a MIDI note, fractions bend it
+static inline void opl_note_frequency(double note, uint16_t &fnum, uint8_t &block)
+{
+	opl_frequency(440.0 * pow(2.0, (note - 69.0) / 12.0), fnum, block);
+}
+
+static inline uint64_t splitmix(uint64_t &state)
+{
+	uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+// The value of a -q option: full, half or quarter
+static inline int parse_quality(const char * name, DBOPL::Quality &quality)
+{
+	if (strcmp(name, "full") == 0) {
+		quality = DBOPL::qualityFull;
+	} else if (strcmp(name, "half") == 0) {
+		quality = DBOPL::qualityHalf;
+	} else if (strcmp(name, "quarter") == 0) {
+		quality = DBOPL::qualityQuarter;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+#endif
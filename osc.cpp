@@ -0,0 +1,372 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "oplutil.h"
+#include "osc.h"
+
+static const int kPollTimeout = 100; // ms, only bounds how long osc_close waits
+// A bit over a second of writes at tens of thousands of messages a second
+static const size_t kOscQueueSize = 1 << 16;
+// Datagrams taken per recvmmsg call, and the largest one accepted
+static const size_t kReceiveBatch = 64;
+static const size_t kDatagramSize = 16384;
+static const int kReceiveBuffer = 4 << 20;
+static const size_t kMaxArgs = 256;
+static const int kMaxBundleDepth = 8;
+
+
+// Offset of every operator slot within a bank
+static const uint8_t kOperatorOffset[18] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15,
+};
+
+// A bit field of a channel or operator register
+struct osc_field_t
+{
+	const char * name;
+	uint8_t reg;
+	uint8_t shift;
+	uint8_t bits;
+};
+
+static const osc_field_t kChannelFields[] = {
+	{ "block", 0xb0, 2, 3 },
+	{ "key", 0xb0, 5, 1 },
+	{ "feedback", 0xc0, 1, 3 },
+	{ "connection", 0xc0, 0, 1 },
+	{ "pan", 0xc0, 4, 2 },
+};
+
+static const osc_field_t kOperatorFields[] = {
+	{ "tremolo", 0x20, 7, 1 },
+	{ "vibrato", 0x20, 6, 1 },
+	{ "sustain_mode", 0x20, 5, 1 },
+	{ "ksr", 0x20, 4, 1 },
+	{ "multi", 0x20, 0, 4 },
+	{ "ksl", 0x40, 6, 2 },
+	{ "level", 0x40, 0, 6 },
+	{ "attack", 0x60, 4, 4 },
+	{ "decay", 0x60, 0, 4 },
+	{ "sustain", 0x80, 4, 4 },
+	{ "release", 0x80, 0, 4 },
+	{ "wave", 0xe0, 0, 3 },
+};
+
+static uint32_t read_be32(const uint8_t * p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint64_t read_be64(const uint8_t * p)
+{
+	return ((uint64_t)read_be32(p) << 32) | read_be32(p + 4);
+}
+
+static size_t padded(size_t size)
+{
+	return (size + 3) & ~(size_t)3;
+}
+
+// A string padded with zeros to 4 bytes
+static bool read_string(const uint8_t * &p, const uint8_t * end, const char * &str)
+{
+	const uint8_t * zero = (const uint8_t *)memchr(p, 0, end - p);
+	if (zero == nullptr || padded(zero - p + 1) > (size_t)(end - p))
+		return false;
+	str = (const char *)p;
+	p += padded(zero - p + 1);
+	return true;
+}
+
+// Waits for the audio side to make room rather than dropping writes, only
+// the network thread ever waits here
+static bool push(osc_input_t &osc, uint16_t reg, uint8_t val, uint8_t mask)
+{
+	while (!regqueue_push(osc.queue, osc.now, reg, val, mask)) {
+		if (!osc.running.load(std::memory_order_relaxed))
+			return false;
+		std::this_thread::yield();
+	}
+	osc.writes.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+static void push_field(osc_input_t &osc, uint16_t reg, const osc_field_t &field, int64_t value)
+{
+	uint8_t mask = ((1 << field.bits) - 1) << field.shift;
+	push(osc, reg, (uint8_t)(value << field.shift) & mask, mask);
+}
+
+static uint16_t channel_reg(int64_t channel, uint8_t reg)
+{
+	return ((channel / 9) << 8) | (reg + channel % 9);
+}
+
+static int channel_message(osc_input_t &osc, const char * rest, const int64_t * args, size_t count)
+{
+	char * name;
+	long channel = strtol(rest, &name, 10);
+	if (name == rest || *name != '/' || channel < 0 || channel >= 18 || count < 1)
+		return -1;
+	name++;
+	if (strcmp(name, "fnum") == 0) {
+		push(osc, channel_reg(channel, 0xa0), args[0] & 0xff, 0xff);
+		push(osc, channel_reg(channel, 0xb0), (args[0] >> 8) & 0x03, 0x03);
+		return 0;
+	}
+	for (const osc_field_t &field : kChannelFields) {
+		if (strcmp(name, field.name) == 0) {
+			push_field(osc, channel_reg(channel, field.reg), field, args[0]);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int operator_message(osc_input_t &osc, const char * rest, const int64_t * args, size_t count)
+{
+	char * name;
+	long slot = strtol(rest, &name, 10);
+	if (name == rest || *name != '/' || slot < 0 || slot >= 36 || count < 1)
+		return -1;
+	name++;
+	for (const osc_field_t &field : kOperatorFields) {
+		if (strcmp(name, field.name) == 0) {
+			push_field(osc, ((slot / 18) << 8) | (field.reg + kOperatorOffset[slot % 18]), field, args[0]);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Key on retriggers the envelope even when the channel was still sounding
+static int note_message(osc_input_t &osc, const int64_t * args, size_t count)
+{
+	if (count < 3 || args[0] < 0 || args[0] >= 18)
+		return -1;
+	uint16_t b0 = channel_reg(args[0], 0xb0);
+	push(osc, b0, 0, 0x20);
+	if (args[2] <= 0)
+		return 0;
+	uint16_t fnum;
+	uint8_t block;
+	opl_note_frequency((double)args[1], fnum, block);
+	push(osc, channel_reg(args[0], 0xa0), fnum & 0xff, 0xff);
+	push(osc, b0, 0x20 | (block << 2) | (fnum >> 8), 0x3f);
+	return 0;
+}
+
+static int message(osc_input_t &osc, const uint8_t * p, const uint8_t * end)
+{
+	const char * address;
+	const char * types = ",";
+	if (!read_string(p, end, address))
+		return -1;
+	// Old senders leave out the type tags when there are no arguments
+	if (p < end && (!read_string(p, end, types) || types[0] != ','))
+		return -1;
+	int64_t args[kMaxArgs];
+	size_t count = 0;
+	const uint8_t * blob = nullptr;
+	size_t blob_size = 0;
+	for (const char * t = types + 1; *t != 0; t++) {
+		int64_t value = 0;
+		switch (*t) {
+			case 'i':
+				if (end - p < 4)
+					return -1;
+				value = (int32_t)read_be32(p);
+				p += 4;
+				break;
+			case 'f': {
+				if (end - p < 4)
+					return -1;
+				uint32_t bits = read_be32(p);
+				float f;
+				memcpy(&f, &bits, 4);
+				value = lrintf(f);
+				p += 4;
+				break;
+			}
+			case 'h':
+				if (end - p < 8)
+					return -1;
+				value = (int64_t)read_be64(p);
+				p += 8;
+				break;
+			case 'd': {
+				if (end - p < 8)
+					return -1;
+				uint64_t bits = read_be64(p);
+				double d;
+				memcpy(&d, &bits, 8);
+				value = llrint(d);
+				p += 8;
+				break;
+			}
+			case 'T':
+				value = 1;
+				break;
+			case 'F':
+				break;
+			case 'b':
+				if (end - p < 4 || padded(read_be32(p)) > (size_t)(end - p - 4))
+					return -1;
+				blob_size = read_be32(p);
+				blob = p + 4;
+				p += 4 + padded(blob_size);
+				continue;
+			case 's':
+			case 'S': {
+				const char * str;
+				if (!read_string(p, end, str))
+					return -1;
+				continue;
+			}
+			case 'N':
+			case 'I':
+				continue;
+			default:
+				return -1;
+		}
+		if (count == kMaxArgs)
+			return -1;
+		args[count++] = value;
+	}
+
+	if (strncmp(address, "/chan/", 6) == 0)
+		return channel_message(osc, address + 6, args, count);
+	if (strncmp(address, "/op/", 4) == 0)
+		return operator_message(osc, address + 4, args, count);
+	if (strcmp(address, "/note") == 0)
+		return note_message(osc, args, count);
+	if (strcmp(address, "/reg") == 0) {
+		if (count < 2)
+			return -1;
+		push(osc, args[0] & 0x1ff, args[1], 0xff);
+		return 0;
+	}
+	if (strcmp(address, "/regs") == 0) {
+		if (blob != nullptr) {
+			for (size_t i = 0; i + 3 <= blob_size; i += 3)
+				push(osc, ((blob[i] << 8) | blob[i + 1]) & 0x1ff, blob[i + 2], 0xff);
+			return blob_size % 3 ? -1 : 0;
+		}
+		for (size_t i = 0; i + 2 <= count; i += 2)
+			push(osc, args[i] & 0x1ff, args[i + 1], 0xff);
+		return count % 2 ? -1 : 0;
+	}
+	return -1;
+}
+
+// Returns the messages in the packet, -1 for a malformed one
+static int packet(osc_input_t &osc, const uint8_t * p, size_t size, int depth)
+{
+	if (size < 8 || memcmp(p, "#bundle", 8) != 0) {
+		osc.messages.fetch_add(1, std::memory_order_relaxed);
+		return message(osc, p, p + size);
+	}
+	// Skip the time tag, the bundle plays when it arrives
+	if (depth == kMaxBundleDepth || size < 16)
+		return -1;
+	const uint8_t * end = p + size;
+	p += 16;
+	int ret = 0;
+	while (p < end) {
+		if (end - p < 4)
+			return -1;
+		size_t element = read_be32(p);
+		if (element > (size_t)(end - p - 4))
+			return -1;
+		if (packet(osc, p + 4, element, depth + 1) != 0)
+			ret = -1;
+		p += 4 + element;
+	}
+	return ret;
+}
+
+static void osc_thread(osc_input_t * osc)
+{
+	std::vector<uint8_t> buffers(kReceiveBatch * kDatagramSize);
+	struct mmsghdr msgs[kReceiveBatch];
+	struct iovec iovs[kReceiveBatch];
+	struct pollfd pfd = { osc->socket, POLLIN, 0 };
+	while (osc->running) {
+		if (poll(&pfd, 1, kPollTimeout) <= 0)
+			continue;
+		for (;;) {
+			memset(msgs, 0, sizeof(msgs));
+			for (size_t i = 0; i < kReceiveBatch; i++) {
+				iovs[i].iov_base = &buffers[i * kDatagramSize];
+				iovs[i].iov_len = kDatagramSize;
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			int got = recvmmsg(osc->socket, msgs, kReceiveBatch, MSG_DONTWAIT, nullptr);
+			if (got <= 0)
+				break;
+			for (int i = 0; i < got; i++) {
+				osc->now = osc->clock();
+				if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+					packet(*osc, &buffers[i * kDatagramSize], msgs[i].msg_len, 0) != 0)
+					osc->errors.fetch_add(1, std::memory_order_relaxed);
+			}
+			if (got < (int)kReceiveBatch)
+				break;
+		}
+	}
+}
+
+int osc_open(osc_input_t &osc, uint16_t port, uint32_t (*clock)())
+{
+	osc.socket = socket(AF_INET, SOCK_DGRAM, 0);
+	if (osc.socket < 0) {
+		fprintf(stderr, "Could not create OSC socket: %s\n", strerror(errno));
+		return -1;
+	}
+	// Bursts from a script arrive faster than one poll wakeup drains them
+	int size = kReceiveBuffer;
+	setsockopt(osc.socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	struct sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(osc.socket, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Could not bind OSC port %u: %s\n", port, strerror(errno));
+		close(osc.socket);
+		osc.socket = -1;
+		return -1;
+	}
+	printf("OSC input on udp://127.0.0.1:%u\n", port);
+
+	regqueue_init(osc.queue, kOscQueueSize);
+	osc.clock = clock;
+	osc.messages = 0;
+	osc.writes = 0;
+	osc.errors = 0;
+	osc.running = true;
+	osc.thread = std::thread(osc_thread, &osc);
+	return 0;
+}
+
+void osc_close(osc_input_t &osc)
+{
+	if (!osc.running)
+		return;
+	osc.running = false;
+	osc.thread.join();
+	close(osc.socket);
+	osc.socket = -1;
+	printf("OSC: %llu messages, %llu register writes, %llu malformed packets\n",
+		(unsigned long long)osc.messages, (unsigned long long)osc.writes, (unsigned long long)osc.errors);
+}
@@ -0,0 +1,46 @@
+#ifndef OPERATIC_OSC_H
+#define OPERATIC_OSC_H
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+#include "regqueue.h"
+
+// OSC over UDP on the loopback interface, for controlling the synth from
+// scripts. Packets are decoded on a network thread of their own into
+// register writes on a lock free queue, every write stamped with clock when
+// its packet arrived. Whoever generates audio places them by that time, the
+// same way as the editor's writes. Bundle time tags are not scheduled, a
+// bundle plays when it arrives like everything else.
+//
+//   /chan/N/fnum|block|key|feedback|connection|pan i   channel 0-17
+//   /op/N/tremolo|vibrato|sustain_mode|ksr|multi|ksl|level|attack|decay|sustain|release|wave i
+//                                                       operator slot 0-35
+//   /note i:channel i:note i:velocity                   velocity 0 keys off
+//   /reg i:reg i:val                                    full register address
+//   /regs i:reg i:val ...  or  /regs b                  blob of reg hi, reg lo, val
+//
+// Arguments may be int32, int64, float or double. Fields of a register are
+// written as masked writes, so a message only changes its own bits.
+
+static const uint16_t kOscDefaultPort = 7770;
+
+struct osc_input_t
+{
+	int socket;
+	regqueue_t queue;
+	uint32_t (*clock)();
+	uint32_t now;  // arrival of the packet being decoded, network thread only
+	std::atomic<bool> running;
+	std::thread thread;
+	// Counted on the network thread
+	std::atomic<uint64_t> messages;
+	std::atomic<uint64_t> writes;
+	std::atomic<uint64_t> errors;
+};
+
+int osc_open(osc_input_t &osc, uint16_t port, uint32_t (*clock)());
+void osc_close(osc_input_t &osc);
+
+#endif
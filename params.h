@@ -0,0 +1,71 @@
+#ifndef OPERATIC_PARAMS_H
+#define OPERATIC_PARAMS_H
+
+#include <stdint.h>
+
+// The editable parameters of an operator and a channel, shared by the editor
+// and the plugin. Every parameter is a field of one register.
+
+enum operator_param
+{
+	OP_TREM,
+	OP_VIB,
+	OP_SUSTAIN,
+	OP_KSR,
+	OP_FMULTI,
+	OP_KSL,
+	OP_OLVL,
+	OP_A,
+	OP_D,
+	OP_S,
+	OP_R,
+	OP_COUNT
+};
+
+enum channel_param
+{
+	CH_FNUMBER = 0,
+	CH_FEEDBACK,
+	CH_OCTAVE,
+	CH_KEYON,
+	CH_COUNT
+};
+
+static const uint8_t operator_param_mask[OP_COUNT] = {
+	0x01,
+	0x01,
+	0x01,
+	0x01,
+	0x0F, // multi: 4 bits
+	0x03, // ksl: 3 bits
+	0x3f, // output level: 6 bits
+	0x0F,
+	0x0F,
+	0x0F,
+	0x0F
+};
+
+static const uint16_t channel_param_mask[CH_COUNT] = {
+	0x03ff, // f-number: 10 bits
+	0x0007, // feedback: 3 bits
+	0x0007, // octave: 3 bits
+	0x0001, // key-on: 1 bit
+};
+
+// Register group of every operator parameter, before the operator offset,
+// and where the field starts in it
+static const uint8_t operator_param_reg[OP_COUNT] = {
+	0x20, 0x20, 0x20, 0x20, 0x20,
+	0x40, 0x40,
+	0x60, 0x60,
+	0x80, 0x80
+};
+
+static const uint8_t operator_param_shift[OP_COUNT] = {
+	7, 6, 5, 4, 0,
+	6, 0,
+	4, 0,
+	4, 0
+};
+
+#endif
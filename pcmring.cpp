@@ -0,0 +1,65 @@
+#include <string.h>
+
+#include "pcmring.h"
+
+void pcmring_init(pcmring_t &ring, size_t frames, size_t channels)
+{
+	size_t size = 1;
+	while (size < frames)
+		size <<= 1;
+	ring.channels = channels > 0 ? channels : 1;
+	ring.samples.assign(size * ring.channels, 0);
+	ring.head.store(0, std::memory_order_relaxed);
+	ring.tail.store(0, std::memory_order_relaxed);
+}
+
+size_t pcmring_capacity(const pcmring_t &ring)
+{
+	return ring.samples.size() / ring.channels;
+}
+
+size_t pcmring_fill(const pcmring_t &ring)
+{
+	uint64_t head = ring.head.load(std::memory_order_acquire);
+	return ring.tail.load(std::memory_order_acquire) - head;
+}
+
+// Copy frames between data and the ring starting at frame position, in at
+// most two pieces around the end
+static void copy_frames(pcmring_t &ring, uint64_t position, int16_t * data, size_t frames, bool into)
+{
+	size_t capacity = pcmring_capacity(ring);
+	size_t start = position & (capacity - 1);
+	size_t first = frames < capacity - start ? frames : capacity - start;
+	int16_t * ringdata = ring.samples.data();
+	size_t bytes = ring.channels * sizeof(int16_t);
+	if (into) {
+		memcpy(ringdata + start * ring.channels, data, first * bytes);
+		memcpy(ringdata, data + first * ring.channels, (frames - first) * bytes);
+	} else {
+		memcpy(data, ringdata + start * ring.channels, first * bytes);
+		memcpy(data + first * ring.channels, ringdata, (frames - first) * bytes);
+	}
+}
+
+size_t pcmring_write(pcmring_t &ring, const int16_t * data, size_t frames)
+{
+	uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+	size_t space = pcmring_capacity(ring) - (tail - ring.head.load(std::memory_order_acquire));
+	if (frames > space)
+		frames = space;
+	copy_frames(ring, tail, (int16_t*)data, frames, true);
+	ring.tail.store(tail + frames, std::memory_order_release);
+	return frames;
+}
+
+size_t pcmring_read(pcmring_t &ring, int16_t * data, size_t frames)
+{
+	uint64_t head = ring.head.load(std::memory_order_relaxed);
+	size_t fill = ring.tail.load(std::memory_order_acquire) - head;
+	if (frames > fill)
+		frames = fill;
+	copy_frames(ring, head, data, frames, false);
+	ring.head.store(head + frames, std::memory_order_release);
+	return frames;
+}
@@ -0,0 +1,33 @@
+#ifndef OPERATIC_PCMRING_H
+#define OPERATIC_PCMRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// A lock free ring of 16 bit sample frames from one producer thread to one
+// consumer thread, for audio generated ahead of the callback that plays it.
+// The positions count every frame ever written and read, so they double as
+// a sample clock on both sides.
+
+struct pcmring_t
+{
+	std::vector<int16_t> samples;          // a power of two frames long
+	size_t channels;
+	alignas(64) std::atomic<uint64_t> head;  // frames read, moved by the consumer
+	alignas(64) std::atomic<uint64_t> tail;  // frames written, moved by the producer
+};
+
+// frames is rounded up to a power of two
+void pcmring_init(pcmring_t &ring, size_t frames, size_t channels);
+size_t pcmring_capacity(const pcmring_t &ring);
+// Frames waiting to be read. The other side keeps moving, so the producer
+// may count a few frames too many and the consumer a few too few
+size_t pcmring_fill(const pcmring_t &ring);
+// Both return the frames copied, fewer than asked when the ring is full or
+// runs empty
+size_t pcmring_write(pcmring_t &ring, const int16_t * data, size_t frames);
+size_t pcmring_read(pcmring_t &ring, int16_t * data, size_t frames);
+
+#endif
@@ -0,0 +1,227 @@
+#include <alloca.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
+
+#include "realtime.h"
+
+static const size_t kPageSize = 4096;
+
+int realtime_lock_memory()
+{
+	if (0 != mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		fprintf(stderr, "Could not lock memory: %s\n", strerror(errno));
+		if (errno == ENOMEM || errno == EPERM)
+			fprintf(stderr, "Raise RLIMIT_MEMLOCK (memlock in limits.conf) to allow it\n");
+		return -1;
+	}
+	return 0;
+}
+
+void realtime_prefault(void * data, size_t size)
+{
+	volatile uint8_t * p = (volatile uint8_t *)data;
+	for (size_t i = 0; i < size; i += kPageSize)
+		p[i] = p[i];
+	if (size > 0)
+		p[size - 1] = p[size - 1];
+}
+
+void realtime_prefault_stack(size_t size)
+{
+	volatile uint8_t * stack = (volatile uint8_t *)alloca(size);
+	for (size_t i = 0; i < size; i += kPageSize)
+		stack[i] = 0;
+}
+
+int realtime_promote(int priority, int cpu)
+{
+	int ret = 0;
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err != 0) {
+			fprintf(stderr, "Could not pin thread to CPU %d: %s\n", cpu, strerror(err));
+			ret = -1;
+		}
+	}
+	sched_param param{};
+	int max = sched_get_priority_max(SCHED_FIFO);
+	param.sched_priority = priority < max ? priority : max;
+	int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err != 0) {
+		fprintf(stderr, "Could not switch to SCHED_FIFO: %s\n", strerror(err));
+		if (err == EPERM)
+			fprintf(stderr, "Raise RLIMIT_RTPRIO (rtprio in limits.conf) to at least %d to allow it\n",
+				param.sched_priority);
+		ret = -1;
+	}
+	return ret;
+}
+
+#ifdef NDEBUG
+
+realtime_guard_t::realtime_guard_t(bool arm)
+	: armed(arm)
+{
+}
+
+realtime_guard_t::~realtime_guard_t()
+{
+}
+
+void realtime_lock(std::mutex &lock)
+{
+	lock.lock();
+}
+
+#else
+
+static thread_local int guard_depth = 0;
+
+static void guard_violation(const char * what)
+{
+	// Leave the guard first, reporting may allocate
+	guard_depth = 0;
+	fprintf(stderr, "%s in a realtime section\n", what);
+	abort();
+}
+
+realtime_guard_t::realtime_guard_t(bool arm)
+	: armed(arm)
+{
+	if (armed)
+		guard_depth++;
+}
+
+realtime_guard_t::~realtime_guard_t()
+{
+	if (armed)
+		guard_depth--;
+}
+
+void realtime_lock(std::mutex &lock)
+{
+	if (lock.try_lock())
+		return;
+	if (guard_depth > 0)
+		guard_violation("Blocked on a lock");
+	lock.lock();
+}
+
+static void * guarded_alloc(size_t size)
+{
+	if (guard_depth > 0)
+		guard_violation("Allocated memory");
+	void * p = malloc(size > 0 ? size : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+static void * guarded_alloc(size_t size, std::align_val_t align)
+{
+	if (guard_depth > 0)
+		guard_violation("Allocated memory");
+	size_t alignment = (size_t)align;
+	void * p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+static void guarded_free(void * p)
+{
+	if (p != nullptr && guard_depth > 0)
+		guard_violation("Freed memory");
+	free(p);
+}
+
+void * operator new(size_t size)
+{
+	return guarded_alloc(size);
+}
+
+void * operator new[](size_t size)
+{
+	return guarded_alloc(size);
+}
+
+void * operator new(size_t size, std::align_val_t align)
+{
+	return guarded_alloc(size, align);
+}
+
+void * operator new[](size_t size, std::align_val_t align)
+{
+	return guarded_alloc(size, align);
+}
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	try {
+		return guarded_alloc(size);
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	try {
+		return guarded_alloc(size);
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+}
+
+void operator delete(void * p) noexcept
+{
+	guarded_free(p);
+}
+
+void operator delete[](void * p) noexcept
+{
+	guarded_free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+	guarded_free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept
+{
+	guarded_free(p);
+}
+
+void operator delete(void * p, std::align_val_t) noexcept
+{
+	guarded_free(p);
+}
+
+void operator delete[](void * p, std::align_val_t) noexcept
+{
+	guarded_free(p);
+}
+
+void operator delete(void * p, size_t, std::align_val_t) noexcept
+{
+	guarded_free(p);
+}
+
+void operator delete[](void * p, size_t, std::align_val_t) noexcept
+{
+	guarded_free(p);
+}
+
+#endif
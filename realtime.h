@@ -0,0 +1,41 @@
+#ifndef OPERATIC_REALTIME_H
+#define OPERATIC_REALTIME_H
+
+#include <stddef.h>
+#include <mutex>
+
+// Opt-in hardening for the thread that has to keep the audio device fed:
+// SCHED_FIFO, pinning to one core and keeping memory resident so the thread
+// never waits on the scheduler or a page fault.
+//
+// Debug builds also get a guard: while a realtime_guard_t is alive on a
+// thread, allocating through operator new or blocking in realtime_lock
+// aborts with a message, so such calls are found on the desk and not as a
+// dropout under load. malloc from C code is not caught. Release builds
+// compile the guard away.
+
+static const int kRealtimePriority = 70;
+
+// Lock all current and future pages of the process in memory
+int realtime_lock_memory();
+// Touch every page of data, for memory that has to be resident even when
+// realtime_lock_memory is not allowed
+void realtime_prefault(void * data, size_t size);
+// Grow the stack of the calling thread by size now rather than in the callback
+void realtime_prefault_stack(size_t size);
+// Move the calling thread to SCHED_FIFO at priority and pin it to cpu,
+// unless cpu is negative
+int realtime_promote(int priority, int cpu);
+
+// Guards the rest of the scope, when armed
+struct realtime_guard_t
+{
+	bool armed;
+	realtime_guard_t(bool arm = true);
+	~realtime_guard_t();
+};
+
+// Take lock, in a guarded section of a debug build abort when that would block
+void realtime_lock(std::mutex &lock);
+
+#endif
@@ -0,0 +1,34 @@
+#include "regqueue.h"
+
+void regqueue_init(regqueue_t &queue, size_t capacity)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	queue.writes.assign(size, regqueue_write_t{});
+	queue.head.store(0, std::memory_order_relaxed);
+	queue.tail.store(0, std::memory_order_relaxed);
+}
+
+bool regqueue_push(regqueue_t &queue, uint64_t time, uint16_t reg, uint8_t val, uint8_t mask)
+{
+	size_t tail = queue.tail.load(std::memory_order_relaxed);
+	if (tail - queue.head.load(std::memory_order_acquire) == queue.writes.size())
+		return false;
+	queue.writes[tail & (queue.writes.size() - 1)] = regqueue_write_t{ time, reg, val, mask };
+	queue.tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+const regqueue_write_t * regqueue_peek(regqueue_t &queue)
+{
+	size_t head = queue.head.load(std::memory_order_relaxed);
+	if (head == queue.tail.load(std::memory_order_acquire))
+		return nullptr;
+	return &queue.writes[head & (queue.writes.size() - 1)];
+}
+
+void regqueue_pop(regqueue_t &queue)
+{
+	queue.head.store(queue.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
@@ -0,0 +1,38 @@
+#ifndef OPERATIC_REGQUEUE_H
+#define OPERATIC_REGQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// A lock free queue of register writes from one producer thread to one
+// consumer thread, typically whoever generates audio. Every write carries the
+// time it was made in whatever clock the two sides agree on, so the consumer
+// can place it at the right sample instead of at the start of its next block.
+
+struct regqueue_write_t
+{
+	uint64_t time;
+	uint16_t reg;     // full register address
+	uint8_t val;
+	uint8_t mask;     // bits of val to write, the others keep their last value
+};
+
+struct regqueue_t
+{
+	std::vector<regqueue_write_t> writes;  // a power of two long
+	alignas(64) std::atomic<size_t> head;  // next write to pop, moved by the consumer
+	alignas(64) std::atomic<size_t> tail;  // next free slot, moved by the producer
+};
+
+// capacity is rounded up to a power of two
+void regqueue_init(regqueue_t &queue, size_t capacity);
+// false when the queue is full
+bool regqueue_push(regqueue_t &queue, uint64_t time, uint16_t reg, uint8_t val, uint8_t mask = 0xff);
+// The oldest write, nullptr when the queue is empty. It stays valid until
+// regqueue_pop
+const regqueue_write_t * regqueue_peek(regqueue_t &queue);
+void regqueue_pop(regqueue_t &queue);
+
+#endif
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "regtrace.h"
+
+static const size_t kTraceHeaderSize = 28;
+static const size_t kTraceImageSize = 512 / 8 + 512;
+static const size_t kTraceRecordSize = 8;
+static const Bitu kReplayFrames = 512;
+
+static uint16_t read_le16(const uint8_t * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t * p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t * p)
+{
+	return read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+static void write_le16(uint8_t * p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void write_le32(uint8_t * p, uint32_t v)
+{
+	write_le16(p, v & 0xffff);
+	write_le16(p + 2, v >> 16);
+}
+
+static void write_le64(uint8_t * p, uint64_t v)
+{
+	write_le32(p, v & 0xffffffff);
+	write_le32(p + 4, v >> 32);
+}
+
+static void trace_hook(void * data, Bit64u sample, Bit32u reg, Bit8u val)
+{
+	regtrace_write(*(regtrace_t*)data, sample, reg, val);
+}
+
+void regtrace_init(regtrace_t &trace, size_t capacity, uint32_t rate)
+{
+	trace.records.assign(capacity > 0 ? capacity : 1, regtrace_record_t{});
+	trace.head = 0;
+	trace.count = 0;
+	trace.start = 0;
+	trace.last = 0;
+	trace.rate = rate;
+	memset(trace.image, 0, sizeof(trace.image));
+	memset(trace.image_valid, 0, sizeof(trace.image_valid));
+}
+
+void regtrace_attach(regtrace_t &trace, DBOPL::Handler &synth)
+{
+	if (trace.count == 0)
+		trace.start = trace.last = synth.sampleClock;
+	synth.traceHandler = trace_hook;
+	synth.traceData = &trace;
+}
+
+void regtrace_detach(DBOPL::Handler &synth)
+{
+	synth.traceHandler = nullptr;
+	synth.traceData = nullptr;
+}
+
+// The oldest record goes into the register image when the ring is full
+static void push_record(regtrace_t &trace, const regtrace_record_t &record)
+{
+	size_t capacity = trace.records.size();
+	if (trace.count < capacity) {
+		trace.records[(trace.head + trace.count) % capacity] = record;
+		trace.count++;
+		return;
+	}
+	const regtrace_record_t &old = trace.records[trace.head];
+	trace.start += old.delta;
+	if (old.reg != kTraceWait) {
+		trace.image[old.reg & 0x1ff] = old.val;
+		trace.image_valid[(old.reg & 0x1ff) / 8] |= 1 << (old.reg & 7);
+	}
+	trace.records[trace.head] = record;
+	trace.head = (trace.head + 1) % capacity;
+}
+
+void regtrace_write(regtrace_t &trace, uint64_t sample, uint16_t reg, uint8_t val)
+{
+	uint64_t delta = sample - trace.last;
+	while (delta > 0xffffffff) {
+		push_record(trace, { 0xffffffff, kTraceWait, 0, 0 });
+		delta -= 0xffffffff;
+	}
+	push_record(trace, { (uint32_t)delta, reg, val, 0 });
+	trace.last = sample;
+}
+
+int regtrace_save(const regtrace_t &trace, const char * path, uint64_t end)
+{
+	std::vector<uint8_t> data(kTraceHeaderSize + kTraceImageSize + trace.count * kTraceRecordSize);
+	uint8_t * p = data.data();
+	memcpy(p, kTraceMagic, 8);
+	write_le16(p + 8, kTraceVersion);
+	write_le32(p + 12, trace.rate);
+	write_le64(p + 16, end > trace.last ? end - trace.start : trace.last - trace.start);
+	write_le32(p + 24, trace.count);
+	memcpy(p + kTraceHeaderSize, trace.image_valid, sizeof(trace.image_valid));
+	memcpy(p + kTraceHeaderSize + sizeof(trace.image_valid), trace.image, sizeof(trace.image));
+	p += kTraceHeaderSize + kTraceImageSize;
+	for (size_t i = 0; i < trace.count; i++, p += kTraceRecordSize) {
+		const regtrace_record_t &r = trace.records[(trace.head + i) % trace.records.size()];
+		write_le32(p, r.delta);
+		write_le16(p + 4, r.reg);
+		p[6] = r.val;
+		p[7] = 0;
+	}
+	FILE * f = fopen(path, "wb");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not create %s\n", path);
+		return -1;
+	}
+	size_t written = fwrite(data.data(), 1, data.size(), f);
+	if (fclose(f) != 0 || written != data.size()) {
+		fprintf(stderr, "Could not write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+// Mode and waveform enables go first and the key-on registers last, so the
+// image starts the notes that were playing with their instruments in place
+static int image_order(uint16_t reg)
+{
+	if (reg == 0x105)
+		return 0;
+	if (reg == 0x104 || reg == 0x01)
+		return 1;
+	uint8_t low = reg & 0xff;
+	if ((low >= 0xb0 && low <= 0xb8) || reg == 0xbd)
+		return 3;
+	return 2;
+}
+
+int regtrace_load(const char * path, regtrace_log_t &log)
+{
+	log.events.clear();
+	log.length = 0;
+	log.rate = 0;
+	FILE * f = fopen(path, "rb");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	uint8_t header[kTraceHeaderSize + kTraceImageSize];
+	if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+		memcmp(header, kTraceMagic, 8) != 0 || read_le16(header + 8) != kTraceVersion) {
+		fprintf(stderr, "%s is not a register trace\n", path);
+		fclose(f);
+		return -1;
+	}
+	log.rate = read_le32(header + 12);
+	log.length = read_le64(header + 16);
+	uint32_t count = read_le32(header + 24);
+	const uint8_t * valid = header + kTraceHeaderSize;
+	const uint8_t * image = valid + 512 / 8;
+	for (int order = 0; order < 4; order++) {
+		for (uint16_t reg = 0; reg < 512; reg++) {
+			if ((valid[reg / 8] & (1 << (reg & 7))) && image_order(reg) == order)
+				log.events.push_back({ 0, reg, image[reg] });
+		}
+	}
+	std::vector<uint8_t> data((size_t)count * kTraceRecordSize);
+	size_t got = data.empty() ? 0 : fread(data.data(), 1, data.size(), f);
+	fclose(f);
+	if (got != data.size() || log.rate == 0) {
+		fprintf(stderr, "%s: truncated register trace\n", path);
+		return -1;
+	}
+	uint64_t sample = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		const uint8_t * p = data.data() + i * kTraceRecordSize;
+		sample += read_le32(p);
+		uint16_t reg = read_le16(p + 4);
+		if (reg != kTraceWait)
+			log.events.push_back({ sample, reg, p[6] });
+	}
+	if (log.length < sample)
+		log.length = sample;
+	return 0;
+}
+
+void regtrace_replay(const regtrace_log_t &log, DBOPL::Handler &synth, std::vector<Bit32s> &buffer)
+{
+	buffer.resize(kReplayFrames * 2);
+	const regtrace_event_t * events = log.events.data();
+	size_t count = log.events.size();
+	size_t next = 0;
+	uint64_t done = 0;
+	while (done < log.length) {
+		while (next < count && events[next].sample <= done) {
+			synth.WriteReg(events[next].reg, events[next].val);
+			next++;
+		}
+		uint64_t until = next < count && events[next].sample < log.length ? events[next].sample : log.length;
+		Bitu frames = until - done < kReplayFrames ? until - done : kReplayFrames;
+		synth.Generate(buffer.data(), frames);
+		done += frames;
+	}
+}
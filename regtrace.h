@@ -0,0 +1,74 @@
+#ifndef OPERATIC_REGTRACE_H
+#define OPERATIC_REGTRACE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "dbopl.h"
+
+// Register traces: every register write made through a DBOPL::Handler with
+// the output sample it landed on, recorded into a fixed size ring of 8 byte
+// records so tracing can stay on for a whole session. Writes that fall out
+// of the ring are folded into a register image, so a saved trace always
+// starts from the full chip state.
+//
+// Recording runs inside Handler::WriteReg; whoever locks the handler also
+// protects the trace attached to it.
+
+static const char kTraceMagic[8] = { 'O', 'P', 'L', 'T', 'R', 'A', 'C', 'E' };
+static const uint16_t kTraceVersion = 1;
+
+// Writes more than 2^32 samples apart are separated by records with this reg
+static const uint16_t kTraceWait = 0xffff;
+
+struct regtrace_record_t
+{
+	uint32_t delta;   // samples since the previous record
+	uint16_t reg;     // full register address, kTraceWait for a pause
+	uint8_t val;
+	uint8_t pad;
+};
+
+struct regtrace_t
+{
+	std::vector<regtrace_record_t> records;
+	size_t head;      // oldest record
+	size_t count;
+	uint64_t start;   // sample the oldest record counts from
+	uint64_t last;    // sample of the newest record
+	uint32_t rate;
+	// Registers written before the oldest record
+	uint8_t image[512];
+	uint8_t image_valid[512 / 8];
+};
+
+struct regtrace_event_t
+{
+	uint64_t sample;
+	uint16_t reg;
+	uint8_t val;
+};
+
+// A saved trace expanded to absolute sample times, the register image first
+struct regtrace_log_t
+{
+	std::vector<regtrace_event_t> events;
+	uint64_t length;  // samples, at least the time of the last event
+	uint32_t rate;
+};
+
+void regtrace_init(regtrace_t &trace, size_t capacity, uint32_t rate);
+// Record every register write of synth from now on, call after Handler::Init
+void regtrace_attach(regtrace_t &trace, DBOPL::Handler &synth);
+void regtrace_detach(DBOPL::Handler &synth);
+void regtrace_write(regtrace_t &trace, uint64_t sample, uint16_t reg, uint8_t val);
+
+// Write the ring to path, end is the sample clock the trace should last until
+int regtrace_save(const regtrace_t &trace, const char * path, uint64_t end);
+int regtrace_load(const char * path, regtrace_log_t &log);
+
+// Play log back on synth, which must be freshly initialised at log.rate,
+// generating into buffer
+void regtrace_replay(const regtrace_log_t &log, DBOPL::Handler &synth, std::vector<Bit32s> &buffer);
+
+#endif
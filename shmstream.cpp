@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
+
+#include "oplutil.h"
+#include "shmstream.h"
+
+static const size_t kHeaderSize = 384;
+static const size_t kApplyBatch = 256;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the counters are shared between processes");
+static_assert(sizeof(shmstream_header_t) == kHeaderSize, "documented header layout");
+static_assert(offsetof(shmstream_header_t, write_tail) == 64, "documented header layout");
+static_assert(offsetof(shmstream_header_t, write_head) == 128, "documented header layout");
+static_assert(offsetof(shmstream_header_t, clock) == 192, "documented header layout");
+static_assert(offsetof(shmstream_header_t, pcm_tail) == 256, "documented header layout");
+static_assert(offsetof(shmstream_header_t, pcm_head) == 320, "documented header layout");
+static_assert(sizeof(shmstream_write_t) == 16, "documented write layout");
+
+static size_t power_of_two(size_t n)
+{
+	size_t size = 1;
+	while (size < n)
+		size <<= 1;
+	return size;
+}
+
+static int map(shmstream_t &stream, int fd, size_t size)
+{
+	void * data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s: %s\n", stream.name, strerror(errno));
+		return -1;
+	}
+	stream.size = size;
+	stream.header = (shmstream_header_t *)data;
+	return 0;
+}
+
+static void set_rings(shmstream_t &stream)
+{
+	uint8_t * base = (uint8_t *)stream.header;
+	stream.writes = (shmstream_write_t *)(base + stream.header->write_offset);
+	stream.pcm = stream.header->pcm_capacity ? (int16_t *)(base + stream.header->pcm_offset) : nullptr;
+}
+
+int shmstream_create(shmstream_t &stream, const char * name, uint32_t rate, size_t writes, size_t pcm_frames)
+{
+	snprintf(stream.name, sizeof(stream.name), "%s", name);
+	stream.owner = true;
+	size_t write_capacity = power_of_two(writes);
+	size_t pcm_capacity = pcm_frames ? power_of_two(pcm_frames) : 0;
+	size_t write_offset = kHeaderSize;
+	size_t pcm_offset = write_offset + write_capacity * sizeof(shmstream_write_t);
+	size_t size = pcm_offset + pcm_capacity * 2 * sizeof(int16_t);
+
+	// Whoever had the name before is gone or about to be cut off
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create shared memory %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, size) != 0) {
+		fprintf(stderr, "Could not size shared memory %s: %s\n", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	int ret = map(stream, fd, size);
+	close(fd);
+	if (ret != 0) {
+		shm_unlink(name);
+		return -1;
+	}
+
+	shmstream_header_t * header = new (stream.header) shmstream_header_t();
+	header->version = kShmVersion;
+	header->rate = rate;
+	header->write_capacity = write_capacity;
+	header->pcm_capacity = pcm_capacity;
+	header->pcm_channels = 2;
+	header->consumer_pid = getpid();
+	header->write_offset = write_offset;
+	header->pcm_offset = pcm_offset;
+	header->write_tail.store(0, std::memory_order_relaxed);
+	header->write_head.store(0, std::memory_order_relaxed);
+	header->clock.store(0, std::memory_order_relaxed);
+	header->pcm_tail.store(0, std::memory_order_relaxed);
+	header->pcm_head.store(0, std::memory_order_relaxed);
+	set_rings(stream);
+	// The magic goes last, a producer attaching early sees no stream yet
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(header->magic, kShmMagic, 8);
+	return 0;
+}
+
+int shmstream_attach(shmstream_t &stream, const char * name)
+{
+	snprintf(stream.name, sizeof(stream.name), "%s", name);
+	stream.owner = false;
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open shared memory %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < kHeaderSize) {
+		fprintf(stderr, "%s is not a register stream\n", name);
+		close(fd);
+		return -1;
+	}
+	int ret = map(stream, fd, st.st_size);
+	close(fd);
+	if (ret != 0)
+		return -1;
+
+	const shmstream_header_t * h = stream.header;
+	bool valid = memcmp(h->magic, kShmMagic, 8) == 0 && h->version == kShmVersion &&
+		h->write_capacity != 0 && (h->write_capacity & (h->write_capacity - 1)) == 0 &&
+		(h->pcm_capacity & (h->pcm_capacity - 1)) == 0 && h->pcm_channels == 2 &&
+		h->write_offset >= kHeaderSize &&
+		h->write_offset + (uint64_t)h->write_capacity * sizeof(shmstream_write_t) <= stream.size &&
+		h->pcm_offset + (uint64_t)h->pcm_capacity * 4 <= stream.size;
+	if (!valid) {
+		fprintf(stderr, "%s is not a register stream of version %u\n", name, kShmVersion);
+		munmap(stream.header, stream.size);
+		stream.header = nullptr;
+		return -1;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	set_rings(stream);
+	return 0;
+}
+
+void shmstream_close(shmstream_t &stream)
+{
+	if (stream.header == nullptr)
+		return;
+	munmap(stream.header, stream.size);
+	stream.header = nullptr;
+	if (stream.owner)
+		shm_unlink(stream.name);
+}
+
+bool shmstream_push(shmstream_t &stream, uint64_t time, uint16_t reg, uint8_t val)
+{
+	shmstream_header_t * h = stream.header;
+	uint64_t tail = h->write_tail.load(std::memory_order_relaxed);
+	if (tail - h->write_head.load(std::memory_order_acquire) == h->write_capacity)
+		return false;
+	shmstream_write_t &w = stream.writes[tail & (h->write_capacity - 1)];
+	w.time = time;
+	w.reg = reg;
+	w.val = val;
+	h->write_tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+uint64_t shmstream_clock(const shmstream_t &stream)
+{
+	return stream.header->clock.load(std::memory_order_acquire);
+}
+
+const int16_t * shmstream_pcm_peek(shmstream_t &stream, size_t &frames)
+{
+	shmstream_header_t * h = stream.header;
+	uint64_t head = h->pcm_head.load(std::memory_order_relaxed);
+	size_t fill = h->pcm_tail.load(std::memory_order_acquire) - head;
+	size_t start = h->pcm_capacity ? head & (h->pcm_capacity - 1) : 0;
+	if (frames > fill)
+		frames = fill;
+	if (frames > h->pcm_capacity - start)
+		frames = h->pcm_capacity - start;
+	return stream.pcm + start * 2;
+}
+
+void shmstream_pcm_release(shmstream_t &stream, size_t frames)
+{
+	shmstream_header_t * h = stream.header;
+	h->pcm_head.store(h->pcm_head.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+}
+
+// The producer's counters are not trusted: a broken or crashed producer can
+// leave anything there. The consumer never walks more than one ring of
+// writes past head, nor takes a tail behind head for a full ring
+static uint64_t write_tail(const shmstream_header_t * h, uint64_t head)
+{
+	uint64_t pending = h->write_tail.load(std::memory_order_acquire) - head;
+	if ((int64_t)pending < 0)
+		return head;
+	return head + (pending > h->write_capacity ? h->write_capacity : pending);
+}
+
+const shmstream_write_t * shmstream_peek(shmstream_t &stream)
+{
+	shmstream_header_t * h = stream.header;
+	uint64_t head = h->write_head.load(std::memory_order_relaxed);
+	if (head == write_tail(h, head))
+		return nullptr;
+	return &stream.writes[head & (h->write_capacity - 1)];
+}
+
+void shmstream_pop(shmstream_t &stream)
+{
+	shmstream_header_t * h = stream.header;
+	h->write_head.store(h->write_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void shmstream_advance(shmstream_t &stream, size_t frames)
+{
+	shmstream_header_t * h = stream.header;
+	h->clock.store(h->clock.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+}
+
+int16_t * shmstream_pcm_reserve(shmstream_t &stream, size_t &frames)
+{
+	shmstream_header_t * h = stream.header;
+	uint64_t tail = h->pcm_tail.load(std::memory_order_relaxed);
+	// The producer's read count, like its write count, is kept within a ring
+	uint64_t used = tail - h->pcm_head.load(std::memory_order_acquire);
+	if ((int64_t)used < 0)
+		used = 0;
+	if (used > h->pcm_capacity)
+		used = h->pcm_capacity;
+	size_t space = h->pcm_capacity - used;
+	size_t start = h->pcm_capacity ? tail & (h->pcm_capacity - 1) : 0;
+	if (frames > space)
+		frames = space;
+	if (frames > h->pcm_capacity - start)
+		frames = h->pcm_capacity - start;
+	return stream.pcm + start * 2;
+}
+
+void shmstream_pcm_commit(shmstream_t &stream, size_t frames)
+{
+	shmstream_header_t * h = stream.header;
+	h->pcm_tail.store(h->pcm_tail.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+}
+
+void shmstream_generate(shmstream_t &stream, DBOPL::Handler &synth, int16_t * pcm, size_t frames, Bit32s * scratch)
+{
+	shmstream_header_t * h = stream.header;
+	uint64_t clock = h->clock.load(std::memory_order_relaxed);
+	uint64_t head = h->write_head.load(std::memory_order_relaxed);
+	uint64_t mask = h->write_capacity - 1;
+	DBOPL::RegWrite batch[kApplyBatch];
+	size_t done = 0;
+	while (done < frames) {
+		// Writes pushed while the block is under way still make it in
+		uint64_t tail = write_tail(h, head);
+		size_t count = 0;
+		for (; head != tail && count < kApplyBatch && stream.writes[head & mask].time <= clock + done; head++) {
+			const shmstream_write_t &w = stream.writes[head & mask];
+			batch[count].reg = w.reg & 0x1ff;
+			batch[count].val = w.val;
+			count++;
+		}
+		if (count > 0) {
+			synth.WriteRegs(batch, count);
+			if (count == kApplyBatch)
+				continue;
+		}
+		size_t until = frames;
+		if (head != tail && stream.writes[head & mask].time < clock + frames)
+			until = stream.writes[head & mask].time - clock;
+		size_t todo = until - done;
+		synth.Generate(scratch, todo);
+		int16_t * out = pcm + done * 2;
+		if (synth.chip.opl3Active) {
+			for (size_t i = 0; i < todo * 2; i++)
+				out[i] = opl_clip(scratch[i]);
+		} else {
+			for (size_t i = 0; i < todo; i++)
+				out[i * 2] = out[i * 2 + 1] = opl_clip(scratch[i]);
+		}
+		done = until;
+	}
+	h->write_head.store(head, std::memory_order_release);
+	h->clock.store(clock + frames, std::memory_order_release);
+}
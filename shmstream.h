@@ -0,0 +1,118 @@
+#ifndef OPERATIC_SHMSTREAM_H
+#define OPERATIC_SHMSTREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include "dbopl.h"
+
+// Register streams over POSIX shared memory, for feeding the emulator from
+// another process without a system call per write. The consumer (operatic
+// or opld) creates the segment; one producer process attaches to it, puts
+// timed register writes into a ring and, when the segment has one, takes
+// the rendered audio out of a second ring. Both rings are single producer,
+// single consumer and lock free, and both sides work in place in the
+// shared memory.
+//
+// Layout, all integers little endian as on every host this runs on:
+//
+//   0    shmstream_header_t, 384 bytes
+//          0  magic "OPLSTRM\0"
+//          8  uint32 version, kShmVersion
+//         12  uint32 rate, frames per second of the clock and the audio
+//         16  uint32 write capacity in entries, a power of two
+//         20  uint32 audio capacity in frames, a power of two, 0 for none
+//         24  uint32 audio channels, 2
+//         28  uint32 pid of the consumer
+//         32  uint64 byte offset of the write ring
+//         40  uint64 byte offset of the audio ring
+//         64  uint64 writes pushed, only moved by the producer
+//        128  uint64 writes taken, only moved by the consumer
+//        192  uint64 clock, frames generated so far, only moved by the consumer
+//        256  uint64 audio frames written, only moved by the consumer
+//        320  uint64 audio frames read, only moved by the producer
+//   384  write ring, entries of 16 bytes:
+//          0  uint64 frame on the clock to write at, earlier ones are
+//             written at the start of the next block
+//          8  uint16 register, 0x100 set for the second bank
+//         10  uint8 value
+//   then the audio ring, interleaved 16 bit stereo frames
+//
+// The counters only grow; an entry or frame lives at its count modulo the
+// capacity. A side publishes its counter with a release store after it
+// wrote the data and reads the other side's with an acquire load.
+// The consumer keeps the producer's counters within one ring of its own,
+// so a broken producer can at worst replay one ring of writes.
+
+static const char kShmMagic[8] = { 'O', 'P', 'L', 'S', 'T', 'R', 'M', 0 };
+static const uint32_t kShmVersion = 1;
+static const char * const kShmDefaultName = "/operatic";
+
+struct shmstream_header_t
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t rate;
+	uint32_t write_capacity;
+	uint32_t pcm_capacity;
+	uint32_t pcm_channels;
+	uint32_t consumer_pid;
+	uint64_t write_offset;
+	uint64_t pcm_offset;
+	alignas(64) std::atomic<uint64_t> write_tail;
+	alignas(64) std::atomic<uint64_t> write_head;
+	alignas(64) std::atomic<uint64_t> clock;
+	alignas(64) std::atomic<uint64_t> pcm_tail;
+	alignas(64) std::atomic<uint64_t> pcm_head;
+};
+
+struct shmstream_write_t
+{
+	uint64_t time;
+	uint16_t reg;
+	uint8_t val;
+	uint8_t pad[5];
+};
+
+struct shmstream_t
+{
+	shmstream_header_t * header;
+	shmstream_write_t * writes;
+	int16_t * pcm;
+	size_t size;       // bytes mapped
+	char name[64];
+	bool owner;        // created the segment and unlinks it on close
+};
+
+// Consumer side: create name, replacing a stale segment of that name, with
+// room for writes entries and pcm_frames frames of audio, 0 for none
+int shmstream_create(shmstream_t &stream, const char * name, uint32_t rate, size_t writes, size_t pcm_frames);
+// Producer side: attach to the segment a consumer created
+int shmstream_attach(shmstream_t &stream, const char * name);
+void shmstream_close(shmstream_t &stream);
+
+// Producer: queue a write for frame time, false when the ring is full
+bool shmstream_push(shmstream_t &stream, uint64_t time, uint16_t reg, uint8_t val);
+// Producer: the frame the consumer generates next
+uint64_t shmstream_clock(const shmstream_t &stream);
+// Producer: rendered audio waiting to be read, up to frames in one piece,
+// which stays valid until shmstream_pcm_release
+const int16_t * shmstream_pcm_peek(shmstream_t &stream, size_t &frames);
+void shmstream_pcm_release(shmstream_t &stream, size_t frames);
+
+// Consumer: the oldest queued write, nullptr when there is none. It stays
+// valid until shmstream_pop. For consumers that generate the block
+// themselves and place each write at time - shmstream_clock
+const shmstream_write_t * shmstream_peek(shmstream_t &stream);
+void shmstream_pop(shmstream_t &stream);
+// Consumer: move the clock on by the frames just generated
+void shmstream_advance(shmstream_t &stream, size_t frames);
+// Consumer: room for up to frames of audio in one piece
+int16_t * shmstream_pcm_reserve(shmstream_t &stream, size_t &frames);
+void shmstream_pcm_commit(shmstream_t &stream, size_t frames);
+// Consumer: generate frames into pcm as 16 bit stereo with every write at
+// its own frame, and move the clock on. scratch needs room for frames * 2
+void shmstream_generate(shmstream_t &stream, DBOPL::Handler &synth, int16_t * pcm, size_t frames, Bit32s * scratch);
+
+#endif
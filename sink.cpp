@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sink.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define SINK_URING 1
+#endif
+#endif
+
+static const size_t kPageSize = 4096;
+static const size_t kWavHeaderSize = 80;
+
+static void write_le16(uint8_t * p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void write_le32(uint8_t * p, uint32_t v)
+{
+	write_le16(p, v & 0xffff);
+	write_le16(p + 2, v >> 16);
+}
+
+static void write_le64(uint8_t * p, uint64_t v)
+{
+	write_le32(p, v & 0xffffffff);
+	write_le32(p + 4, v >> 32);
+}
+
+static int pwrite_all(int fd, const uint8_t * data, size_t len, uint64_t offset)
+{
+	while (len > 0) {
+		ssize_t done = pwrite(fd, data, len, offset);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return -1;
+		data += done;
+		len -= done;
+		offset += done;
+	}
+	return 0;
+}
+
+#ifdef SINK_URING
+
+// Just enough io_uring for one write in flight at a time, without liburing
+struct sink_uring_t
+{
+	int fd;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	io_uring_sqe * sqes;
+	io_uring_cqe * cqes;
+	void * sq_ring;
+	size_t sq_size;
+	void * cq_ring;
+	size_t cq_size;
+	size_t sqes_size;
+	// The write in flight
+	const uint8_t * data;
+	size_t len;
+	uint64_t offset;
+};
+
+static void uring_free(sink_uring_t * u)
+{
+	if (u->sqes != nullptr)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != nullptr && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_size);
+	if (u->sq_ring != nullptr)
+		munmap(u->sq_ring, u->sq_size);
+	close(u->fd);
+	delete u;
+}
+
+// nullptr when the kernel has no io_uring or doesn't let us use it
+static sink_uring_t * uring_init()
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, 4, &p);
+	if (fd < 0)
+		return nullptr;
+	sink_uring_t * u = new sink_uring_t{};
+	u->fd = fd;
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single)
+		u->sq_size = u->cq_size = u->sq_size > u->cq_size ? u->sq_size : u->cq_size;
+	u->sq_ring = mmap(nullptr, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = nullptr;
+		uring_free(u);
+		return nullptr;
+	}
+	u->cq_ring = single ? u->sq_ring : mmap(nullptr, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (u->cq_ring == MAP_FAILED) {
+		u->cq_ring = nullptr;
+		uring_free(u);
+		return nullptr;
+	}
+	u->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	u->sqes = (io_uring_sqe*)mmap(nullptr, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = nullptr;
+		uring_free(u);
+		return nullptr;
+	}
+	uint8_t * sq = (uint8_t*)u->sq_ring;
+	uint8_t * cq = (uint8_t*)u->cq_ring;
+	u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->cq_head = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+	return u;
+}
+
+static int uring_submit(sink_uring_t * u, int fd, const uint8_t * data, size_t len, uint64_t offset)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned index = tail & *u->sq_mask;
+	io_uring_sqe * sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = len;
+	sqe->off = offset;
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->data = data;
+	u->len = len;
+	u->offset = offset;
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, nullptr, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret == 1 ? 0 : -1;
+}
+
+// Wait for the write in flight, whatever it left short is written directly
+static int uring_complete(sink_uring_t * u, int fd)
+{
+	for (;;) {
+		unsigned head = *u->cq_head;
+		if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			int res = u->cqes[head & *u->cq_mask].res;
+			__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+			if (res < 0 && res != -EINTR && res != -EAGAIN && res != -EINVAL)
+				return -1;
+			size_t done = res > 0 ? res : 0;
+			return pwrite_all(fd, u->data + done, u->len - done, u->offset + done);
+		}
+		int ret = syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+	}
+}
+
+#else
+
+struct sink_uring_t
+{
+};
+
+static void uring_free(sink_uring_t *)
+{
+}
+
+static sink_uring_t * uring_init()
+{
+	return nullptr;
+}
+
+static int uring_submit(sink_uring_t *, int, const uint8_t *, size_t, uint64_t)
+{
+	return -1;
+}
+
+static int uring_complete(sink_uring_t *, int)
+{
+	return -1;
+}
+
+#endif
+
+// Same size with or without RF64, the ds64 chunk takes the place of a JUNK
+// chunk once the data no longer fits 32 bit sizes
+static void wav_header(uint8_t * h, uint32_t rate, uint16_t channels, uint64_t bytes)
+{
+	uint64_t riff = kWavHeaderSize - 8 + bytes;
+	bool rf64 = riff > 0xffffffffull;
+	memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+	write_le32(h + 4, rf64 ? 0xffffffff : riff);
+	memcpy(h + 8, "WAVE", 4);
+	memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+	write_le32(h + 16, 28);
+	memset(h + 20, 0, 28);
+	if (rf64) {
+		write_le64(h + 20, riff);
+		write_le64(h + 28, bytes);
+		write_le64(h + 36, bytes / (channels * 2));
+	}
+	memcpy(h + 48, "fmt ", 4);
+	write_le32(h + 52, 16);
+	write_le16(h + 56, 1);              // PCM
+	write_le16(h + 58, channels);
+	write_le32(h + 60, rate);
+	write_le32(h + 64, rate * channels * 2);
+	write_le16(h + 68, channels * 2);   // block align
+	write_le16(h + 70, 16);             // bits
+	memcpy(h + 72, "data", 4);
+	write_le32(h + 76, rf64 ? 0xffffffff : bytes);
+}
+
+// Turn a filled buffer into the bytes that go to disk
+static void prepare_buffer(sink_t &sink, sink_buffer_t &b, const uint8_t * &data, size_t &len)
+{
+	if (sink.format == SINK_FLAC) {
+		b.encoded.clear();
+		flac_encode(sink.flac, b.pcm, b.frames, b.encoded);
+		data = b.encoded.data();
+		len = b.encoded.size();
+		return;
+	}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (size_t i = 0; i < b.frames * sink.channels; i++)
+		b.pcm[i] = (int16_t)__builtin_bswap16((uint16_t)b.pcm[i]);
+#endif
+	data = (const uint8_t*)b.pcm;
+	len = b.frames * sink.channels * 2;
+}
+
+// Back to the render thread, empty
+static void release_buffer(sink_buffer_t &b)
+{
+	b.frames = 0;
+	b.ready = false;
+}
+
+// Buffers are written in the order they are filled. With io_uring the next
+// buffer is encoded while the previous one is still being written.
+static void writer_thread(sink_t * sink)
+{
+	size_t next = 0;
+	int inflight = -1;
+	std::unique_lock<std::mutex> guard(sink->lock);
+	for (;;) {
+		if (inflight >= 0 && !sink->buffers[next].ready) {
+			guard.unlock();
+			int ret = uring_complete(sink->uring, sink->fd);
+			guard.lock();
+			sink->failed |= ret != 0;
+			release_buffer(sink->buffers[inflight]);
+			sink->cond.notify_all();
+			inflight = -1;
+			continue;
+		}
+		sink->cond.wait(guard, [&] { return sink->stop || sink->buffers[next].ready; });
+		if (!sink->buffers[next].ready)
+			break;
+		sink_buffer_t &b = sink->buffers[next];
+		guard.unlock();
+		const uint8_t * data;
+		size_t len;
+		prepare_buffer(*sink, b, data, len);
+		int ret = 0;
+		if (inflight >= 0)
+			ret = uring_complete(sink->uring, sink->fd);
+		uint64_t offset = sink->offset;
+		sink->offset += len;
+		bool queued = sink->uring != nullptr && uring_submit(sink->uring, sink->fd, data, len, offset) == 0;
+		if (!queued)
+			ret |= pwrite_all(sink->fd, data, len, offset);
+		guard.lock();
+		sink->failed |= ret != 0;
+		if (inflight >= 0)
+			release_buffer(sink->buffers[inflight]);
+		if (!queued)
+			release_buffer(b);
+		inflight = queued ? (int)next : -1;
+		sink->cond.notify_all();
+		next ^= 1;
+	}
+}
+
+int sink_init(sink_t &sink, size_t buffer_frames)
+{
+	sink.buffer_frames = (buffer_frames + kFlacBlockSize - 1) / kFlacBlockSize * kFlacBlockSize;
+	if (sink.buffer_frames == 0)
+		sink.buffer_frames = kFlacBlockSize;
+	size_t bytes = (sink.buffer_frames * 2 * sizeof(int16_t) + kPageSize - 1) / kPageSize * kPageSize;
+	for (sink_buffer_t &b : sink.buffers) {
+		b.pcm = (int16_t*)aligned_alloc(kPageSize, bytes);
+		b.frames = 0;
+		b.ready = false;
+		if (b.pcm == nullptr) {
+			fprintf(stderr, "Could not allocate sink buffers\n");
+			return -1;
+		}
+	}
+	sink.stop = false;
+	sink.fd = -1;
+	sink.failed = false;
+	sink.current = 0;
+	sink.uring = uring_init();
+	sink.thread = std::thread(writer_thread, &sink);
+	return 0;
+}
+
+void sink_free(sink_t &sink)
+{
+	{
+		std::lock_guard<std::mutex> guard(sink.lock);
+		sink.stop = true;
+		sink.cond.notify_all();
+	}
+	if (sink.thread.joinable())
+		sink.thread.join();
+	if (sink.uring != nullptr)
+		uring_free(sink.uring);
+	sink.uring = nullptr;
+	for (sink_buffer_t &b : sink.buffers) {
+		free(b.pcm);
+		b.pcm = nullptr;
+	}
+}
+
+int sink_open(sink_t &sink, const char * path, sink_format_t format, uint32_t rate, uint16_t channels)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create %s\n", path);
+		return -1;
+	}
+	std::lock_guard<std::mutex> guard(sink.lock);
+	sink.fd = fd;
+	sink.format = format;
+	sink.rate = rate;
+	sink.channels = channels;
+	sink.data_bytes = 0;
+	sink.failed = false;
+	sink.buffers[sink.current].frames = 0;
+	// The header goes in last, once the sizes are known
+	sink.offset = format == SINK_FLAC ? kFlacHeaderSize : kWavHeaderSize;
+	flac_init(sink.flac, rate, channels);
+	return 0;
+}
+
+int16_t * sink_reserve(sink_t &sink, size_t &frames)
+{
+	sink_buffer_t &b = sink.buffers[sink.current];
+	{
+		std::unique_lock<std::mutex> guard(sink.lock);
+		sink.cond.wait(guard, [&] { return !b.ready; });
+	}
+	size_t room = sink.buffer_frames - b.frames;
+	if (frames > room)
+		frames = room;
+	return b.pcm + b.frames * sink.channels;
+}
+
+static void hand_over(sink_t &sink)
+{
+	sink_buffer_t &b = sink.buffers[sink.current];
+	sink.data_bytes += b.frames * sink.channels * 2;
+	std::lock_guard<std::mutex> guard(sink.lock);
+	b.ready = true;
+	sink.cond.notify_all();
+	sink.current ^= 1;
+}
+
+void sink_commit(sink_t &sink, size_t frames)
+{
+	sink_buffer_t &b = sink.buffers[sink.current];
+	b.frames += frames;
+	if (b.frames == sink.buffer_frames)
+		hand_over(sink);
+}
+
+int sink_close(sink_t &sink)
+{
+	bool partial;
+	{
+		std::lock_guard<std::mutex> guard(sink.lock);
+		partial = !sink.buffers[sink.current].ready && sink.buffers[sink.current].frames > 0;
+	}
+	if (partial)
+		hand_over(sink);
+	std::unique_lock<std::mutex> guard(sink.lock);
+	sink.cond.wait(guard, [&] { return !sink.buffers[0].ready && !sink.buffers[1].ready; });
+	uint8_t header[kWavHeaderSize];
+	size_t size;
+	if (sink.format == SINK_FLAC) {
+		flac_header(sink.flac, header);
+		size = kFlacHeaderSize;
+	} else {
+		wav_header(header, sink.rate, sink.channels, sink.data_bytes);
+		size = kWavHeaderSize;
+	}
+	int ret = sink.failed ? -1 : 0;
+	ret |= pwrite_all(sink.fd, header, size, 0);
+	if (close(sink.fd) != 0)
+		ret = -1;
+	sink.fd = -1;
+	return ret;
+}
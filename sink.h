@@ -0,0 +1,73 @@
+#ifndef OPERATIC_SINK_H
+#define OPERATIC_SINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "flac.h"
+
+// Output sinks stream 16 bit PCM to WAV files (RIFF, RF64 past 4 GB) or FLAC
+// files from a background writer. The render thread fills one of two page
+// aligned buffers in place while the writer encodes and writes the other,
+// through io_uring where the kernel allows it and pwrite otherwise. The
+// render thread only waits when the disk falls a whole buffer behind, never
+// on a write itself.
+//
+// A sink is set up once and then writes any number of files one after the
+// other. Only one thread may render into it.
+
+enum sink_format_t
+{
+	SINK_WAV,
+	SINK_FLAC,
+};
+
+struct sink_uring_t;
+
+struct sink_buffer_t
+{
+	int16_t * pcm;
+	size_t frames;
+	bool ready;       // handed to the writer, not written yet
+	std::vector<uint8_t> encoded;
+};
+
+struct sink_t
+{
+	size_t buffer_frames;
+	sink_buffer_t buffers[2];
+	std::mutex lock;
+	std::condition_variable cond;
+	std::thread thread;
+	bool stop;
+	sink_uring_t * uring;
+
+	// The file being written
+	int fd;
+	sink_format_t format;
+	uint32_t rate;
+	uint16_t channels;
+	uint64_t offset;  // next write, owned by the writer
+	uint64_t data_bytes;
+	flac_info_t flac;
+	bool failed;
+	size_t current;   // buffer the render thread fills
+};
+
+// buffer_frames is rounded up to whole FLAC blocks
+int sink_init(sink_t &sink, size_t buffer_frames);
+void sink_free(sink_t &sink);
+
+int sink_open(sink_t &sink, const char * path, sink_format_t format, uint32_t rate, uint16_t channels);
+// Room for up to frames frames of interleaved samples, frames is lowered to
+// what fits in the current buffer
+int16_t * sink_reserve(sink_t &sink, size_t &frames);
+void sink_commit(sink_t &sink, size_t frames);
+// Write what is left, finish the header and close the file
+int sink_close(sink_t &sink);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+
+#include "timeline.h"
+
+std::atomic<bool> timeline_enabled(false);
+
+static std::mutex threads_lock;
+static timeline_thread_t * threads = nullptr;
+static uint32_t thread_count = 0;
+static size_t ring_size = 0;
+// Bumped by timeline_free so threads drop their stale ring pointer
+static std::atomic<uint32_t> generation(0);
+static std::chrono::steady_clock::time_point origin;
+
+static thread_local timeline_thread_t * current = nullptr;
+static thread_local uint32_t current_generation = 0;
+
+// Only the first event of a thread in every generation takes the lock
+static timeline_thread_t * thread_ring()
+{
+	uint32_t gen = generation.load(std::memory_order_acquire);
+	if (current != nullptr && current_generation == gen)
+		return current;
+	std::lock_guard<std::mutex> guard(threads_lock);
+	timeline_thread_t * t = new timeline_thread_t();
+	t->ring = std::vector<timeline_slot_t>(ring_size);
+	t->written.store(0, std::memory_order_relaxed);
+	t->claimed.store(0, std::memory_order_relaxed);
+	t->id = ++thread_count;
+	snprintf(t->name, sizeof(t->name), "thread %u", t->id);
+	t->named = false;
+	t->next = threads;
+	threads = t;
+	current = t;
+	current_generation = gen;
+	return t;
+}
+
+void timeline_init(size_t events)
+{
+	std::lock_guard<std::mutex> guard(threads_lock);
+	ring_size = events > 0 ? events : 1;
+	origin = std::chrono::steady_clock::now();
+	timeline_enabled.store(true, std::memory_order_release);
+}
+
+void timeline_free()
+{
+	timeline_enabled.store(false, std::memory_order_release);
+	std::lock_guard<std::mutex> guard(threads_lock);
+	generation.fetch_add(1, std::memory_order_acq_rel);
+	while (threads != nullptr) {
+		timeline_thread_t * next = threads->next;
+		delete threads;
+		threads = next;
+	}
+	thread_count = 0;
+}
+
+void timeline_thread_name(const char * name)
+{
+	if (!timeline_enabled.load(std::memory_order_relaxed))
+		return;
+	timeline_thread_t * t = thread_ring();
+	if (t->named)
+		return;
+	std::lock_guard<std::mutex> guard(threads_lock);
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	t->named = true;
+}
+
+uint64_t timeline_now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void timeline_record(const char * name, uint64_t start, uint64_t end)
+{
+	// A scope that was open across timeline_free
+	if (!timeline_enabled.load(std::memory_order_relaxed))
+		return;
+	timeline_thread_t * t = thread_ring();
+	uint64_t index = t->written.load(std::memory_order_relaxed);
+	// Claim the slot before touching it, an export that copies any of the
+	// new values is then sure to see the claim
+	t->claimed.store(index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	timeline_slot_t &slot = t->ring[index % t->ring.size()];
+	slot.name.store(name, std::memory_order_relaxed);
+	slot.start.store(start, std::memory_order_relaxed);
+	slot.duration.store(end - start, std::memory_order_relaxed);
+	t->written.store(index + 1, std::memory_order_release);
+}
+
+// Chrome trace timestamps are in microseconds
+static void write_us(FILE * f, const char * key, uint64_t ns)
+{
+	fprintf(f, "\"%s\":%llu.%03u", key, (unsigned long long)(ns / 1000), (unsigned)(ns % 1000));
+}
+
+int timeline_export(const char * path)
+{
+	FILE * f = fopen(path, "w");
+	if (f == nullptr) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	bool first = true;
+	std::vector<timeline_event_t> events;
+	std::lock_guard<std::mutex> guard(threads_lock);
+	for (timeline_thread_t * t = threads; t != nullptr; t = t->next) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", t->id, t->name);
+		first = false;
+
+		// Copy the ring, then drop what the thread overwrote meanwhile, the
+		// slot it may be writing into right now included
+		size_t size = t->ring.size();
+		uint64_t written = t->written.load(std::memory_order_acquire);
+		uint64_t begin = written > size ? written - size : 0;
+		events.clear();
+		for (uint64_t i = begin; i < written; i++) {
+			const timeline_slot_t &slot = t->ring[i % size];
+			events.push_back(timeline_event_t{ slot.name.load(std::memory_order_relaxed),
+				slot.start.load(std::memory_order_relaxed), slot.duration.load(std::memory_order_relaxed) });
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t claimed = t->claimed.load(std::memory_order_relaxed);
+		uint64_t valid = claimed > size ? claimed - size : 0;
+
+		for (uint64_t i = begin < valid ? valid : begin; i < written; i++) {
+			const timeline_event_t &e = events[i - begin];
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,", e.name, t->id);
+			write_us(f, "ts", e.start);
+			fprintf(f, ",");
+			write_us(f, "dur", e.duration);
+			fprintf(f, "}");
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Could not write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
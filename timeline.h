@@ -0,0 +1,79 @@
+#ifndef OPERATIC_TIMELINE_H
+#define OPERATIC_TIMELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// Timeline markers for lining up the UI loop, vsync waits, lock holds and
+// audio callbacks. Every thread records the start and length of its scopes
+// into a ring of its own without taking a lock, and timeline_export writes
+// whatever the rings hold as Chrome trace JSON, which chrome://tracing and
+// ui.perfetto.dev both open.
+//
+// Nothing is recorded before timeline_init, until then a scope costs one
+// atomic load.
+
+struct timeline_event_t
+{
+	const char * name;  // kept by pointer, so a string literal
+	uint64_t start;     // ns since timeline_init
+	uint64_t duration;  // ns
+};
+
+// Ring slots are relaxed atomics so timeline_export can copy them while the
+// thread overwrites them, and then tell which copies it has to drop
+struct timeline_slot_t
+{
+	std::atomic<const char *> name;
+	std::atomic<uint64_t> start;
+	std::atomic<uint64_t> duration;
+};
+
+struct timeline_thread_t
+{
+	std::vector<timeline_slot_t> ring;
+	std::atomic<uint64_t> written;  // events ever recorded, the newest ring.size() are kept
+	std::atomic<uint64_t> claimed;  // written, plus one while a slot is being overwritten
+	uint32_t id;
+	char name[32];
+	bool named;                     // only touched by the thread itself
+	timeline_thread_t * next;
+};
+
+extern std::atomic<bool> timeline_enabled;
+
+// Start recording, keeping the last events scopes of every thread
+void timeline_init(size_t events);
+// Stop recording and drop the rings, no thread may be inside a scope
+void timeline_free();
+// Name the calling thread in the export, only the first name sticks
+void timeline_thread_name(const char * name);
+uint64_t timeline_now();
+void timeline_record(const char * name, uint64_t start, uint64_t end);
+// Can run while other threads keep recording, events they overwrite while
+// the export copies their ring are left out
+int timeline_export(const char * path);
+
+// Records a scope from construction to destruction
+struct timeline_scope_t
+{
+	const char * name;
+	uint64_t start;
+	bool active;
+
+	timeline_scope_t(const char * scope_name)
+		: name(scope_name), start(0), active(timeline_enabled.load(std::memory_order_acquire))
+	{
+		if (active)
+			start = timeline_now();
+	}
+	~timeline_scope_t()
+	{
+		if (active)
+			timeline_record(name, start, timeline_now());
+	}
+};
+
+#endif
@@ -0,0 +1,254 @@
+#include "oplutil.h"
+#include "voices.h"
+
+using namespace DBOPL;
+
+// Offset of the first (modulator) operator of channels 0-8 within a bank
+static const uint8_t kOperatorOffset[9] = {
+	0x00, 0x01, 0x02,
+	0x08, 0x09, 0x0a,
+	0x10, 0x11, 0x12,
+};
+
+// First channel of every 4-op pair, its partner is 3 channels up
+static const uint8_t kFourOpChannels[6] = {
+	0, 1, 2,
+	9, 10, 11,
+};
+
+
+// The chip keeps 4-op pairs next to each other, see ChanOffsetTable in dbopl.cpp
+static Channel * chip_channel(voice_allocator_t &va, uint8_t channel)
+{
+	uint8_t bank = channel / 9;
+	uint8_t index = channel % 9;
+	if (index < 6)
+		index = (index % 3) * 2 + (index / 3);
+	return &va.synth->chip.chan[bank * 9 + index];
+}
+
+static void write_channel_reg(voice_allocator_t &va, uint8_t channel, uint8_t reg, uint8_t val)
+{
+	uint32_t bank = channel / 9;
+	va.synth->WriteReg((bank << 8) | (reg + channel % 9), val);
+}
+
+static void write_operator_reg(voice_allocator_t &va, uint8_t channel, uint8_t op, uint8_t reg, uint8_t val)
+{
+	uint32_t bank = channel / 9;
+	va.synth->WriteReg((bank << 8) | (reg + kOperatorOffset[channel % 9] + op * 3), val);
+}
+
+static const int32_t kEnvelopeMax = 511;
+static const int32_t kVoiceOff = 0x7fffffff;
+
+// An operator stuck at maximum attenuation only leaves RELEASE when its release rate is not 0
+static int32_t operator_attenuation(const Operator * op)
+{
+	if (op->state == Operator::OFF || op->volume >= kEnvelopeMax)
+		return kVoiceOff;
+	return op->totalLevel + op->volume;
+}
+
+// Bit k set when operator k of a voice, counted over both channels of a 4-op
+// pair, reaches the output. The connection bits pick them as Channel::Culled
+static uint8_t voice_carriers(bool four_op, uint8_t first_c0, uint8_t last_c0)
+{
+	if (!four_op)
+		return (first_c0 & 1) ? 0x3 : 0x2;
+	switch ((first_c0 & 1) | ((last_c0 & 1) << 1)) {
+		case 0: return 0x8;  // FM-FM
+		case 1: return 0x9;  // AM-FM
+		case 2: return 0xa;  // FM-AM
+		default: return 0xd; // AM-AM
+	}
+}
+
+// Lowest attenuation of the operators that reach the output, higher is quieter
+static int32_t voice_attenuation(voice_allocator_t &va, const voice_t &voice)
+{
+	Channel * first = chip_channel(va, voice.channel);
+	Channel * last = va.four_op ? first + 1 : first;
+	uint8_t carriers = voice_carriers(va.four_op, first->regC0, last->regC0);
+	int32_t att = kVoiceOff;
+	for (uint8_t k = 0; k < 4; k++) {
+		if (!(carriers & (1 << k)))
+			continue;
+		int32_t op = operator_attenuation(&(k < 2 ? first : last)->op[k & 1]);
+		if (op < att)
+			att = op;
+	}
+	return att;
+}
+
+static bool voice_off(voice_allocator_t &va, const voice_t &voice)
+{
+	return voice_attenuation(va, voice) == kVoiceOff;
+}
+
+static void write_frequency(voice_allocator_t &va, const voice_t &voice, bool keyon)
+{
+	double bend = va.bend[voice.midi_channel] * va.bend_range / 8192.0;
+	uint16_t fnum;
+	uint8_t block;
+	opl_note_frequency(voice.note + bend, fnum, block);
+	write_channel_reg(va, voice.channel, 0xa0, fnum & 0xff);
+	write_channel_reg(va, voice.channel, 0xb0, (keyon ? 0x20 : 0) | (block << 2) | (fnum >> 8));
+}
+
+// Copy the operator and channel registers of the patch channel onto the voice
+static void copy_patch(voice_allocator_t &va, const voice_t &voice, uint8_t velocity)
+{
+	uint8_t pairs = va.four_op ? 2 : 1;
+	Channel * patch = chip_channel(va, va.patch_channel);
+	Channel * patch_last = chip_channel(va, va.patch_channel + (pairs - 1) * 3);
+	uint8_t carriers = voice_carriers(va.four_op, patch->regC0, patch_last->regC0);
+	for (uint8_t p = 0; p < pairs; p++) {
+		uint8_t src = va.patch_channel + p * 3;
+		uint8_t dst = voice.channel + p * 3;
+		Channel * chan = chip_channel(va, src);
+		for (uint8_t op = 0; op < 2; op++) {
+			const Operator * o = &chan->op[op];
+			uint8_t reg40 = o->reg40;
+			// Velocity scales the carriers, the modulators keep the timbre
+			if (carriers & (1 << (p * 2 + op))) {
+				uint8_t tl = (reg40 & 0x3f) + ((127 - velocity) >> 2);
+				reg40 = (reg40 & 0xc0) | (tl > 0x3f ? 0x3f : tl);
+			}
+			write_operator_reg(va, dst, op, 0x20, o->reg20);
+			write_operator_reg(va, dst, op, 0x40, reg40);
+			write_operator_reg(va, dst, op, 0x60, o->reg60);
+			write_operator_reg(va, dst, op, 0x80, o->reg80);
+			write_operator_reg(va, dst, op, 0xe0, o->regE0);
+		}
+		// Route the voice to both speakers when the chip runs in opl3 mode
+		uint8_t c0 = chan->regC0 | (va.synth->chip.opl3Active ? 0x30 : 0);
+		write_channel_reg(va, dst, 0xc0, c0);
+	}
+}
+
+static voice_t * find_voice(voice_allocator_t &va, uint8_t midi_channel, uint8_t note)
+{
+	for (uint8_t i = 0; i < va.count; i++) {
+		voice_t * v = va.voices + i;
+		if (v->held && v->note == note && v->midi_channel == midi_channel)
+			return v;
+	}
+	return nullptr;
+}
+
+// Pick a voice for a new note: a finished voice, then the quietest released
+// one, and only then steal the quietest voice that is still held.
+static voice_t * allocate_voice(voice_allocator_t &va)
+{
+	voice_t * best = nullptr;
+	for (uint8_t i = 0; i < va.count; i++) {
+		voice_t * v = va.voices + i;
+		if (!v->held && voice_off(va, *v) && (!best || v->age < best->age))
+			best = v;
+	}
+	if (best)
+		return best;
+
+	int32_t best_att = -1;
+	for (int held = 0; held < 2 && !best; held++) {
+		for (uint8_t i = 0; i < va.count; i++) {
+			voice_t * v = va.voices + i;
+			if (v->held != held)
+				continue;
+			int32_t att = voice_attenuation(va, *v);
+			if (att > best_att || (att == best_att && v->age < best->age)) {
+				best = v;
+				best_att = att;
+			}
+		}
+	}
+	return best;
+}
+
+void voices_init(voice_allocator_t &va, Handler * synth, bool four_op)
+{
+	va = voice_allocator_t{};
+	va.synth = synth;
+	va.four_op = four_op;
+	va.bend_range = 2;
+	// The patch channel stays out of the pool so velocity never changes the patch
+	uint8_t channels = four_op ? 6 : 18;
+	for (uint8_t i = 0; i < channels; i++) {
+		uint8_t channel = four_op ? kFourOpChannels[i] : i;
+		if (channel == va.patch_channel)
+			continue;
+		va.voices[va.count].channel = channel;
+		va.voices[va.count].note = kNoNote;
+		va.count++;
+	}
+	// Channels 9-17 only play in opl3 mode
+	synth->WriteReg(0x105, 0x01);
+	if (four_op)
+		synth->WriteReg(0x104, 0x3f);
+}
+
+void voices_note_on(voice_allocator_t &va, uint8_t midi_channel, uint8_t note, uint8_t velocity)
+{
+	midi_channel &= 0x0f;
+	if (velocity == 0) {
+		voices_note_off(va, midi_channel, note);
+		return;
+	}
+	voice_t * v = find_voice(va, midi_channel, note);
+	if (!v)
+		v = allocate_voice(va);
+	// Key off first so the envelope restarts on a stolen or retriggered voice
+	if (v->note != kNoNote)
+		write_frequency(va, *v, false);
+	v->note = note;
+	v->midi_channel = midi_channel;
+	v->held = 1;
+	v->velocity = velocity;
+	v->age = ++va.clock;
+	copy_patch(va, *v, velocity);
+	write_frequency(va, *v, true);
+}
+
+void voices_note_off(voice_allocator_t &va, uint8_t midi_channel, uint8_t note)
+{
+	voice_t * v = find_voice(va, midi_channel & 0x0f, note);
+	if (!v)
+		return;
+	v->held = 0;
+	v->age = ++va.clock;
+	write_frequency(va, *v, false);
+}
+
+void voices_pitch_bend(voice_allocator_t &va, uint8_t midi_channel, int16_t value)
+{
+	midi_channel &= 0x0f;
+	va.bend[midi_channel] = value;
+	for (uint8_t i = 0; i < va.count; i++) {
+		voice_t * v = va.voices + i;
+		// Released voices keep bending while their tail rings out
+		if (v->note != kNoNote && v->midi_channel == midi_channel)
+			write_frequency(va, *v, v->held);
+	}
+}
+
+void voices_all_off(voice_allocator_t &va)
+{
+	for (uint8_t i = 0; i < va.count; i++) {
+		voice_t * v = va.voices + i;
+		if (v->held) {
+			v->held = 0;
+			write_frequency(va, *v, false);
+		}
+	}
+}
+
+void voices_update_patch(voice_allocator_t &va)
+{
+	for (uint8_t i = 0; i < va.count; i++) {
+		const voice_t * v = va.voices + i;
+		// Released voices take it too while their tail rings out
+		if (v->note != kNoNote && !voice_off(va, *v))
+			copy_patch(va, *v, v->velocity);
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef OPERATIC_VOICES_H
+#define OPERATIC_VOICES_H
+
+#include <stdint.h>
+
+#include "dbopl.h"
+
+// Maps notes onto the OPL channels of a DBOPL::Handler. Every voice is a
+// 2-op channel or, in four-op mode, a 4-op pair. New notes copy the patch
+// currently loaded in the patch channel (0), which is left out of the voice
+// pool, and steal voices based on the live envelope state of the chip.
+// voices_update_patch carries later patch edits over to the sounding notes.
+//
+// None of these functions lock anything; callers must hold whatever lock
+// protects the handler.
+
+static const uint8_t kMaxVoices = 18;
+static const uint8_t kNoNote = 0xff;
+
+struct voice_t
+{
+	uint8_t channel;      // register channel, 0-17
+	uint8_t note;         // kNoNote when the voice never played
+	uint8_t midi_channel;
+	uint8_t held;         // key is down
+	uint8_t velocity;     // of the last note-on
+	uint32_t age;         // allocation clock of the last note-on or note-off
+};
+
+struct voice_allocator_t
+{
+	DBOPL::Handler * synth;
+	voice_t voices[kMaxVoices];
+	uint8_t count;
+	bool four_op;
+	uint8_t patch_channel;
+	int16_t bend[16];     // per MIDI channel, -8192..8191
+	uint8_t bend_range;   // semitones
+	uint32_t clock;
+};
+
+void voices_init(voice_allocator_t &va, DBOPL::Handler * synth, bool four_op);
+void voices_note_on(voice_allocator_t &va, uint8_t midi_channel, uint8_t note, uint8_t velocity);
+void voices_note_off(voice_allocator_t &va, uint8_t midi_channel, uint8_t note);
+void voices_pitch_bend(voice_allocator_t &va, uint8_t midi_channel, int16_t value);
+void voices_all_off(voice_allocator_t &va);
+// Copy the patch channel again onto every voice still sounding
+void voices_update_patch(voice_allocator_t &va);
+
+#endif